@@ -81,6 +81,8 @@ typedef struct {
                              layer) also knows about the gap */
   ogg_int64_t   granulepos;
 
+  unsigned char *body_owned;     /* our buffer while body_data points into
+                                    a page (ogg_stream_pagein_inplace) */
 } ogg_stream_state;
 
 /* ogg_packet is used to encapsulate the data and metadata belonging
@@ -110,6 +112,8 @@ typedef struct {
   int unsynced;
   int headerbytes;
   int bodybytes;
+
+  int wrapped;          /* data belongs to the caller (ogg_sync_wrap) */
 } ogg_sync_state;
 
 /* Ogg BITSTREAM PRIMITIVES: bitstream ************************/
@@ -172,9 +176,12 @@ extern int      ogg_sync_check(ogg_sync_state *oy);
 
 extern char    *ogg_sync_buffer(ogg_sync_state *oy, long size);
 extern int      ogg_sync_wrote(ogg_sync_state *oy, long bytes);
+extern int      ogg_sync_wrap(ogg_sync_state *oy, const unsigned char *data, long size);
 extern long     ogg_sync_pageseek(ogg_sync_state *oy,ogg_page *og);
 extern int      ogg_sync_pageout(ogg_sync_state *oy, ogg_page *og);
 extern int      ogg_stream_pagein(ogg_stream_state *os, ogg_page *og);
+extern int      ogg_stream_pagein_inplace(ogg_stream_state *os, ogg_page *og);
+extern int      ogg_crc_set_simd(int enabled);
 extern int      ogg_stream_packetout(ogg_stream_state *os,ogg_packet *op);
 extern int      ogg_stream_packetpeek(ogg_stream_state *os,ogg_packet *op);
 
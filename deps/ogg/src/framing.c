@@ -28,6 +28,34 @@
 #include <string.h>
 #include <ogg/ogg.h>
 
+/* x86 acceleration: SSE2 capture pattern search when the compiler
+   targets SSE2, and a PCLMULQDQ page CRC chosen at runtime via CPUID */
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  include <emmintrin.h>
+#  include <tmmintrin.h>
+#  include <wmmintrin.h>
+#  define OGG_X86_CLMUL 1
+#  ifdef __clang__
+#    define OGG_TARGET_CLMUL __attribute__((target("sse2,ssse3,pclmul")))
+#  else
+#    define OGG_TARGET_CLMUL
+#  endif
+#  if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define OGG_SSE2 1
+#  endif
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#  include <cpuid.h>
+#  include <emmintrin.h>
+#  include <tmmintrin.h>
+#  include <wmmintrin.h>
+#  define OGG_X86_CLMUL 1
+#  define OGG_TARGET_CLMUL __attribute__((target("sse2,ssse3,pclmul")))
+#  if defined(__SSE2__)
+#    define OGG_SSE2 1
+#  endif
+#endif
+
 /* A complete description of Ogg framing exists in docs/framing.html */
 
 int ogg_page_version(const ogg_page *og){
@@ -161,6 +189,7 @@ int ogg_stream_check(ogg_stream_state *os){
 /* _clear does not free os, only the non-flat storage within */
 int ogg_stream_clear(ogg_stream_state *os){
   if(os){
+    if(os->body_owned)os->body_data=os->body_owned;
     if(os->body_data)_ogg_free(os->body_data);
     if(os->lacing_vals)_ogg_free(os->lacing_vals);
     if(os->granule_vals)_ogg_free(os->granule_vals);
@@ -202,6 +231,25 @@ static int _os_body_expand(ogg_stream_state *os,long needed){
   return 0;
 }
 
+/* Stop referencing the last in-place page: take our own buffer back,
+   copying in whatever part of the page has not been returned yet (a
+   packet continued on the next page, or packets not yet read out) */
+static int _os_body_unborrow(ogg_stream_state *os){
+  unsigned char *page=os->body_data+os->body_returned;
+  long left=os->body_fill-os->body_returned;
+
+  os->body_data=os->body_owned;
+  os->body_owned=NULL;
+  os->body_fill=0;
+  os->body_returned=0;
+  if(left>0){
+    if(_os_body_expand(os,left)) return -1;
+    memcpy(os->body_data,page,left);
+    os->body_fill=left;
+  }
+  return 0;
+}
+
 static int _os_lacing_expand(ogg_stream_state *os,long needed){
   if(os->lacing_storage-needed<=os->lacing_fill){
     long lacing_storage;
@@ -252,6 +300,150 @@ static ogg_uint32_t _os_update_crc(ogg_uint32_t crc, unsigned char *buffer, int
   return crc;
 }
 
+#ifdef OGG_X86_CLMUL
+/* Carry-less multiply CRC, after Intel's "Fast CRC Computation for
+   Generic Polynomials Using PCLMULQDQ". The Ogg CRC is unreflected, so
+   each 16 byte block is byte swapped into a 128 bit polynomial with the
+   first byte's MSB as the highest term. Blocks are folded forward with
+   x^n mod P constants until one 128 bit remainder is left, which is
+   congruent to the data folded so far; that and the last few bytes go
+   through the tables. */
+
+static int _os_crc_clmul_allowed=1;
+
+static int _os_crc_clmul_supported(void){
+  static int supported=-1;
+  if(!_os_crc_clmul_allowed)return 0;
+  if(supported<0){
+    unsigned int ecx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info,1);
+    ecx=(unsigned int)info[2];
+#else
+    unsigned int eax,ebx,edx;
+    if(!__get_cpuid(1,&eax,&ebx,&ecx,&edx))ecx=0;
+#endif
+    /* PCLMULQDQ is ECX bit 1, SSSE3 (pshufb) bit 9 */
+    supported=(ecx&(1u<<1))&&(ecx&(1u<<9));
+  }
+  return supported;
+}
+
+OGG_TARGET_CLMUL
+static __m128i _os_crc_fold(__m128i x,__m128i k,__m128i next){
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x,k,0x11),
+                                     _mm_clmulepi64_si128(x,k,0x00)),next);
+}
+
+OGG_TARGET_CLMUL
+static ogg_uint32_t _os_update_crc_clmul(ogg_uint32_t crc, unsigned char *buffer, int size){
+  const __m128i swap=_mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  /* x^192, x^128 mod P: fold one block onto the next */
+  const __m128i k1=_mm_set_epi32(0,(int)0xc5b9cd4cu,0,(int)0xe8a45605u);
+  /* x^576, x^512 mod P: fold a block onto the one four blocks on */
+  const __m128i k4=_mm_set_epi32(0,(int)0x8833794cu,0,(int)0xe6228b11u);
+  unsigned char rest[16];
+  __m128i x0,x1,x2,x3;
+  int i;
+
+  x0=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer),swap);
+  /* the running CRC is added to the first four bytes, as in the table code */
+  x0=_mm_xor_si128(x0,_mm_set_epi32((int)crc,0,0,0));
+  buffer+=16;
+  size-=16;
+
+  if(size>=112){
+    x1=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer),swap);
+    x2=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer+16)),swap);
+    x3=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer+32)),swap);
+    buffer+=48;
+    size-=48;
+    while(size>=64){
+      x0=_os_crc_fold(x0,k4,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer),swap));
+      x1=_os_crc_fold(x1,k4,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer+16)),swap));
+      x2=_os_crc_fold(x2,k4,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer+32)),swap));
+      x3=_os_crc_fold(x3,k4,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer+48)),swap));
+      buffer+=64;
+      size-=64;
+    }
+    x0=_os_crc_fold(x0,k1,x1);
+    x0=_os_crc_fold(x0,k1,x2);
+    x0=_os_crc_fold(x0,k1,x3);
+  }
+
+  while(size>=16){
+    x0=_os_crc_fold(x0,k1,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer),swap));
+    buffer+=16;
+    size-=16;
+  }
+
+  _mm_storeu_si128((__m128i *)rest,_mm_shuffle_epi8(x0,swap));
+  crc=0;
+  for(i=0;i<16;i++)
+    crc=(crc<<8)^crc_lookup[0][((crc >> 24)&0xff)^rest[i]];
+  while (size--)
+    crc=(crc<<8)^crc_lookup[0][((crc >> 24)&0xff)^*buffer++];
+  return crc;
+}
+#endif
+
+/* Local addition: turn the PCLMULQDQ CRC off, or back on where the CPU
+   has it, eg to compare it against the tables.  Returns whether it is in
+   use afterwards. */
+int ogg_crc_set_simd(int enabled){
+#ifdef OGG_X86_CLMUL
+  _os_crc_clmul_allowed=enabled!=0;
+  return _os_crc_clmul_supported();
+#else
+  (void)enabled;
+  return 0;
+#endif
+}
+
+static ogg_uint32_t _os_update_crc_fast(ogg_uint32_t crc, unsigned char *buffer, int size){
+#ifdef OGG_X86_CLMUL
+  /* below a few blocks the table code is as quick */
+  if(size>=64&&_os_crc_clmul_supported())
+    return _os_update_crc_clmul(crc,buffer,size);
+#endif
+  return _os_update_crc(crc,buffer,size);
+}
+
+/* Find the next "OggS" in [p,end). If there is none, returns the first
+   'O' in the last three bytes, where a pattern may yet be completed by
+   more data, or end. */
+static unsigned char *_ogg_find_capture(unsigned char *p, unsigned char *end){
+#ifdef OGG_SSE2
+  const __m128i cO=_mm_set1_epi8('O');
+  const __m128i cg=_mm_set1_epi8('g');
+  const __m128i cS=_mm_set1_epi8('S');
+  /* 16 candidate positions per step, each needing 4 bytes */
+  while(end-p>=19){
+    __m128i m=_mm_and_si128(
+      _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),cO),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+1)),cg)),
+      _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+2)),cg),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+3)),cS)));
+    int mask=_mm_movemask_epi8(m);
+    if(mask){
+#ifdef _MSC_VER
+      unsigned long first;
+      _BitScanForward(&first,(unsigned long)mask);
+      return p+first;
+#else
+      return p+__builtin_ctz((unsigned int)mask);
+#endif
+    }
+    p+=16;
+  }
+#endif
+  for(;end-p>=4;p++)
+    if(p[0]=='O'&&p[1]=='g'&&p[2]=='g'&&p[3]=='S')return p;
+  p=memchr(p,'O',end-p);
+  return p?p:end;
+}
+
 void ogg_page_checksum_set(ogg_page *og){
   if(og){
     ogg_uint32_t crc_reg=0;
@@ -262,8 +454,8 @@ void ogg_page_checksum_set(ogg_page *og){
     og->header[24]=0;
     og->header[25]=0;
 
-    crc_reg=_os_update_crc(crc_reg,og->header,og->header_len);
-    crc_reg=_os_update_crc(crc_reg,og->body,og->body_len);
+    crc_reg=_os_update_crc_fast(crc_reg,og->header,og->header_len);
+    crc_reg=_os_update_crc_fast(crc_reg,og->body,og->body_len);
 
     og->header[22]=(unsigned char)(crc_reg&0xff);
     og->header[23]=(unsigned char)((crc_reg>>8)&0xff);
@@ -565,7 +757,7 @@ int ogg_sync_init(ogg_sync_state *oy){
 /* clear non-flat storage within */
 int ogg_sync_clear(ogg_sync_state *oy){
   if(oy){
-    if(oy->data)_ogg_free(oy->data);
+    if(oy->data && !oy->wrapped)_ogg_free(oy->data);
     memset(oy,0,sizeof(*oy));
   }
   return(0);
@@ -586,6 +778,7 @@ int ogg_sync_check(ogg_sync_state *oy){
 
 char *ogg_sync_buffer(ogg_sync_state *oy, long size){
   if(ogg_sync_check(oy)) return NULL;
+  if(oy->wrapped) return NULL; /* caller's buffer; nothing to write into */
 
   /* first, clear out any space that has been previously returned */
   if(oy->returned){
@@ -623,11 +816,40 @@ char *ogg_sync_buffer(ogg_sync_state *oy, long size){
 
 int ogg_sync_wrote(ogg_sync_state *oy, long bytes){
   if(ogg_sync_check(oy))return -1;
+  if(oy->wrapped)return -1;
   if(oy->fill+bytes>oy->storage)return -1;
   oy->fill+=bytes;
   return(0);
 }
 
+/* Zero-copy input: instead of copying data in through
+   ogg_sync_buffer()/ogg_sync_wrote(), point the sync state at a
+   contiguous caller-owned buffer (typically a mapped file) holding
+   size bytes.  Pages are found and verified in place and the
+   ogg_page pointers returned by pageseek/pageout point straight into
+   it; the buffer is never written, so a read-only mapping is fine.
+   The caller keeps the buffer alive for as long as the sync state
+   and any page taken from it are in use.
+
+   Any internal buffer is released.  Calling it again re-points the
+   state (eg, after a seek); ogg_sync_reset() empties the window and
+   ogg_sync_clear() leaves the caller's buffer alone. */
+int ogg_sync_wrap(ogg_sync_state *oy, const unsigned char *data, long size){
+  if(ogg_sync_check(oy))return -1;
+  if(size<0 || size>INT_MAX)return -1;
+  if(oy->data && !oy->wrapped)_ogg_free(oy->data);
+
+  oy->data=(unsigned char *)data;
+  oy->storage=(int)size;
+  oy->fill=(int)size;
+  oy->returned=0;
+  oy->unsynced=0;
+  oy->headerbytes=0;
+  oy->bodybytes=0;
+  oy->wrapped=1;
+  return(0);
+}
+
 /* sync the stream.  This is meant to be useful for finding page
    boundaries.
 
@@ -664,29 +886,25 @@ long ogg_sync_pageseek(ogg_sync_state *oy,ogg_page *og){
 
   if(oy->bodybytes+oy->headerbytes>bytes)return(0);
 
-  /* The whole test page is buffered.  Verify the checksum */
+  /* The whole test page is buffered.  Verify the checksum.  The CRC
+     is computed with the checksum field read as zero rather than
+     zeroing it in place, so the page data is never written; a wrapped
+     buffer may be a read-only mapping. */
   {
-    /* Grab the checksum bytes, set the header field to zero */
-    char chksum[4];
-    ogg_page log;
-
-    memcpy(chksum,page+22,4);
-    memset(page+22,0,4);
+    static unsigned char zero[4];
+    ogg_uint32_t crc_reg=0;
+    ogg_uint32_t chksum=page[22]|(page[23]<<8)|(page[24]<<16)|
+      ((ogg_uint32_t)page[25]<<24);
 
-    /* set up a temp page struct and recompute the checksum */
-    log.header=page;
-    log.header_len=oy->headerbytes;
-    log.body=page+oy->headerbytes;
-    log.body_len=oy->bodybytes;
-    ogg_page_checksum_set(&log);
+    crc_reg=_os_update_crc_fast(crc_reg,page,22);
+    crc_reg=_os_update_crc_fast(crc_reg,zero,4);
+    crc_reg=_os_update_crc_fast(crc_reg,page+26,oy->headerbytes-26);
+    crc_reg=_os_update_crc_fast(crc_reg,page+oy->headerbytes,oy->bodybytes);
 
     /* Compare */
-    if(memcmp(chksum,page+22,4)){
+    if(crc_reg!=chksum){
       /* D'oh.  Mismatch! Corrupt page (or miscapture and not a page
          at all) */
-      /* replace the computed checksum with the one actually read in */
-      memcpy(page+22,chksum,4);
-
 #ifndef DISABLE_CRC
       /* Bad checksum. Lose sync */
       goto sync_fail;
@@ -716,9 +934,7 @@ long ogg_sync_pageseek(ogg_sync_state *oy,ogg_page *og){
   oy->bodybytes=0;
 
   /* search for possible capture */
-  next=memchr(page+1,'O',bytes-1);
-  if(!next)
-    next=oy->data+oy->fill;
+  next=_ogg_find_capture(page+1,oy->data+oy->fill);
 
   oy->returned=(int)(next-oy->data);
   return((long)-(next-page));
@@ -768,7 +984,7 @@ int ogg_sync_pageout(ogg_sync_state *oy, ogg_page *og){
 /* add the incoming page to the stream state; we decompose the page
    into packet segments here as well. */
 
-int ogg_stream_pagein(ogg_stream_state *os, ogg_page *og){
+static int _os_pagein(ogg_stream_state *os, ogg_page *og, int inplace){
   unsigned char *header=og->header;
   unsigned char *body=og->body;
   long           bodysize=og->body_len;
@@ -784,6 +1000,7 @@ int ogg_stream_pagein(ogg_stream_state *os, ogg_page *og){
   int segments=header[26];
 
   if(ogg_stream_check(os)) return -1;
+  if(os->body_owned && _os_body_unborrow(os)) return -1;
 
   /* clean up 'returned data' */
   {
@@ -854,9 +1071,16 @@ int ogg_stream_pagein(ogg_stream_state *os, ogg_page *og){
   }
 
   if(bodysize){
-    if(_os_body_expand(os,bodysize)) return -1;
-    memcpy(os->body_data+os->body_fill,body,bodysize);
-    os->body_fill+=bodysize;
+    if(inplace && os->body_fill==0){
+      /* nothing carried over; packets can point into the page itself */
+      os->body_owned=os->body_data;
+      os->body_data=body;
+      os->body_fill=bodysize;
+    }else{
+      if(_os_body_expand(os,bodysize)) return -1;
+      memcpy(os->body_data+os->body_fill,body,bodysize);
+      os->body_fill+=bodysize;
+    }
   }
 
   {
@@ -897,6 +1121,21 @@ int ogg_stream_pagein(ogg_stream_state *os, ogg_page *og){
   return(0);
 }
 
+int ogg_stream_pagein(ogg_stream_state *os, ogg_page *og){
+  return _os_pagein(os,og,0);
+}
+
+/* As ogg_stream_pagein(), but when no partial packet is carried over
+   from the previous page the body is not copied: packets returned by
+   packetout/packetpeek point into the page itself.  Only for pages in
+   memory that outlives those packets, eg. from a sync state set up
+   with ogg_sync_wrap().  The stream copies out anything it still
+   needs on the next pagein, so page memory only has to last until
+   the packets have been consumed. */
+int ogg_stream_pagein_inplace(ogg_stream_state *os, ogg_page *og){
+  return _os_pagein(os,og,1);
+}
+
 /* clear things to an initial state.  Good to call, eg, before seeking */
 int ogg_sync_reset(ogg_sync_state *oy){
   if(ogg_sync_check(oy))return -1;
@@ -912,6 +1151,10 @@ int ogg_sync_reset(ogg_sync_state *oy){
 int ogg_stream_reset(ogg_stream_state *os){
   if(ogg_stream_check(os)) return -1;
 
+  if(os->body_owned){
+    os->body_data=os->body_owned;
+    os->body_owned=NULL;
+  }
   os->body_fill=0;
   os->body_returned=0;
 
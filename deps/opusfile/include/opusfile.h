@@ -1093,6 +1093,9 @@ OP_WARN_UNUSED_RESULT OggOpusFile *op_open_file(const char *_path,int *_error)
  OP_ARG_NONNULL(1);
 
 /**Open a stream from a memory buffer.
+   Multi-page comment headers are skipped by their page headers and only
+    parsed when op_tags() asks for them, so large embedded tags cost almost
+    nothing to open.
    \param      _data  The memory buffer to open.
    \param      _size  The number of bytes in the buffer.
    \param[out] _error Returns 0 on success, or a failure code on error.
@@ -1418,6 +1421,50 @@ int op_test_open(OggOpusFile *_of) OP_ARG_NONNULL(1);
    \param _of The \c OggOpusFile to free.*/
 void op_free(OggOpusFile *_of);
 
+/**Open a new stream in an existing \c OggOpusFile, recycling its memory.
+   This closes the stream \a _of was reading, exactly as op_free() would, and
+    then behaves like op_open_callbacks() on the new stream.
+   The Opus decoder, the decode buffer, and the Ogg framing buffers are kept,
+    so when the new stream has the same channel layout as the old one, the
+    decoder is re-initialized in place and the open allocates no new decoder
+    state.
+   \param _of            The \c OggOpusFile to reuse.
+                         It must have been fully opened (not merely tested),
+                          or emptied by a failed call to one of these
+                          functions.
+   \param _stream        The stream to read from (e.g., a <code>FILE *</code>).
+   \param _cb            The callbacks with which to access the stream.
+   \param _initial_data  An initial buffer of data from the start of the
+                          stream.
+   \param _initial_bytes The number of bytes in \a _initial_data.
+   \return 0 on success, or one of the failure codes listed for
+             op_open_callbacks().
+            On failure the stream is not closed, and \a _of is left empty:
+             the only valid operations on it are op_free() and another reopen.*/
+int op_reopen_callbacks(OggOpusFile *_of,void *_stream,
+ const OpusFileCallbacks *_cb,const unsigned char *_initial_data,
+ size_t _initial_bytes) OP_ARG_NONNULL(1) OP_ARG_NONNULL(3);
+
+/**Open a file in an existing \c OggOpusFile, recycling its memory.
+   See op_reopen_callbacks() for what is kept.
+   \param _of   The \c OggOpusFile to reuse.
+   \param _path The path to the file to open.
+   \return 0 on success, #OP_EFAULT if the file could not be opened, or one of
+             the other failure codes from op_open_callbacks() otherwise.
+            On failure \a _of is left empty.*/
+int op_reopen_file(OggOpusFile *_of,const char *_path)
+ OP_ARG_NONNULL(1) OP_ARG_NONNULL(2);
+
+/**Open a memory buffer in an existing \c OggOpusFile, recycling its memory.
+   See op_reopen_callbacks() for what is kept.
+   \param _of   The \c OggOpusFile to reuse.
+   \param _data The memory buffer to open.
+   \param _size The number of bytes in the buffer.
+   \return 0 on success, or a failure code from op_open_callbacks().
+            On failure \a _of is left empty.*/
+int op_reopen_memory(OggOpusFile *_of,const unsigned char *_data,
+ size_t _size) OP_ARG_NONNULL(1);
+
 /*@}*/
 /*@}*/
 
@@ -1557,6 +1604,13 @@ const OpusHead *op_head(const OggOpusFile *_of,int _li) OP_ARG_NONNULL(1);
     chained) Ogg Opus stream.
    This function may be called on partially-opened streams, but it will always
     return the tags from the Opus stream in the first link.
+   Streams opened from memory do not read a comment header that spans more
+    than one page (typically one carrying embedded cover art) at open time.
+   It is parsed the first time this function asks for it; if it turns out to
+    be invalid, the link reports empty tags.
+   Since that first call fills in the link, this function, unlike the other
+    getters, must not be called on the same \c OggOpusFile from two threads
+    at once.
    \param _of The \c OggOpusFile from which to retrieve the comment header
                information.
    \param _li The index of the link whose comment header information should be
@@ -150,6 +150,9 @@ struct OggOpusLink{
   OpusHead     head;
   /*The contents of the comment header.*/
   OpusTags     tags;
+  /*The byte offset to read the comment header from when it has been skipped
+     at open time and not yet parsed (see op_load_tags()), or -1.*/
+  opus_int64   tags_offset;
 };
 
 struct OggOpusFile{
@@ -157,6 +160,12 @@ struct OggOpusFile{
   OpusFileCallbacks  callbacks;
   /*A FILE *, memory buffer, etc.*/
   void              *stream;
+  /*The contents of stream, if it is a memory stream, or NULL otherwise.
+    Memory streams are parsed in place instead of being read into the sync
+     buffer (see op_get_mem_data()).*/
+  const unsigned char *mem_data;
+  /*The size of mem_data.*/
+  opus_int64         mem_size;
   /*Whether or not we can seek with this stream.*/
   int                seekable;
   /*The number of links in this chained Ogg Opus file.*/
@@ -202,6 +211,9 @@ struct OggOpusFile{
   ogg_int64_t        samples_tracked;
   /*Takes physical pages and welds them into a logical stream of packets.*/
   ogg_stream_state   os;
+  /*The stream state op_open_seekable2() scans the links with, kept between
+     opens so op_reopen_callbacks() can reuse its buffers.*/
+  ogg_stream_state   os_spare;
   /*Re-timestamped packets from a single page.
     Buffering these relies on the undocumented libogg behavior that ogg_packet
      pointers remain valid until the next page is submitted to the
@@ -213,6 +225,9 @@ struct OggOpusFile{
   int                op_count;
   /*Central working state for the packet-to-PCM decoder.*/
   OpusMSDecoder     *od;
+  /*The number of bytes allocated for od.
+    The decoder is re-initialized in place whenever a new layout fits.*/
+  opus_int32         od_size;
   /*The application-provided packet decode callback.*/
   op_decode_cb_func  decode_cb;
   /*The application-provided packet decode callback context.*/
@@ -227,6 +242,8 @@ struct OggOpusFile{
   unsigned char      od_mapping[OP_NCHANNELS_MAX];
   /*The buffered data for one decoded packet.*/
   op_sample         *od_buffer;
+  /*The number of channels od_buffer has room for.*/
+  int                od_buffer_channels;
   /*The current position in the decoded buffer.*/
   int                od_buffer_pos;
   /*The number of valid samples in the decoded buffer.*/
@@ -256,4 +273,7 @@ struct OggOpusFile{
 
 int op_strncasecmp(const char *_a,const char *_b,int _n);
 
+const unsigned char *op_mem_stream_data(const OpusFileCallbacks *_cb,
+ void *_stream,opus_int64 *_size);
+
 #endif
@@ -139,6 +139,40 @@ int op_test(OpusHead *_head,
 
 /*The read/seek functions track absolute position within the stream.*/
 
+/*Get the current position indicator of the underlying stream.
+  This should be the same as the value reported by tell().*/
+static opus_int64 op_position(const OggOpusFile *_of){
+  /*The current position indicator is _not_ simply offset.
+    We may also have unprocessed, buffered data in the sync state.*/
+  return _of->offset+_of->oy.fill-_of->oy.returned;
+}
+
+/*Zero-copy version of op_get_data() for memory streams.
+  Rather than copying the next chunk into the sync buffer, point the sync
+   state at the rest of the caller's buffer, starting from the first byte it
+   has not consumed yet.
+  Pages are then verified in place and submitted with
+   ogg_stream_pagein_inplace(), so packets point straight into the caller's
+   buffer as well and each input byte is only touched once.
+  Return: The number of bytes newly made available, or 0 on EOF.*/
+static int op_get_mem_data(OggOpusFile *_of){
+  opus_int64 position;
+  opus_int64 nbytes;
+  position=op_position(_of);
+  if(position>=_of->mem_size)return 0;
+  nbytes=OP_MIN(_of->mem_size-_of->offset,INT_MAX);
+  if(OP_UNLIKELY(ogg_sync_wrap(&_of->oy,_of->mem_data+_of->offset,
+   (long)nbytes)<0)){
+    return OP_EFAULT;
+  }
+  /*Keep the stream position in step with op_position().*/
+  if(OP_UNLIKELY((*_of->callbacks.seek)(_of->stream,
+   _of->offset+nbytes,SEEK_SET)<0)){
+    return OP_EREAD;
+  }
+  return (int)(_of->offset+nbytes-position);
+}
+
 /*Read a little more data from the file/pipe into the ogg_sync framer.
   _nbytes: The maximum number of bytes to read.
   Return: A positive number of bytes read on success, 0 on end-of-file, or a
@@ -147,6 +181,7 @@ static int op_get_data(OggOpusFile *_of,int _nbytes){
   unsigned char *buffer;
   int            nbytes;
   OP_ASSERT(_nbytes>0);
+  if(_of->mem_data!=NULL)return op_get_mem_data(_of);
   buffer=(unsigned char *)ogg_sync_buffer(&_of->oy,_nbytes);
   nbytes=(int)(*_of->callbacks.read)(_of->stream,buffer,_nbytes);
   OP_ASSERT(nbytes<=_nbytes);
@@ -166,14 +201,6 @@ static int op_seek_helper(OggOpusFile *_of,opus_int64 _offset){
   return 0;
 }
 
-/*Get the current position indicator of the underlying stream.
-  This should be the same as the value reported by tell().*/
-static opus_int64 op_position(const OggOpusFile *_of){
-  /*The current position indicator is _not_ simply offset.
-    We may also have unprocessed, buffered data in the sync state.*/
-  return _of->offset+_of->oy.fill-_of->oy.returned;
-}
-
 /*From the head of the stream, get the next page.
   _boundary specifies if the function is allowed to fetch more data from the
    stream (and how much) or only use internally buffered data.
@@ -227,6 +254,14 @@ static opus_int64 op_get_next_page(OggOpusFile *_of,ogg_page *_og,
   return OP_FALSE;
 }
 
+/*Submit a page to the current logical stream.
+  Pages from a memory stream stay valid for as long as the stream is open, so
+   their packets are left in place rather than copied.*/
+static int op_pagein(OggOpusFile *_of,ogg_page *_og){
+  if(_of->mem_data!=NULL)return ogg_stream_pagein_inplace(&_of->os,_og);
+  return ogg_stream_pagein(&_of->os,_og);
+}
+
 static int op_add_serialno(const ogg_page *_og,
  ogg_uint32_t **_serialnos,int *_nserialnos,int *_cserialnos){
   ogg_uint32_t *serialnos;
@@ -474,9 +509,97 @@ static opus_int64 op_get_last_page(OggOpusFile *_of,ogg_int64_t *_gp,
 
 /*Uses the local ogg_stream storage in _of.
   This is important for non-streaming input sources.*/
+/*Step over the comment header of a memory stream without reading it.
+  Pages in memory can be walked by their headers alone, so rather than
+   assembling the comment header (which may carry megabytes of embedded cover
+   art) we note where it starts, for op_load_tags(), and move on to the first
+   page after it.
+  _og: The first page after the BOS pages, just returned by op_get_next_page().
+  Return: 0 on success, or a negative value on error.*/
+static int op_skip_tags(OggOpusFile *_of,OpusTags *_tags,
+ opus_int64 *_tags_offset,ogg_page *_og){
+  ogg_uint32_t serialno;
+  opus_int64   offset;
+  opus_int64   size;
+  serialno=(ogg_uint32_t)_of->os.serialno;
+  offset=_of->offset-(_og->header_len+_og->body_len);
+  size=_of->mem_size;
+  *_tags_offset=offset;
+  for(;;){
+    ogg_page og;
+    int      nsegs;
+    int      end;
+    int      si;
+    if(OP_UNLIKELY(size-offset<27))return OP_EBADHEADER;
+    og.header=(unsigned char *)_of->mem_data+offset;
+    if(OP_UNLIKELY(memcmp(og.header,"OggS",4)!=0)
+     ||OP_UNLIKELY(ogg_page_version(&og)!=0)){
+      return OP_EBADHEADER;
+    }
+    nsegs=og.header[26];
+    if(OP_UNLIKELY(size-offset<27+nsegs))return OP_EBADHEADER;
+    og.header_len=27+nsegs;
+    og.body_len=0;
+    end=-1;
+    for(si=0;si<nsegs;si++){
+      og.body_len+=og.header[27+si];
+      if(end<0&&og.header[27+si]<255)end=si;
+    }
+    offset+=og.header_len+og.body_len;
+    if((ogg_uint32_t)ogg_page_serialno(&og)!=serialno){
+      /*If the link ends before we see the Opus comment header, abort.*/
+      if(OP_UNLIKELY(ogg_page_bos(&og)))return OP_EBADHEADER;
+      continue;
+    }
+    if(end>=0){
+      /*The comment header must end its page, as in op_fetch_headers_impl().*/
+      if(OP_UNLIKELY(end!=nsegs-1))return OP_EBADHEADER;
+      break;
+    }
+  }
+  if(OP_UNLIKELY(offset>size))return OP_EBADHEADER;
+  opus_tags_init(_tags);
+  ogg_stream_reset_serialno(&_of->os,serialno);
+  return op_seek_helper(_of,offset);
+}
+
+/*Parse a comment header skipped by op_skip_tags(), the first time it is
+   needed.
+  It is read straight from the memory stream, so this does not disturb the
+   decoder's position.
+  If it turns out to be invalid, the link is left with empty tags.*/
+static void op_load_tags(OggOpusFile *_of,int _li){
+  OggOpusLink      *link;
+  ogg_sync_state    oy;
+  ogg_stream_state  os;
+  ogg_page          og;
+  ogg_packet        op;
+  link=_of->links+_li;
+  if(OP_LIKELY(link->tags_offset<0))return;
+  ogg_sync_init(&oy);
+  ogg_stream_init(&os,(int)link->serialno);
+  if(ogg_sync_wrap(&oy,_of->mem_data+link->tags_offset,
+   (long)OP_MIN(_of->mem_size-link->tags_offset,LONG_MAX))>=0){
+    while(ogg_sync_pageout(&oy,&og)>0){
+      if((ogg_uint32_t)ogg_page_serialno(&og)!=link->serialno)continue;
+      ogg_stream_pagein(&os,&og);
+      if(ogg_stream_packetout(&os,&op)>0){
+        if(OP_UNLIKELY(opus_tags_parse(&link->tags,op.packet,op.bytes)<0)){
+          /*A tags packet that does not parse reads as no tags.*/
+          opus_tags_init(&link->tags);
+        }
+        break;
+      }
+    }
+  }
+  ogg_stream_clear(&os);
+  ogg_sync_clear(&oy);
+  link->tags_offset=-1;
+}
+
 static int op_fetch_headers_impl(OggOpusFile *_of,OpusHead *_head,
- OpusTags *_tags,ogg_uint32_t **_serialnos,int *_nserialnos,
- int *_cserialnos,ogg_page *_og){
+ OpusTags *_tags,opus_int64 *_tags_offset,ogg_uint32_t **_serialnos,
+ int *_nserialnos,int *_cserialnos,ogg_page *_og){
   ogg_packet op;
   int        ret;
   if(_serialnos!=NULL)*_nserialnos=0;
@@ -496,7 +619,7 @@ static int op_fetch_headers_impl(OggOpusFile *_of,OpusHead *_head,
          stream setup.
         We need a stream to get packets.*/
       ogg_stream_reset_serialno(&_of->os,ogg_page_serialno(_og));
-      ogg_stream_pagein(&_of->os,_og);
+      op_pagein(_of,_og);
       if(OP_LIKELY(ogg_stream_packetout(&_of->os,&op)>0)){
         ret=opus_head_parse(_head,op.packet,op.bytes);
         /*Found a valid Opus header.
@@ -517,8 +640,15 @@ static int op_fetch_headers_impl(OggOpusFile *_of,OpusHead *_head,
     }
   }
   if(OP_UNLIKELY(_of->ready_state!=OP_STREAMSET))return OP_ENOTFORMAT;
+  /*A comment header that does not fit in the page we already have is left
+     in place and parsed on demand.*/
+  if(_tags_offset!=NULL&&_of->mem_data!=NULL
+   &&(_of->os.serialno!=ogg_page_serialno(_og)
+   ||_og->header[_og->header_len-1]==255)){
+    return op_skip_tags(_of,_tags,_tags_offset,_og);
+  }
   /*If the first non-header page belonged to our Opus stream, submit it.*/
-  if(_of->os.serialno==ogg_page_serialno(_og))ogg_stream_pagein(&_of->os,_og);
+  if(_of->os.serialno==ogg_page_serialno(_og))op_pagein(_of,_og);
   /*Loop getting packets.*/
   for(;;){
     switch(ogg_stream_packetout(&_of->os,&op)){
@@ -533,7 +663,7 @@ static int op_fetch_headers_impl(OggOpusFile *_of,OpusHead *_head,
           }
           /*If this page belongs to the correct stream, go parse it.*/
           if(_of->os.serialno==ogg_page_serialno(_og)){
-            ogg_stream_pagein(&_of->os,_og);
+            op_pagein(_of,_og);
             break;
           }
           /*If the link ends before we see the Opus comment header, abort.*/
@@ -566,11 +696,14 @@ static int op_fetch_headers_impl(OggOpusFile *_of,OpusHead *_head,
   }
 }
 
+/*_tags_offset: Where to record the position of a comment header skipped by
+   op_skip_tags(), or NULL to always parse it now.*/
 static int op_fetch_headers(OggOpusFile *_of,OpusHead *_head,
- OpusTags *_tags,ogg_uint32_t **_serialnos,int *_nserialnos,
- int *_cserialnos,ogg_page *_og){
+ OpusTags *_tags,opus_int64 *_tags_offset,ogg_uint32_t **_serialnos,
+ int *_nserialnos,int *_cserialnos,ogg_page *_og){
   ogg_page og;
   int      ret;
+  if(_tags_offset!=NULL)*_tags_offset=-1;
   if(!_og){
     /*No need to clamp the boundary offset against _of->end, as all errors
        become OP_ENOTFORMAT.*/
@@ -581,8 +714,8 @@ static int op_fetch_headers(OggOpusFile *_of,OpusHead *_head,
     _og=&og;
   }
   _of->ready_state=OP_OPENED;
-  ret=op_fetch_headers_impl(_of,_head,_tags,_serialnos,_nserialnos,
-   _cserialnos,_og);
+  ret=op_fetch_headers_impl(_of,_head,_tags,_tags_offset,_serialnos,
+   _nserialnos,_cserialnos,_og);
   /*Revert back from OP_STREAMSET to OP_OPENED on failure, to prevent
      double-free of the tags in an unseekable stream.*/
   if(OP_UNLIKELY(ret<0))_of->ready_state=OP_OPENED;
@@ -877,7 +1010,7 @@ static int op_find_initial_pcm_offset(OggOpusFile *_of,
     /*Ignore pages from other streams (not strictly necessary, because of the
        checks in ogg_stream_pagein(), but saves some work).*/
     if(serialno!=(ogg_uint32_t)ogg_page_serialno(_og))continue;
-    ogg_stream_pagein(&_of->os,_og);
+    op_pagein(_of,_og);
     /*Bitrate tracking: add the header's bytes here.
       The body bytes are counted when we consume the packets.*/
     _of->bytes_tracked+=_og->header_len;
@@ -1265,7 +1398,8 @@ static int op_bisect_forward_serialno(OggOpusFile *_of,
       if(OP_UNLIKELY(ret<0))return ret;
     }
     ret=op_fetch_headers(_of,&links[nlinks].head,&links[nlinks].tags,
-     _serialnos,_nserialnos,_cserialnos,last!=next?NULL:&og);
+     &links[nlinks].tags_offset,_serialnos,_nserialnos,_cserialnos,
+     last!=next?NULL:&og);
     if(OP_UNLIKELY(ret<0))return ret;
     links[nlinks].offset=next;
     links[nlinks].data_offset=_of->offset;
@@ -1315,6 +1449,7 @@ static void op_update_gain(OggOpusFile *_of){
   switch(_of->gain_type){
     case OP_ALBUM_GAIN:{
       int album_gain_q8;
+      op_load_tags(_of,li);
       album_gain_q8=0;
       opus_tags_get_album_gain(&_of->links[li].tags,&album_gain_q8);
       gain_q8+=album_gain_q8;
@@ -1322,6 +1457,7 @@ static void op_update_gain(OggOpusFile *_of){
     }break;
     case OP_TRACK_GAIN:{
       int track_gain_q8;
+      op_load_tags(_of,li);
       track_gain_q8=0;
       opus_tags_get_track_gain(&_of->links[li].tags,&track_gain_q8);
       gain_q8+=track_gain_q8;
@@ -1364,11 +1500,26 @@ static int op_make_decode_ready(OggOpusFile *_of){
     opus_multistream_decoder_ctl(_of->od,OPUS_RESET_STATE);
   }
   else{
-    int err;
-    opus_multistream_decoder_destroy(_of->od);
-    _of->od=opus_multistream_decoder_create(48000,channel_count,
-     stream_count,coupled_count,head->mapping,&err);
-    if(_of->od==NULL)return OP_EFAULT;
+    opus_int32 size;
+    int        err;
+    /*Initialize the decoder in the memory we already have if it is large
+       enough (e.g., one kept by op_reopen_callbacks()), so switching between
+       streams with the same layout does not go back to the heap.*/
+    size=opus_multistream_decoder_get_size(stream_count,coupled_count);
+    if(OP_UNLIKELY(size<=0))return OP_EFAULT;
+    if(_of->od==NULL||_of->od_size<size){
+      _ogg_free(_of->od);
+      _of->od=(OpusMSDecoder *)_ogg_malloc(size);
+      _of->od_size=_of->od!=NULL?size:0;
+      if(OP_UNLIKELY(_of->od==NULL))return OP_EFAULT;
+    }
+    err=opus_multistream_decoder_init(_of->od,48000,channel_count,
+     stream_count,coupled_count,head->mapping);
+    if(OP_UNLIKELY(err!=OPUS_OK)){
+      /*Make sure the next call does not mistake this for a usable decoder.*/
+      _of->od_channel_count=0;
+      return OP_EFAULT;
+    }
     _of->od_stream_count=stream_count;
     _of->od_coupled_count=coupled_count;
     _of->od_channel_count=channel_count;
@@ -1443,10 +1594,14 @@ static int op_open_seekable2(OggOpusFile *_of){
   memcpy(op_start,_of->op,sizeof(*op_start)*start_op_count);
   OP_ASSERT((*_of->callbacks.tell)(_of->stream)==op_position(_of));
   ogg_sync_init(&_of->oy);
-  ogg_stream_init(&_of->os,-1);
+  if(_of->os_spare.body_data!=NULL){
+    *&_of->os=*&_of->os_spare;
+    ogg_stream_reset_serialno(&_of->os,-1);
+  }
+  else ogg_stream_init(&_of->os,-1);
   ret=op_open_seekable2_impl(_of);
-  /*Restore the old stream state.*/
-  ogg_stream_clear(&_of->os);
+  /*Restore the old stream state, keeping the scan state for the next open.*/
+  *&_of->os_spare=*&_of->os;
   ogg_sync_clear(&_of->oy);
   *&_of->oy=*&oy_start;
   *&_of->os=*&os_start;
@@ -1481,7 +1636,7 @@ static void op_decode_clear(OggOpusFile *_of){
 static void op_clear(OggOpusFile *_of){
   OggOpusLink *links;
   _ogg_free(_of->od_buffer);
-  if(_of->od!=NULL)opus_multistream_decoder_destroy(_of->od);
+  _ogg_free(_of->od);
   links=_of->links;
   if(!_of->seekable){
     if(_of->ready_state>OP_OPENED||_of->ready_state==OP_PARTOPEN){
@@ -1497,6 +1652,7 @@ static void op_clear(OggOpusFile *_of){
   _ogg_free(links);
   _ogg_free(_of->serialnos);
   ogg_stream_clear(&_of->os);
+  ogg_stream_clear(&_of->os_spare);
   ogg_sync_clear(&_of->oy);
   if(_of->callbacks.close!=NULL)(*_of->callbacks.close)(_of->stream);
 }
@@ -1508,15 +1664,18 @@ static int op_open1(OggOpusFile *_of,
   ogg_page *pog;
   int       seekable;
   int       ret;
-  memset(_of,0,sizeof(*_of));
   if(OP_UNLIKELY(_initial_bytes>(size_t)LONG_MAX))return OP_EFAULT;
   _of->end=-1;
   _of->stream=_stream;
   *&_of->callbacks=*_cb;
+  _of->mem_data=op_mem_stream_data(_cb,_stream,&_of->mem_size);
   /*At a minimum, we need to be able to read data.*/
   if(OP_UNLIKELY(_of->callbacks.read==NULL))return OP_EREAD;
-  /*Initialize the framing state.*/
-  ogg_sync_init(&_of->oy);
+  /*Initialize the framing state.
+    A structure recycled by op_reopen_callbacks() keeps its sync buffer, unless
+     that buffer belonged to the previous caller.*/
+  if(_of->oy.data!=NULL&&!_of->oy.wrapped)ogg_sync_reset(&_of->oy);
+  else ogg_sync_init(&_of->oy);
   /*Perhaps some data was previously read into a buffer for testing against
      other stream types.
     Allow initialization from this previously read data (especially as we may
@@ -1549,13 +1708,15 @@ static int op_open1(OggOpusFile *_of,
     Set up a 'single' (current) logical bitstream entry for partial open.*/
   _of->links=(OggOpusLink *)_ogg_malloc(sizeof(*_of->links));
   /*The serialno gets filled in later by op_fetch_headers().*/
-  ogg_stream_init(&_of->os,-1);
+  if(_of->os.body_data!=NULL)ogg_stream_reset_serialno(&_of->os,-1);
+  else ogg_stream_init(&_of->os,-1);
   pog=NULL;
   for(;;){
     /*Fetch all BOS pages, store the Opus header and all seen serial numbers,
       and load subsequent Opus setup headers.*/
     ret=op_fetch_headers(_of,&_of->links[0].head,&_of->links[0].tags,
-     &_of->serialnos,&_of->nserialnos,&_of->cserialnos,pog);
+     &_of->links[0].tags_offset,&_of->serialnos,&_of->nserialnos,
+     &_of->cserialnos,pog);
     if(OP_UNLIKELY(ret<0))break;
     _of->nlinks=1;
     _of->links[0].offset=0;
@@ -1605,6 +1766,7 @@ OggOpusFile *op_test_callbacks(void *_stream,const OpusFileCallbacks *_cb,
   of=(OggOpusFile *)_ogg_malloc(sizeof(*of));
   ret=OP_EFAULT;
   if(OP_LIKELY(of!=NULL)){
+    memset(of,0,sizeof(*of));
     ret=op_open1(of,_stream,_cb,_initial_data,_initial_bytes);
     if(OP_LIKELY(ret>=0)){
       if(_error!=NULL)*_error=0;
@@ -1702,6 +1864,116 @@ void op_free(OggOpusFile *_of){
   }
 }
 
+/*The number of channels the decoder scratch buffer needs room for.*/
+static int op_buffer_channels(const OggOpusFile *_of){
+  int nchannels_max;
+  if(_of->seekable){
+    const OggOpusLink *links;
+    int                nlinks;
+    int                li;
+    links=_of->links;
+    nlinks=_of->nlinks;
+    nchannels_max=1;
+    for(li=0;li<nlinks;li++){
+      nchannels_max=OP_MAX(nchannels_max,links[li].head.channel_count);
+    }
+  }
+  else nchannels_max=OP_NCHANNELS_MAX;
+  return nchannels_max;
+}
+
+int op_reopen_callbacks(OggOpusFile *_of,void *_stream,
+ const OpusFileCallbacks *_cb,const unsigned char *_initial_data,
+ size_t _initial_bytes){
+  OggOpusFile  keep;
+  int          ret;
+  /*Pull out the allocations that do not depend on the stream, then release
+     everything else the way op_free() would, including the old stream.*/
+  keep.od=_of->od;
+  keep.od_size=_of->od_size;
+  keep.od_stream_count=_of->od_stream_count;
+  keep.od_coupled_count=_of->od_coupled_count;
+  keep.od_channel_count=_of->od_channel_count;
+  memcpy(keep.od_mapping,_of->od_mapping,sizeof(keep.od_mapping));
+  keep.od_buffer=_of->od_buffer;
+  keep.od_buffer_channels=_of->od_buffer_channels;
+  *&keep.oy=*&_of->oy;
+  *&keep.os=*&_of->os;
+  *&keep.os_spare=*&_of->os_spare;
+  _of->od=NULL;
+  _of->od_buffer=NULL;
+  memset(&_of->oy,0,sizeof(_of->oy));
+  memset(&_of->os,0,sizeof(_of->os));
+  memset(&_of->os_spare,0,sizeof(_of->os_spare));
+  op_clear(_of);
+  memset(_of,0,sizeof(*_of));
+  _of->od=keep.od;
+  _of->od_size=keep.od_size;
+  _of->od_stream_count=keep.od_stream_count;
+  _of->od_coupled_count=keep.od_coupled_count;
+  _of->od_channel_count=keep.od_channel_count;
+  memcpy(_of->od_mapping,keep.od_mapping,sizeof(_of->od_mapping));
+  _of->od_buffer=keep.od_buffer;
+  _of->od_buffer_channels=keep.od_buffer_channels;
+  *&_of->oy=*&keep.oy;
+  *&_of->os=*&keep.os;
+  *&_of->os_spare=*&keep.os_spare;
+  ret=op_open1(_of,_stream,_cb,_initial_data,_initial_bytes);
+  if(OP_LIKELY(ret>=0)){
+    ret=op_open2(_of);
+    if(OP_LIKELY(ret>=0)){
+      /*The decode buffer is only sized for the old stream's channel count.
+        Drop it if this one needs more, and op_init_buffer() will replace it
+         on demand.*/
+      if(_of->od_buffer!=NULL
+       &&_of->od_buffer_channels<op_buffer_channels(_of)){
+        _ogg_free(_of->od_buffer);
+        _of->od_buffer=NULL;
+      }
+      return 0;
+    }
+  }
+  else{
+    /*Don't auto-close the stream on failure.*/
+    _of->callbacks.close=NULL;
+    op_clear(_of);
+  }
+  /*Leave an empty structure that op_free() can release.*/
+  memset(_of,0,sizeof(*_of));
+  return ret;
+}
+
+int op_reopen_file(OggOpusFile *_of,const char *_path){
+  OpusFileCallbacks  cb;
+  void              *stream;
+  int                ret;
+  stream=op_fopen(&cb,_path,"rb");
+  if(OP_UNLIKELY(stream==NULL)){
+    op_clear(_of);
+    memset(_of,0,sizeof(*_of));
+    return OP_EFAULT;
+  }
+  ret=op_reopen_callbacks(_of,stream,&cb,NULL,0);
+  if(OP_UNLIKELY(ret<0))(*cb.close)(stream);
+  return ret;
+}
+
+int op_reopen_memory(OggOpusFile *_of,const unsigned char *_data,
+ size_t _size){
+  OpusFileCallbacks  cb;
+  void              *stream;
+  int                ret;
+  stream=op_mem_stream_create(&cb,_data,_size);
+  if(OP_UNLIKELY(stream==NULL)){
+    op_clear(_of);
+    memset(_of,0,sizeof(*_of));
+    return OP_EFAULT;
+  }
+  ret=op_reopen_callbacks(_of,stream,&cb,NULL,0);
+  if(OP_UNLIKELY(ret<0))(*cb.close)(stream);
+  return ret;
+}
+
 int op_seekable(const OggOpusFile *_of){
   return _of->seekable;
 }
@@ -1771,6 +2043,11 @@ const OpusTags *op_tags(const OggOpusFile *_of,int _li){
     _li=0;
   }
   else if(_li<0)_li=_of->ready_state>=OP_STREAMSET?_of->cur_link:0;
+  /*Parsing a skipped comment header on demand does not change anything the
+     caller can observe, so cast away the const.
+    It does write the link, though, which is why op_tags() is documented as
+     not safe to call from two threads at once on the same file.*/
+  op_load_tags((OggOpusFile *)_of,_li);
   return &_of->links[_li].tags;
 }
 
@@ -1946,7 +2223,7 @@ static int op_fetch_and_process_page(OggOpusFile *_of,
         do{
           /*We're streaming.
             Fetch the two header packets, build the info struct.*/
-          ret=op_fetch_headers(_of,&links[0].head,&links[0].tags,
+          ret=op_fetch_headers(_of,&links[0].head,&links[0].tags,NULL,
            NULL,NULL,NULL,&og);
           if(OP_UNLIKELY(ret<0))return ret;
           /*op_find_initial_pcm_offset() will suppress any initial hole for us,
@@ -1977,7 +2254,7 @@ static int op_fetch_and_process_page(OggOpusFile *_of,
       if(OP_UNLIKELY(ret<0))return ret;
     }
     /*Extract all the packets from the current page.*/
-    ogg_stream_pagein(&_of->os,&og);
+    op_pagein(_of,&og);
     if(OP_LIKELY(_of->ready_state>=OP_INITSET)){
       opus_int32 total_duration;
       int        durations[255];
@@ -2237,7 +2514,7 @@ static int op_page_continues(const ogg_page *_og){
 /*A small helper to buffer the continued packet data from a page.*/
 static void op_buffer_continued_data(OggOpusFile *_of,ogg_page *_og){
   ogg_packet op;
-  ogg_stream_pagein(&_of->os,_og);
+  op_pagein(_of,_og);
   /*Drain any packets that did end on this page (and ignore holes).
     We only care about the continued packet data.*/
   while(ogg_stream_packetout(&_of->os,&op));
@@ -2470,7 +2747,7 @@ static int op_pcm_seek_page(OggOpusFile *_of,
         gp=has_packets?ogg_page_granulepos(&og):-1;
         if(gp==-1){
           if(buffering){
-            if(OP_LIKELY(!has_packets))ogg_stream_pagein(&_of->os,&og);
+            if(OP_LIKELY(!has_packets))op_pagein(_of,&og);
             else{
               /*If packets did end on this page, but we still didn't have a
                  valid granule position (in violation of the spec!), stop
@@ -2753,21 +3030,11 @@ void op_set_dither_enabled(OggOpusFile *_of,int _enabled){
    never need it.*/
 static int op_init_buffer(OggOpusFile *_of){
   int nchannels_max;
-  if(_of->seekable){
-    const OggOpusLink *links;
-    int                nlinks;
-    int                li;
-    links=_of->links;
-    nlinks=_of->nlinks;
-    nchannels_max=1;
-    for(li=0;li<nlinks;li++){
-      nchannels_max=OP_MAX(nchannels_max,links[li].head.channel_count);
-    }
-  }
-  else nchannels_max=OP_NCHANNELS_MAX;
+  nchannels_max=op_buffer_channels(_of);
   _of->od_buffer=(op_sample *)_ogg_malloc(
    sizeof(*_of->od_buffer)*nchannels_max*120*48);
   if(_of->od_buffer==NULL)return OP_EFAULT;
+  _of->od_buffer_channels=nchannels_max;
   return 0;
 }
 
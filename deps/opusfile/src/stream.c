@@ -400,6 +400,17 @@ static const OpusFileCallbacks OP_MEM_CALLBACKS={
   op_mem_close
 };
 
+/*Return the block of memory behind a stream created by op_mem_stream_create()
+   (storing its size in *_size), or NULL if the stream is anything else.*/
+const unsigned char *op_mem_stream_data(const OpusFileCallbacks *_cb,
+ void *_stream,opus_int64 *_size){
+  OpusMemStream *stream;
+  if(_cb->read!=op_mem_read||_cb->seek!=op_mem_seek)return NULL;
+  stream=(OpusMemStream *)_stream;
+  *_size=(opus_int64)stream->size;
+  return stream->data;
+}
+
 void *op_mem_stream_create(OpusFileCallbacks *_cb,
  const unsigned char *_data,size_t _size){
   OpusMemStream *stream;
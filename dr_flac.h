@@ -215,6 +215,18 @@ typedef drflac_uint32           drflac_bool32;
 DRFLAC_API void drflac_version(drflac_uint32* pMajor, drflac_uint32* pMinor, drflac_uint32* pRevision);
 DRFLAC_API const char* drflac_version_string(void);
 
+/*
+SIMD paths in use. The widest ones the CPU supports are picked on the first open. drflac_set_simd_level() caps them at a lower
+level (e.g. to compare against the scalar code) and returns the level actually in effect, which is clamped to what the CPU and
+compiler support. It applies to every decoder in the process, including ones already open.
+*/
+#define DRFLAC_SIMD_NONE    0
+#define DRFLAC_SIMD_SSE2    1
+#define DRFLAC_SIMD_SSE41   2
+#define DRFLAC_SIMD_AVX2    3
+
+DRFLAC_API int drflac_set_simd_level(int level);
+
 /* Allocation Callbacks */
 typedef struct
 {
@@ -989,6 +1001,33 @@ Return Value
 */
 DRFLAC_API drflac_bool32 drflac_seek_to_pcm_frame(drflac* pFlac, drflac_uint64 pcmFrameIndex);
 
+/*
+Replaces the seek table used by drflac_seek_to_pcm_frame().
+
+
+Parameters
+----------
+pFlac (in)
+    The decoder.
+
+pSeekpoints (in)
+    The seekpoints, sorted by firstPCMFrame, or NULL to remove the seek table. As in a SEEKTABLE block, flacFrameOffset is relative to the
+    first FLAC frame.
+
+seekpointCount (in)
+    The number of items in pSeekpoints.
+
+
+Remarks
+-------
+This is intended for streams without a SEEKTABLE block, where seeking otherwise falls back to a binary search over the whole stream. A table
+synthesized from a scan of the frame headers, with a seekpoint for every FLAC frame, lets a seek go straight to the frame holding the target.
+
+The array is not copied. It must remain valid until it is replaced or the decoder is closed. The stream's own seek table cannot be restored
+once replaced, so check that pFlac->seekpointCount is 0 first if it needs to be kept.
+*/
+DRFLAC_API void drflac_set_seek_table(drflac* pFlac, const drflac_seekpoint* pSeekpoints, drflac_uint32 seekpointCount);
+
 
 
 #ifndef DR_FLAC_NO_STDIO
@@ -1374,7 +1413,11 @@ Unfortuantely dr_flac depends on this for a few things so we're just going to di
             #include <intrin.h>
             static void drflac__cpuid(int info[4], int fid)
             {
+            #if _MSC_VER >= 1500
+                __cpuidex(info, fid, 0);    /* Sub-leaf 0 explicitly. Leaf 7 (AVX2) depends on it. */
+            #else
                 __cpuid(info, fid);
+            #endif
             }
         #else
             #define DRFLAC_NO_CPUID
@@ -1411,6 +1454,39 @@ Unfortuantely dr_flac depends on this for a few things so we're just going to di
     #define DRFLAC_NO_CPUID
 #endif
 
+/*
+AVX2 is used for the LPC restoration kernel only, and unlike SSE it is always selected at runtime. The kernel is compiled with a
+target attribute on GCC and Clang so the rest of the library doesn't need to be built with -mavx2. MSVC allows the intrinsics
+regardless of /arch.
+*/
+#if !defined(DR_FLAC_NO_SIMD) && !defined(DRFLAC_NO_AVX2) && !defined(DRFLAC_NO_CPUID)
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #if _MSC_VER >= 1800    /* 2013 */
+            #define DRFLAC_SUPPORT_AVX2
+            #define DRFLAC_AVX2_TARGET
+        #endif
+    #elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+        #define DRFLAC_SUPPORT_AVX2
+        #define DRFLAC_AVX2_TARGET __attribute__((target("avx2")))
+    #endif
+
+    #if defined(DRFLAC_SUPPORT_AVX2)
+        #include <immintrin.h>
+
+        static unsigned int drflac__xgetbv(void)
+        {
+        #if defined(_MSC_VER) && !defined(__clang__)
+            return (unsigned int)_xgetbv(0);
+        #else
+            unsigned int eax;
+            unsigned int edx;
+            __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));   /* xgetbv */
+            return eax;
+        #endif
+        }
+    #endif
+#endif
+
 static DRFLAC_INLINE drflac_bool32 drflac_has_sse2(void)
 {
 #if defined(DRFLAC_SUPPORT_SSE2)
@@ -1459,6 +1535,29 @@ static DRFLAC_INLINE drflac_bool32 drflac_has_sse41(void)
 #endif
 }
 
+static DRFLAC_INLINE drflac_bool32 drflac_has_avx2(void)
+{
+#if defined(DRFLAC_SUPPORT_AVX2)
+    int info[4];
+
+    drflac__cpuid(info, 0);
+    if (info[0] < 7) {
+        return DRFLAC_FALSE;
+    }
+
+    /* The CPU needs AVX and OSXSAVE, and the OS needs to be saving the YMM registers on context switches. */
+    drflac__cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (drflac__xgetbv() & 6) != 6) {
+        return DRFLAC_FALSE;
+    }
+
+    drflac__cpuid(info, 7);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return DRFLAC_FALSE;           /* No compiler support. */
+#endif
+}
+
 
 #if defined(_MSC_VER) && _MSC_VER >= 1500 && (defined(DRFLAC_X86) || defined(DRFLAC_X64)) && !defined(__clang__)
     #define DRFLAC_HAS_LZCNT_INTRINSIC
@@ -1670,6 +1769,7 @@ static drflac_bool32 drflac__gIsLZCNTSupported = DRFLAC_FALSE;
 #ifndef DRFLAC_NO_CPUID
 static drflac_bool32 drflac__gIsSSE2Supported  = DRFLAC_FALSE;
 static drflac_bool32 drflac__gIsSSE41Supported = DRFLAC_FALSE;
+static drflac_bool32 drflac__gIsAVX2Supported  = DRFLAC_FALSE;
 
 /*
 I've had a bug report that Clang's ThreadSanitizer presents a warning in this function. Having reviewed this, this does
@@ -1695,6 +1795,9 @@ DRFLAC_NO_THREAD_SANITIZE static void drflac__init_cpu_caps(void)
         /* SSE4.1 */
         drflac__gIsSSE41Supported = drflac_has_sse41();
 
+        /* AVX2 */
+        drflac__gIsAVX2Supported = drflac_has_avx2();
+
         /* Initialized. */
         isCPUCapsInitialized = DRFLAC_TRUE;
     }
@@ -1730,6 +1833,32 @@ DRFLAC_NO_THREAD_SANITIZE static void drflac__init_cpu_caps(void)
 }
 #endif
 
+DRFLAC_NO_THREAD_SANITIZE DRFLAC_API int drflac_set_simd_level(int level)
+{
+#ifndef DRFLAC_NO_CPUID
+    int effective = DRFLAC_SIMD_NONE;
+
+    drflac__init_cpu_caps();    /* So a later first open doesn't undo this. */
+    drflac__gIsSSE2Supported  = level >= DRFLAC_SIMD_SSE2  && drflac_has_sse2();
+    drflac__gIsSSE41Supported = level >= DRFLAC_SIMD_SSE41 && drflac_has_sse41();
+    drflac__gIsAVX2Supported  = level >= DRFLAC_SIMD_AVX2  && drflac_has_avx2();
+
+    if (drflac__gIsSSE2Supported) {
+        effective = DRFLAC_SIMD_SSE2;
+    }
+    if (drflac__gIsSSE41Supported) {
+        effective = DRFLAC_SIMD_SSE41;
+    }
+    if (drflac__gIsAVX2Supported) {
+        effective = DRFLAC_SIMD_AVX2;
+    }
+    return effective;
+#else
+    (void)level;
+    return DRFLAC_SIMD_NONE;
+#endif
+}
+
 
 /* Endian Management */
 static DRFLAC_INLINE drflac_bool32 drflac__is_little_endian(void)
@@ -3792,21 +3921,17 @@ static drflac_bool32 drflac__decode_samples_with_residual__rice__scalar(drflac_b
 }
 
 #if defined(DRFLAC_SUPPORT_SSE2)
-static DRFLAC_INLINE __m128i drflac__mm_packs_interleaved_epi32(__m128i a, __m128i b)
+/*
+Packs and interleaves 8 stereo frames: a0/a1 hold the first channel, b0/b1 the second. Packing each channel on its own first leaves
+the interleave as a plain 16-bit unpack.
+*/
+static DRFLAC_INLINE void drflac__mm_storeu_packs_interleaved_epi32x2(drflac_int16* pOutputSamples, __m128i a0, __m128i a1, __m128i b0, __m128i b1)
 {
-    __m128i r;
+    __m128i a = _mm_packs_epi32(a0, a1);
+    __m128i b = _mm_packs_epi32(b0, b1);
 
-    /* Pack. */
-    r = _mm_packs_epi32(a, b);
-
-    /* a3a2 a1a0 b3b2 b1b0 -> a3a2 b3b2 a1a0 b1b0 */
-    r = _mm_shuffle_epi32(r, _MM_SHUFFLE(3, 1, 2, 0));
-
-    /* a3a2 b3b2 a1a0 b1b0 -> a3b3 a2b2 a1b1 a0b0 */
-    r = _mm_shufflehi_epi16(r, _MM_SHUFFLE(3, 1, 2, 0));
-    r = _mm_shufflelo_epi16(r, _MM_SHUFFLE(3, 1, 2, 0));
-
-    return r;
+    _mm_storeu_si128((__m128i*)pOutputSamples + 0, _mm_unpacklo_epi16(a, b));
+    _mm_storeu_si128((__m128i*)pOutputSamples + 1, _mm_unpackhi_epi16(a, b));
 }
 #endif
 
@@ -4255,6 +4380,182 @@ static drflac_bool32 drflac__decode_samples_with_residual__rice__sse41(drflac_bs
 }
 #endif
 
+#if defined(DRFLAC_SUPPORT_AVX2)
+/*
+The AVX2 path works in two passes. The residuals are decoded into the output buffer first, and then the LPC filter is run over
+them in place. This keeps the bit reader tight and lets the restoration handle any order up to 32.
+
+The restoration works on blocks of 8 samples. Taps that reach back before the block are independent of each other, so they're
+done 8 lanes at a time. Taps that land inside the block depend on samples being restored in this block and are added serially.
+The arithmetic is the same as the scalar path, so the output is bit-exact.
+
+The serial part puts a floor on the cost per block, so this only pays off for higher orders. Lower orders are left to the SSE4.1
+path, which already covers orders up to 12. See drflac__decode_samples_with_residual__rice().
+*/
+DRFLAC_AVX2_TARGET
+static drflac_bool32 drflac__read_rice_residuals__avx2(drflac_bs* bs, drflac_uint32 count, drflac_uint8 riceParam, drflac_int32* pResidualsOut)
+{
+    drflac_uint32 t[2] = {0x00000000, 0xFFFFFFFF};
+    drflac_uint32 zeroCountParts[8];
+    drflac_uint32 riceParamParts[8];
+    drflac_uint32 riceParamMask;
+    drflac_uint32 i;
+    drflac_uint32 j;
+    __m256i riceParamMask256;
+    __m128i riceParam128;
+
+    riceParamMask    = (drflac_uint32)~((~0UL) << riceParam);
+    riceParamMask256 = _mm256_set1_epi32(riceParamMask);
+    riceParam128     = _mm_cvtsi32_si128(riceParam);
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256i zeroCountPart256;
+        __m256i riceParamPart256;
+
+        for (j = 0; j < 8; j += 1) {
+            if (!drflac__read_rice_parts_x1(bs, riceParam, &zeroCountParts[j], &riceParamParts[j])) {
+                return DRFLAC_FALSE;
+            }
+        }
+
+        zeroCountPart256 = _mm256_loadu_si256((const __m256i*)zeroCountParts);
+        riceParamPart256 = _mm256_loadu_si256((const __m256i*)riceParamParts);
+
+        riceParamPart256 = _mm256_or_si256(_mm256_and_si256(riceParamPart256, riceParamMask256), _mm256_sll_epi32(zeroCountPart256, riceParam128));
+        riceParamPart256 = _mm256_xor_si256(_mm256_srli_epi32(riceParamPart256, 1), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(riceParamPart256, _mm256_set1_epi32(1))));
+
+        _mm256_storeu_si256((__m256i*)(pResidualsOut + i), riceParamPart256);
+    }
+
+    for (; i < count; i += 1) {
+        if (!drflac__read_rice_parts_x1(bs, riceParam, &zeroCountParts[0], &riceParamParts[0])) {
+            return DRFLAC_FALSE;
+        }
+
+        riceParamParts[0] &= riceParamMask;
+        riceParamParts[0] |= (zeroCountParts[0] << riceParam);
+        riceParamParts[0]  = (riceParamParts[0] >> 1) ^ t[riceParamParts[0] & 0x01];
+
+        pResidualsOut[i] = (drflac_int32)riceParamParts[0];
+    }
+
+    return DRFLAC_TRUE;
+}
+
+/*
+Sample restoration for one block. The vector part has already summed the taps that reach back before the block; what's left is
+the contribution of the samples restored earlier in the same block. Those are kept in registers rather than going back through
+memory, which keeps the store-to-load round trip out of the dependency chain.
+*/
+#define DRFLAC_AVX2_RESTORE_BLOCK(type, p, r, c, s, shift) \
+    s[0] = (drflac_int32)((drflac_uint32)r[0] + (drflac_uint32)(drflac_int32)((p[0]                                                                                 ) >> shift)); \
+    s[1] = (drflac_int32)((drflac_uint32)r[1] + (drflac_uint32)(drflac_int32)((p[1] + c[0]*(type)s[0]                                                               ) >> shift)); \
+    s[2] = (drflac_int32)((drflac_uint32)r[2] + (drflac_uint32)(drflac_int32)((p[2] + c[0]*(type)s[1] + c[1]*(type)s[0]                                             ) >> shift)); \
+    s[3] = (drflac_int32)((drflac_uint32)r[3] + (drflac_uint32)(drflac_int32)((p[3] + c[0]*(type)s[2] + c[1]*(type)s[1] + c[2]*(type)s[0]                           ) >> shift)); \
+    s[4] = (drflac_int32)((drflac_uint32)r[4] + (drflac_uint32)(drflac_int32)((p[4] + c[0]*(type)s[3] + c[1]*(type)s[2] + c[2]*(type)s[1] + c[3]*(type)s[0]         ) >> shift)); \
+    s[5] = (drflac_int32)((drflac_uint32)r[5] + (drflac_uint32)(drflac_int32)((p[5] + c[0]*(type)s[4] + c[1]*(type)s[3] + c[2]*(type)s[2] + c[3]*(type)s[1] + c[4]*(type)s[0]) >> shift)); \
+    s[6] = (drflac_int32)((drflac_uint32)r[6] + (drflac_uint32)(drflac_int32)((p[6] + c[0]*(type)s[5] + c[1]*(type)s[4] + c[2]*(type)s[3] + c[3]*(type)s[2] + c[4]*(type)s[1] + c[5]*(type)s[0]) >> shift)); \
+    s[7] = (drflac_int32)((drflac_uint32)r[7] + (drflac_uint32)(drflac_int32)((p[7] + c[0]*(type)s[6] + c[1]*(type)s[5] + c[2]*(type)s[4] + c[3]*(type)s[3] + c[4]*(type)s[2] + c[5]*(type)s[1] + c[6]*(type)s[0]) >> shift))
+
+#if defined(__clang__)
+__attribute__((no_sanitize("signed-integer-overflow")))
+#endif
+DRFLAC_AVX2_TARGET
+static void drflac__restore_lpc_32__avx2(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    drflac_int32 coefficientsPadded[32 + 8];
+    drflac_int32 predictions[8];
+    drflac_int32 samples[8];
+    drflac_uint32 i;
+    drflac_uint32 d;
+
+    DRFLAC_ASSERT(order > 0 && order <= 32);
+
+    /*
+    The filter is applied as a sum of broadcast samples times coefficient vectors. Lane j of the vector for tap d holds the weight
+    that sample n-d has for output n+j, which is coefficient d+j. Anything past the order is zero, hence the padding.
+    */
+    DRFLAC_ZERO_MEMORY(coefficientsPadded, sizeof(coefficientsPadded));
+    DRFLAC_COPY_MEMORY(coefficientsPadded, coefficients, order * sizeof(drflac_int32));
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        drflac_int32* pBlock = pSamples + i;
+        __m256i prediction256 = _mm256_setzero_si256();
+
+        for (d = 1; d <= order; d += 1) {
+            prediction256 = _mm256_add_epi32(prediction256, _mm256_mullo_epi32(_mm256_set1_epi32(pBlock[-(drflac_int32)d]), _mm256_loadu_si256((const __m256i*)(coefficientsPadded + d - 1))));
+        }
+
+        _mm256_storeu_si256((__m256i*)predictions, prediction256);
+        DRFLAC_AVX2_RESTORE_BLOCK(drflac_int32, predictions, pBlock, coefficientsPadded, samples, shift);
+        _mm256_storeu_si256((__m256i*)pBlock, _mm256_loadu_si256((const __m256i*)samples));
+    }
+
+    for (; i < count; i += 1) {
+        pSamples[i] = (drflac_int32)((drflac_uint32)pSamples[i] + (drflac_uint32)drflac__calculate_prediction_32(order, shift, coefficients, pSamples + i));
+    }
+}
+
+DRFLAC_AVX2_TARGET
+static void drflac__restore_lpc_64__avx2(drflac_uint32 count, drflac_uint32 order, drflac_int32 shift, const drflac_int32* coefficients, drflac_int32* pSamples)
+{
+    drflac_int32 coefficientsPadded[32 + 8];
+    drflac_int64 predictions[8];
+    drflac_int32 samples[8];
+    drflac_uint32 i;
+    drflac_uint32 d;
+
+    DRFLAC_ASSERT(order > 0 && order <= 32);
+
+    /* Same layout as the 32-bit version. _mm256_mul_epi32() only looks at the low half of each 64-bit lane, so we do 4 outputs at a time. */
+    DRFLAC_ZERO_MEMORY(coefficientsPadded, sizeof(coefficientsPadded));
+    DRFLAC_COPY_MEMORY(coefficientsPadded, coefficients, order * sizeof(drflac_int32));
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        drflac_int32* pBlock = pSamples + i;
+        __m256i prediction256_0 = _mm256_setzero_si256();
+        __m256i prediction256_4 = _mm256_setzero_si256();
+
+        for (d = 1; d <= order; d += 1) {
+            __m256i sample256 = _mm256_set1_epi32(pBlock[-(drflac_int32)d]);
+            prediction256_0 = _mm256_add_epi64(prediction256_0, _mm256_mul_epi32(sample256, _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(coefficientsPadded + d - 1)))));
+            prediction256_4 = _mm256_add_epi64(prediction256_4, _mm256_mul_epi32(sample256, _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(coefficientsPadded + d + 3)))));
+        }
+
+        _mm256_storeu_si256((__m256i*)(predictions + 0), prediction256_0);
+        _mm256_storeu_si256((__m256i*)(predictions + 4), prediction256_4);
+        DRFLAC_AVX2_RESTORE_BLOCK(drflac_int64, predictions, pBlock, coefficientsPadded, samples, shift);
+        _mm256_storeu_si256((__m256i*)pBlock, _mm256_loadu_si256((const __m256i*)samples));
+    }
+
+    for (; i < count; i += 1) {
+        pSamples[i] = (drflac_int32)((drflac_uint32)pSamples[i] + (drflac_uint32)drflac__calculate_prediction_64(order, shift, coefficients, pSamples + i));
+    }
+}
+
+static drflac_bool32 drflac__decode_samples_with_residual__rice__avx2(drflac_bs* bs, drflac_uint32 bitsPerSample, drflac_uint32 count, drflac_uint8 riceParam, drflac_uint32 lpcOrder, drflac_int32 lpcShift, drflac_uint32 lpcPrecision, const drflac_int32* coefficients, drflac_int32* pSamplesOut)
+{
+    DRFLAC_ASSERT(bs != NULL);
+    DRFLAC_ASSERT(pSamplesOut != NULL);
+
+    if (lpcOrder <= 12 || lpcOrder > 32) {
+        return drflac__decode_samples_with_residual__rice__scalar(bs, bitsPerSample, count, riceParam, lpcOrder, lpcShift, lpcPrecision, coefficients, pSamplesOut);
+    }
+
+    if (!drflac__read_rice_residuals__avx2(bs, count, riceParam, pSamplesOut)) {
+        return DRFLAC_FALSE;
+    }
+
+    if (drflac__use_64_bit_prediction(bitsPerSample, lpcOrder, lpcPrecision)) {
+        drflac__restore_lpc_64__avx2(count, lpcOrder, lpcShift, coefficients, pSamplesOut);
+    } else {
+        drflac__restore_lpc_32__avx2(count, lpcOrder, lpcShift, coefficients, pSamplesOut);
+    }
+
+    return DRFLAC_TRUE;
+}
+#endif
+
 #if defined(DRFLAC_SUPPORT_NEON)
 static DRFLAC_INLINE void drflac__vst2q_s32(drflac_int32* p, int32x4x2_t x)
 {
@@ -4754,6 +5055,11 @@ static drflac_bool32 drflac__decode_samples_with_residual__rice__neon(drflac_bs*
 
 static drflac_bool32 drflac__decode_samples_with_residual__rice(drflac_bs* bs, drflac_uint32 bitsPerSample, drflac_uint32 count, drflac_uint8 riceParam, drflac_uint32 lpcOrder, drflac_int32 lpcShift, drflac_uint32 lpcPrecision, const drflac_int32* coefficients, drflac_int32* pSamplesOut)
 {
+#if defined(DRFLAC_SUPPORT_AVX2)
+    if (drflac__gIsAVX2Supported && lpcOrder > 12) {
+        return drflac__decode_samples_with_residual__rice__avx2(bs, bitsPerSample, count, riceParam, lpcOrder, lpcShift, lpcPrecision, coefficients, pSamplesOut);
+    } else
+#endif
 #if defined(DRFLAC_SUPPORT_SSE41)
     if (drflac__gIsSSE41Supported) {
         return drflac__decode_samples_with_residual__rice__sse41(bs, bitsPerSample, count, riceParam, lpcOrder, lpcShift, lpcPrecision, coefficients, pSamplesOut);
@@ -9975,7 +10281,7 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_left_side__scalar(d
 static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_left_side__sse2(drflac* pFlac, drflac_uint64 frameCount, drflac_uint32 unusedBitsPerSample, const drflac_int32* pInputSamples0, const drflac_int32* pInputSamples1, drflac_int16* pOutputSamples)
 {
     drflac_uint64 i;
-    drflac_uint64 frameCount4 = frameCount >> 2;
+    drflac_uint64 frameCount8 = frameCount >> 3;
     const drflac_uint32* pInputSamples0U32 = (const drflac_uint32*)pInputSamples0;
     const drflac_uint32* pInputSamples1U32 = (const drflac_uint32*)pInputSamples1;
     drflac_uint32 shift0 = unusedBitsPerSample + pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
@@ -9983,18 +10289,23 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_left_side__sse2(drf
 
     DRFLAC_ASSERT(pFlac->bitsPerSample <= 24);
 
-    for (i = 0; i < frameCount4; ++i) {
-        __m128i left  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i), shift0);
-        __m128i side  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i), shift1);
-        __m128i right = _mm_sub_epi32(left, side);
+    for (i = 0; i < frameCount8; ++i) {
+        __m128i left0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 0), shift0);
+        __m128i left1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 1), shift0);
+        __m128i side0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 0), shift1);
+        __m128i side1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 1), shift1);
+        __m128i right0 = _mm_sub_epi32(left0, side0);
+        __m128i right1 = _mm_sub_epi32(left1, side1);
 
-        left  = _mm_srai_epi32(left,  16);
-        right = _mm_srai_epi32(right, 16);
+        left0  = _mm_srai_epi32(left0,  16);
+        left1  = _mm_srai_epi32(left1,  16);
+        right0 = _mm_srai_epi32(right0, 16);
+        right1 = _mm_srai_epi32(right1, 16);
 
-        _mm_storeu_si128((__m128i*)(pOutputSamples + i*8), drflac__mm_packs_interleaved_epi32(left, right));
+        drflac__mm_storeu_packs_interleaved_epi32x2(pOutputSamples + i*16, left0, left1, right0, right1);
     }
 
-    for (i = (frameCount4 << 2); i < frameCount; ++i) {
+    for (i = (frameCount8 << 3); i < frameCount; ++i) {
         drflac_uint32 left  = pInputSamples0U32[i] << shift0;
         drflac_uint32 side  = pInputSamples1U32[i] << shift1;
         drflac_uint32 right = left - side;
@@ -10156,7 +10467,7 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_right_side__scalar(
 static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_right_side__sse2(drflac* pFlac, drflac_uint64 frameCount, drflac_uint32 unusedBitsPerSample, const drflac_int32* pInputSamples0, const drflac_int32* pInputSamples1, drflac_int16* pOutputSamples)
 {
     drflac_uint64 i;
-    drflac_uint64 frameCount4 = frameCount >> 2;
+    drflac_uint64 frameCount8 = frameCount >> 3;
     const drflac_uint32* pInputSamples0U32 = (const drflac_uint32*)pInputSamples0;
     const drflac_uint32* pInputSamples1U32 = (const drflac_uint32*)pInputSamples1;
     drflac_uint32 shift0 = unusedBitsPerSample + pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
@@ -10164,18 +10475,23 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_right_side__sse2(dr
 
     DRFLAC_ASSERT(pFlac->bitsPerSample <= 24);
 
-    for (i = 0; i < frameCount4; ++i) {
-        __m128i side  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i), shift0);
-        __m128i right = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i), shift1);
-        __m128i left  = _mm_add_epi32(right, side);
+    for (i = 0; i < frameCount8; ++i) {
+        __m128i side0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 0), shift0);
+        __m128i side1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 1), shift0);
+        __m128i right0 = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 0), shift1);
+        __m128i right1 = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 1), shift1);
+        __m128i left0  = _mm_add_epi32(right0, side0);
+        __m128i left1  = _mm_add_epi32(right1, side1);
 
-        left  = _mm_srai_epi32(left,  16);
-        right = _mm_srai_epi32(right, 16);
+        left0  = _mm_srai_epi32(left0,  16);
+        left1  = _mm_srai_epi32(left1,  16);
+        right0 = _mm_srai_epi32(right0, 16);
+        right1 = _mm_srai_epi32(right1, 16);
 
-        _mm_storeu_si128((__m128i*)(pOutputSamples + i*8), drflac__mm_packs_interleaved_epi32(left, right));
+        drflac__mm_storeu_packs_interleaved_epi32x2(pOutputSamples + i*16, left0, left1, right0, right1);
     }
 
-    for (i = (frameCount4 << 2); i < frameCount; ++i) {
+    for (i = (frameCount8 << 3); i < frameCount; ++i) {
         drflac_uint32 side  = pInputSamples0U32[i] << shift0;
         drflac_uint32 right = pInputSamples1U32[i] << shift1;
         drflac_uint32 left  = right + side;
@@ -10408,37 +10724,46 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_mid_side__scalar(dr
 static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_mid_side__sse2(drflac* pFlac, drflac_uint64 frameCount, drflac_uint32 unusedBitsPerSample, const drflac_int32* pInputSamples0, const drflac_int32* pInputSamples1, drflac_int16* pOutputSamples)
 {
     drflac_uint64 i;
-    drflac_uint64 frameCount4 = frameCount >> 2;
+    drflac_uint64 frameCount8 = frameCount >> 3;
     const drflac_uint32* pInputSamples0U32 = (const drflac_uint32*)pInputSamples0;
     const drflac_uint32* pInputSamples1U32 = (const drflac_uint32*)pInputSamples1;
     drflac_uint32 shift = unusedBitsPerSample;
+    drflac_uint32 shift0 = pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
+    drflac_uint32 shift1 = pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample;
 
     DRFLAC_ASSERT(pFlac->bitsPerSample <= 24);
 
     if (shift == 0) {
-        for (i = 0; i < frameCount4; ++i) {
-            __m128i mid;
-            __m128i side;
-            __m128i left;
-            __m128i right;
+        for (i = 0; i < frameCount8; ++i) {
+            __m128i mid0;
+            __m128i mid1;
+            __m128i side0;
+            __m128i side1;
+            __m128i left0;
+            __m128i left1;
+            __m128i right0;
+            __m128i right1;
 
-            mid   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i), pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample);
-            side  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i), pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample);
+            mid0   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 0), shift0);
+            mid1   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 1), shift0);
+            side0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 0), shift1);
+            side1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 1), shift1);
 
-            mid   = _mm_or_si128(_mm_slli_epi32(mid, 1), _mm_and_si128(side, _mm_set1_epi32(0x01)));
+            mid0   = _mm_or_si128(_mm_slli_epi32(mid0, 1), _mm_and_si128(side0, _mm_set1_epi32(0x01)));
+            mid1   = _mm_or_si128(_mm_slli_epi32(mid1, 1), _mm_and_si128(side1, _mm_set1_epi32(0x01)));
 
-            left  = _mm_srai_epi32(_mm_add_epi32(mid, side), 1);
-            right = _mm_srai_epi32(_mm_sub_epi32(mid, side), 1);
-
-            left  = _mm_srai_epi32(left,  16);
-            right = _mm_srai_epi32(right, 16);
+            /* The >> 1 and the >> 16 are folded into a single arithmetic shift. */
+            left0  = _mm_srai_epi32(_mm_add_epi32(mid0, side0), 17);
+            left1  = _mm_srai_epi32(_mm_add_epi32(mid1, side1), 17);
+            right0 = _mm_srai_epi32(_mm_sub_epi32(mid0, side0), 17);
+            right1 = _mm_srai_epi32(_mm_sub_epi32(mid1, side1), 17);
 
-            _mm_storeu_si128((__m128i*)(pOutputSamples + i*8), drflac__mm_packs_interleaved_epi32(left, right));
+            drflac__mm_storeu_packs_interleaved_epi32x2(pOutputSamples + i*16, left0, left1, right0, right1);
         }
 
-        for (i = (frameCount4 << 2); i < frameCount; ++i) {
-            drflac_uint32 mid  = pInputSamples0U32[i] << pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
-            drflac_uint32 side = pInputSamples1U32[i] << pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample;
+        for (i = (frameCount8 << 3); i < frameCount; ++i) {
+            drflac_uint32 mid  = pInputSamples0U32[i] << shift0;
+            drflac_uint32 side = pInputSamples1U32[i] << shift1;
 
             mid = (mid << 1) | (side & 0x01);
 
@@ -10447,29 +10772,40 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_mid_side__sse2(drfl
         }
     } else {
         shift -= 1;
-        for (i = 0; i < frameCount4; ++i) {
-            __m128i mid;
-            __m128i side;
-            __m128i left;
-            __m128i right;
+        for (i = 0; i < frameCount8; ++i) {
+            __m128i mid0;
+            __m128i mid1;
+            __m128i side0;
+            __m128i side1;
+            __m128i left0;
+            __m128i left1;
+            __m128i right0;
+            __m128i right1;
 
-            mid   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i), pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample);
-            side  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i), pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample);
+            mid0   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 0), shift0);
+            mid1   = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 1), shift0);
+            side0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 0), shift1);
+            side1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 1), shift1);
 
-            mid   = _mm_or_si128(_mm_slli_epi32(mid, 1), _mm_and_si128(side, _mm_set1_epi32(0x01)));
+            mid0   = _mm_or_si128(_mm_slli_epi32(mid0, 1), _mm_and_si128(side0, _mm_set1_epi32(0x01)));
+            mid1   = _mm_or_si128(_mm_slli_epi32(mid1, 1), _mm_and_si128(side1, _mm_set1_epi32(0x01)));
 
-            left  = _mm_slli_epi32(_mm_add_epi32(mid, side), shift);
-            right = _mm_slli_epi32(_mm_sub_epi32(mid, side), shift);
+            left0  = _mm_slli_epi32(_mm_add_epi32(mid0, side0), shift);
+            left1  = _mm_slli_epi32(_mm_add_epi32(mid1, side1), shift);
+            right0 = _mm_slli_epi32(_mm_sub_epi32(mid0, side0), shift);
+            right1 = _mm_slli_epi32(_mm_sub_epi32(mid1, side1), shift);
 
-            left  = _mm_srai_epi32(left,  16);
-            right = _mm_srai_epi32(right, 16);
+            left0  = _mm_srai_epi32(left0,  16);
+            left1  = _mm_srai_epi32(left1,  16);
+            right0 = _mm_srai_epi32(right0, 16);
+            right1 = _mm_srai_epi32(right1, 16);
 
-            _mm_storeu_si128((__m128i*)(pOutputSamples + i*8), drflac__mm_packs_interleaved_epi32(left, right));
+            drflac__mm_storeu_packs_interleaved_epi32x2(pOutputSamples + i*16, left0, left1, right0, right1);
         }
 
-        for (i = (frameCount4 << 2); i < frameCount; ++i) {
-            drflac_uint32 mid  = pInputSamples0U32[i] << pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
-            drflac_uint32 side = pInputSamples1U32[i] << pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample;
+        for (i = (frameCount8 << 3); i < frameCount; ++i) {
+            drflac_uint32 mid  = pInputSamples0U32[i] << shift0;
+            drflac_uint32 side = pInputSamples1U32[i] << shift1;
 
             mid = (mid << 1) | (side & 0x01);
 
@@ -10647,24 +10983,28 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_independent_stereo_
 static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_independent_stereo__sse2(drflac* pFlac, drflac_uint64 frameCount, drflac_uint32 unusedBitsPerSample, const drflac_int32* pInputSamples0, const drflac_int32* pInputSamples1, drflac_int16* pOutputSamples)
 {
     drflac_uint64 i;
-    drflac_uint64 frameCount4 = frameCount >> 2;
+    drflac_uint64 frameCount8 = frameCount >> 3;
     const drflac_uint32* pInputSamples0U32 = (const drflac_uint32*)pInputSamples0;
     const drflac_uint32* pInputSamples1U32 = (const drflac_uint32*)pInputSamples1;
     drflac_uint32 shift0 = unusedBitsPerSample + pFlac->currentFLACFrame.subframes[0].wastedBitsPerSample;
     drflac_uint32 shift1 = unusedBitsPerSample + pFlac->currentFLACFrame.subframes[1].wastedBitsPerSample;
 
-    for (i = 0; i < frameCount4; ++i) {
-        __m128i left  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i), shift0);
-        __m128i right = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i), shift1);
+    for (i = 0; i < frameCount8; ++i) {
+        __m128i left0  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 0), shift0);
+        __m128i left1  = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples0 + i*2 + 1), shift0);
+        __m128i right0 = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 0), shift1);
+        __m128i right1 = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)pInputSamples1 + i*2 + 1), shift1);
 
-        left  = _mm_srai_epi32(left,  16);
-        right = _mm_srai_epi32(right, 16);
+        left0  = _mm_srai_epi32(left0,  16);
+        left1  = _mm_srai_epi32(left1,  16);
+        right0 = _mm_srai_epi32(right0, 16);
+        right1 = _mm_srai_epi32(right1, 16);
 
-        /* At this point we have results. We can now pack and interleave these into a single __m128i object and then store the in the output buffer. */
-        _mm_storeu_si128((__m128i*)(pOutputSamples + i*8), drflac__mm_packs_interleaved_epi32(left, right));
+        /* At this point we have results. We can now pack and interleave these into the output buffer. */
+        drflac__mm_storeu_packs_interleaved_epi32x2(pOutputSamples + i*16, left0, left1, right0, right1);
     }
 
-    for (i = (frameCount4 << 2); i < frameCount; ++i) {
+    for (i = (frameCount8 << 3); i < frameCount; ++i) {
         pOutputSamples[i*2+0] = (drflac_int16)((pInputSamples0U32[i] << shift0) >> 16);
         pOutputSamples[i*2+1] = (drflac_int16)((pInputSamples1U32[i] << shift1) >> 16);
     }
@@ -10707,7 +11047,7 @@ static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_independent_stereo_
 static DRFLAC_INLINE void drflac_read_pcm_frames_s16__decode_independent_stereo(drflac* pFlac, drflac_uint64 frameCount, drflac_uint32 unusedBitsPerSample, const drflac_int32* pInputSamples0, const drflac_int32* pInputSamples1, drflac_int16* pOutputSamples)
 {
 #if defined(DRFLAC_SUPPORT_SSE2)
-    if (drflac__gIsSSE2Supported && pFlac->bitsPerSample <= 24) {
+    if (drflac__gIsSSE2Supported) {  /* No decorrelation, so this is fine for 32-bit streams as well. */
         drflac_read_pcm_frames_s16__decode_independent_stereo__sse2(pFlac, frameCount, unusedBitsPerSample, pInputSamples0, pInputSamples1, pOutputSamples);
     } else
 #elif defined(DRFLAC_SUPPORT_NEON)
@@ -11786,6 +12126,17 @@ DRFLAC_API drflac_bool32 drflac_seek_to_pcm_frame(drflac* pFlac, drflac_uint64 p
     }
 }
 
+DRFLAC_API void drflac_set_seek_table(drflac* pFlac, const drflac_seekpoint* pSeekpoints, drflac_uint32 seekpointCount)
+{
+    if (pFlac == NULL) {
+        return;
+    }
+
+    /* The seek table is only ever read, so the cast is safe. */
+    pFlac->pSeekpoints    = (drflac_seekpoint*)pSeekpoints;
+    pFlac->seekpointCount = (pSeekpoints != NULL) ? seekpointCount : 0;
+}
+
 
 
 /* High Level APIs */
@@ -58,6 +58,10 @@ Build Options
 
 #define DR_MP3_NO_SIMD
   Disable SIMD optimizations.
+
+On 32-bit x86 the SSE2 paths are compiled in whenever the compiler can emit SSE2 intrinsics, which for MSVC is always, regardless
+of the /arch setting. Whether they are used is decided by CPUID the first time a decoder is initialized with drmp3dec_init(), with
+the scalar code as the fallback. Use drmp3dec_is_simd_enabled() to check which path was picked.
 */
 
 #ifndef dr_mp3_h
@@ -301,6 +305,13 @@ typedef struct
 /* Initializes a low level decoder. */
 DRMP3_API void drmp3dec_init(drmp3dec *dec);
 
+/* Returns whether the SIMD decoding paths are in use. Only meaningful after the first call to drmp3dec_init(). */
+DRMP3_API drmp3_bool32 drmp3dec_is_simd_enabled(void);
+
+/* Turns the SIMD paths off, or back on if the CPU supports them (e.g. to compare against the scalar code), for every decoder in
+the process. Returns whether they are in use afterwards. */
+DRMP3_API drmp3_bool32 drmp3dec_set_simd_enabled(drmp3_bool32 enabled);
+
 /* Reads a frame from a low level decoder. */
 DRMP3_API int drmp3dec_decode_frame(drmp3dec *dec, const drmp3_uint8 *mp3, int mp3_bytes, void *pcm, drmp3dec_frame_info *info);
 
@@ -662,7 +673,7 @@ DRMP3_API const char* drmp3_version_string(void)
 #define DR_MP3_ONLY_SIMD
 #endif
 
-#if ((defined(_MSC_VER) && _MSC_VER >= 1400) && defined(_M_X64)) || ((defined(__i386) || defined(_M_IX86) || defined(__i386__) || defined(__x86_64__)) && ((defined(_M_IX86_FP) && _M_IX86_FP == 2) || defined(__SSE2__)))
+#if ((defined(_MSC_VER) && _MSC_VER >= 1400) && (defined(_M_X64) || defined(_M_IX86))) || ((defined(__i386) || defined(_M_IX86) || defined(__i386__) || defined(__x86_64__)) && ((defined(_M_IX86_FP) && _M_IX86_FP == 2) || defined(__SSE2__)))
 #if defined(_MSC_VER)
 #include <intrin.h>
 #endif
@@ -707,12 +718,17 @@ static __inline__ __attribute__((always_inline)) void drmp3_cpuid(int CPUInfo[],
 #endif
 }
 #endif
+#ifndef DR_MP3_ONLY_SIMD
+/* 0 = not checked yet, 1 = no SSE2, anything else = SSE2. Primed by drmp3dec_init() so the hot loops only ever read it. */
+static int g_have_simd;
+/* Cleared by drmp3dec_set_simd_enabled() to force the scalar code */
+static int g_allow_simd = 1;
+#endif
 static int drmp3_have_simd(void)
 {
 #ifdef DR_MP3_ONLY_SIMD
     return 1;
 #else
-    static int g_have_simd;
     int CPUInfo[4];
 #ifdef MINIMP3_TEST
     static int g_counter;
@@ -726,11 +742,12 @@ static int drmp3_have_simd(void)
     {
         drmp3_cpuid(CPUInfo, 1);
         g_have_simd = (CPUInfo[3] & (1 << 26)) + 1; /* SSE2 */
-        return g_have_simd - 1;
+        goto end;
     }
+    g_have_simd = 1;
 
 end:
-    return g_have_simd - 1;
+    return g_allow_simd ? g_have_simd - 1 : 0;
 #endif
 }
 #elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64) || defined(_M_ARM64EC)
@@ -2306,6 +2323,29 @@ static int drmp3d_find_frame(const drmp3_uint8 *mp3, int mp3_bytes, int *free_fo
 DRMP3_API void drmp3dec_init(drmp3dec *dec)
 {
     dec->header[0] = 0;
+#if DRMP3_HAVE_SIMD
+    drmp3_have_simd();  /* Do the CPUID check here rather than in the middle of the first frame. */
+#endif
+}
+
+DRMP3_API drmp3_bool32 drmp3dec_is_simd_enabled(void)
+{
+#if DRMP3_HAVE_SIMD
+    return drmp3_have_simd() != 0;
+#else
+    return DRMP3_FALSE;
+#endif
+}
+
+DRMP3_API drmp3_bool32 drmp3dec_set_simd_enabled(drmp3_bool32 enabled)
+{
+#if DRMP3_HAVE_SSE && !defined(DR_MP3_ONLY_SIMD)
+    /* CPUID is resolved whatever g_allow_simd says, so this never has to turn SIMD on to check for it. */
+    g_allow_simd = enabled ? 1 : 0;
+#else
+    (void)enabled;
+#endif
+    return drmp3dec_is_simd_enabled();
 }
 
 DRMP3_API int drmp3dec_decode_frame(drmp3dec *dec, const drmp3_uint8 *mp3, int mp3_bytes, void *pcm, drmp3dec_frame_info *info)
@@ -0,0 +1,70 @@
+/*
+ * Live metrics page shared by mcicda.dll and tools/mcicda_metrics.c.
+ *
+ * With Metrics=1 in mcicda.ini the driver maps MCICDA_METRICS_FILE into
+ * memory and keeps this struct up to date while the game runs. The file
+ * is also visible from the host inside the Wine prefix
+ * (drive_c/mcicda_metrics.bin), so any process can poll it.
+ *
+ * Every field is a naturally aligned 32-bit value written with a single
+ * store, so readers see each field whole without any locking. Fields may
+ * be from slightly different moments; `updates` changes on every write
+ * pass and can be used to tell a live page from a stale one.
+ */
+
+#ifndef MCICDA_METRICS_H
+#define MCICDA_METRICS_H
+
+#include <stdint.h>
+
+#define MCICDA_METRICS_FILE    "C:\\mcicda_metrics.bin"
+#define MCICDA_METRICS_NAME    "mcicda_metrics"
+#define MCICDA_METRICS_MAGIC   0x4D444D43u  /* "CMDM" */
+#define MCICDA_METRICS_VERSION 1
+
+/* Command latency slots */
+enum {
+    MCICDA_CMD_OPEN = 0,
+    MCICDA_CMD_CLOSE,
+    MCICDA_CMD_PLAY,
+    MCICDA_CMD_STOP,
+    MCICDA_CMD_PAUSE,
+    MCICDA_CMD_RESUME,
+    MCICDA_CMD_SEEK,
+    MCICDA_CMD_STATUS,
+    MCICDA_CMD_SET,
+    MCICDA_CMD_INFO,
+    MCICDA_CMD_OTHER,
+    MCICDA_CMD_COUNT
+};
+
+typedef struct {
+    volatile uint32_t count;
+    volatile uint32_t lastUs;
+    volatile uint32_t maxUs;
+    volatile uint32_t totalUs;
+} McicdaCommandLatency;
+
+typedef struct {
+    uint32_t magic;                     /* MCICDA_METRICS_MAGIC */
+    uint32_t version;                   /* MCICDA_METRICS_VERSION */
+    uint32_t size;                      /* sizeof(McicdaMetrics) */
+    volatile uint32_t updates;          /* bumped on every update */
+
+    volatile uint32_t currentTrack;
+    volatile uint32_t playing;          /* 0 stopped, 1 playing, 2 paused */
+    volatile uint32_t positionMs;       /* audio played in the current track */
+    volatile uint32_t queuedMs;         /* audio queued on the device (buffer fill) */
+    volatile uint32_t queueDepth;       /* adaptive queue depth, in blocks */
+    volatile uint32_t decodedMs;        /* audio decoded so far in the current track */
+    volatile uint32_t decodeSpeedX100;  /* decode speed as a multiple of real time, x100 */
+    volatile uint32_t underruns;
+    volatile uint32_t lateRefills;
+    volatile uint32_t cacheHits;
+    volatile uint32_t cacheMisses;
+    volatile uint32_t bytesResident;    /* decoded PCM held in memory */
+
+    McicdaCommandLatency commands[MCICDA_CMD_COUNT];
+} McicdaMetrics;
+
+#endif /* MCICDA_METRICS_H */
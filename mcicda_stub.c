@@ -1,12 +1,17 @@
 /*
  * MCI CD Audio Driver with Direct Multi-Format Playback
- * Intercepts CD audio commands and plays audio files using waveOut API.
+ * Intercepts CD audio commands and plays audio files using waveOut API,
+ * or optionally an mmdevapi IAudioClient.
  * Supports WAV, FLAC, MP3, OGG Vorbis, and Opus.
- * Uses dynamic loading of winmm.dll to avoid import issues.
+ * Uses dynamic loading of winmm.dll and ole32.dll to avoid import issues.
  */
 
+#define COBJMACROS
 #include <windows.h>
 #include <mmsystem.h>
+#include <mmreg.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -21,10 +26,16 @@
 #define DR_MP3_IMPLEMENTATION
 #include "dr_mp3.h"
 
+/* Tracks from one rip share a setup header; build its codebooks once */
+#define STB_VORBIS_SETUP_CACHE
+/* Leave comment headers (and any cover art in them) unread; we never ask */
+#define STB_VORBIS_LAZY_COMMENTS
 #include "stb_vorbis.c"
 
 #include <opusfile.h>
 
+#include "mcicda_metrics.h"
+
 /* Internal MCI driver message IDs */
 #ifndef MCI_OPEN_DRIVER
 #define MCI_OPEN_DRIVER 0x0801
@@ -33,9 +44,52 @@
 #define MCI_CLOSE_DRIVER 0x0802
 #endif
 
+/* DRV_OPEN lParam2 when opened through MCI (MCI_OPEN_DRIVER_PARMS in mmddk.h) */
+typedef struct {
+    UINT wDeviceID;
+    LPCSTR lpstrParams;
+    UINT wCustomCommandTable;
+    UINT wType;
+} MciOpenDriverParms;
+
 /* Paths */
 #define MUSIC_DIR "C:\\music\\"
 #define LOG_FILE "C:\\mcicda_commands.log"
+#define TRACE_FILE "C:\\mcicda_trace.json"
+#define CONFIG_FILE MUSIC_DIR "mcicda.ini"
+#define TOC_CACHE_DIR MUSIC_DIR "cache\\"
+
+/* TOC cache files: per-track data derived from a file, kept until the file changes */
+#define TOC_CACHE_MAGIC 0x434F544Du /* "MTOC" */
+#define TOC_CACHE_VERSION 1
+
+/* Ogg page index spacing, and decoded audio discarded before an Opus seek target */
+#define OGG_INDEX_SPACING 32768
+#define OPUS_PREROLL_FRAMES 3840
+
+/* Highest track number */
+#define MAX_TRACKS 99
+
+/* Most waveOut headers that can be queued at once */
+#define MAX_WAVE_HEADERS 16
+
+/* Healthy playback time after which the queue depth is shrunk again */
+#define QUEUE_SHRINK_MS 30000
+
+/* Trace buffers: events per chunk, and chunks per session before events are dropped */
+#define TRACE_CHUNK_EVENTS 256
+#define TRACE_MAX_CHUNKS 1024
+
+/* Vendor MCI_STATUS items reporting playback health */
+#define MCICDA_STATUS_UNDERRUNS     0x4100  /* times the device ran dry mid-track */
+#define MCICDA_STATUS_LATE_REFILLS  0x4101  /* refills with at most one block left queued */
+#define MCICDA_STATUS_QUEUE_DEPTH   0x4102  /* current queue depth, in blocks */
+#define MCICDA_STATUS_QUEUED_MS     0x4103  /* audio queued ahead of the play cursor */
+#define MCICDA_STATUS_DECODE_MS     0x4104  /* time taken to decode the last complete track */
+#define MCICDA_STATUS_FIRST_SAMPLE_MS 0x4105 /* time from PLAY to the first block queued */
+#define MCICDA_STATUS_CACHE_HITS    0x4106  /* decode cache hits */
+#define MCICDA_STATUS_CACHE_MISSES  0x4107  /* decode cache misses */
+#define MCICDA_STATUS_BYTES_RESIDENT 0x4108 /* decoded PCM held in memory */
 
 /* Supported audio formats */
 typedef enum {
@@ -57,14 +111,101 @@ static DWORD g_dwNumTracks = 18;
 static DWORD g_dwTimeFormat = MCI_FORMAT_TMSF;
 static BOOL g_bPlaying = FALSE;
 static BOOL g_bPaused = FALSE;
+static UINT g_wDeviceID = 0;            /* MCI device ID, for notifications */
+static HWND volatile g_hNotifyWnd = NULL;   /* MCI_NOTIFY window of the current PLAY */
+
+/* Settings, read from the [mcicda] section of CONFIG_FILE on open */
+typedef struct {
+    BOOL progressive;       /* Progressive: start playing once the first block is decoded */
+    DWORD blockMs;          /* BlockMs: length of each decoded block / waveOut header */
+    DWORD queueBlocks;      /* QueueBlocks: blocks kept queued ahead of the play cursor */
+    DWORD maxQueueBlocks;   /* MaxQueueBlocks: limit for the adaptive queue depth */
+    BOOL realtime;          /* Realtime: run the refill thread under MMCSS / time-critical */
+    BOOL trace;             /* Trace: record a timeline to TRACE_FILE */
+    BOOL metrics;           /* Metrics: publish live metrics in MCICDA_METRICS_FILE */
+    DWORD coalesceMs;       /* CoalesceMs: how long a STOP waits for a following PLAY; 0 = off */
+    BOOL audioClient;       /* AudioClient: render through an mmdevapi IAudioClient, not waveOut */
+    LONG virtualClock;      /* VirtualClock: test mode, no audio device; play on a clock running
+                             * this many times real time (-1 = unthrottled, 0 = off) */
+    BOOL simdCheck;         /* SimdCheck: on open, compare every SIMD decode path against scalar */
+    DWORD preloadMB;        /* PreloadMB: read track files into memory at open, up to this many MB; 0 = off */
+    DWORD pcmCacheMB;       /* PcmCacheMB: keep decoded tracks, compressed, up to this many MB; 0 = off */
+} DriverConfig;
+
+static DriverConfig g_config = { TRUE, 250, 4, MAX_WAVE_HEADERS, TRUE, FALSE, FALSE, 100, FALSE, 0, FALSE, 0, 0 };
+
+/* Playback health. Counters are totals since the device was opened;
+ * the rest describe the current or last track. */
+typedef struct {
+    volatile LONG underruns;
+    volatile LONG lateRefills;
+    volatile LONG cacheHits;
+    volatile LONG cacheMisses;
+    volatile LONG queueDepth;
+    volatile LONG queuedMs;
+    volatile LONG minQueuedMs;
+    volatile LONG decodeMs;
+    volatile LONG firstSampleMs;
+    volatile LONG bytesResident;
+} PlaybackStats;
+
+static PlaybackStats g_stats = {0};
+
+/* Live metrics page (see mcicda_metrics.h), NULL unless Metrics is set */
+static HANDLE g_hMetricsFile = INVALID_HANDLE_VALUE;
+static HANDLE g_hMetricsMap = NULL;
+static McicdaMetrics* g_metrics = NULL;
+static LARGE_INTEGER g_metricsFreq;
+
+/* Decoded PCM, kept as a list of fixed-size blocks so playback can start
+ * before the whole track is decoded. Every block but the last holds
+ * blockFrames frames. */
+typedef struct {
+    short* samples;
+    DWORD frames;
+} PcmBlock;
+
+typedef struct {
+    PcmBlock* blocks;
+    DWORD count;
+    DWORD capacity;
+    DWORD blockFrames;
+    unsigned int channels;
+    unsigned int sampleRate;
+    unsigned long long totalFrames;
+    BOOL complete;
+} PcmTrack;
 
 /* Audio playback state */
 static HMODULE g_hWinMM = NULL;
 static HWAVEOUT g_hWaveOut = NULL;
-static WAVEHDR g_waveHdr = {0};
-static BYTE* g_pAudioData = NULL;
+static HANDLE g_hWaveEvent = NULL;
+static WAVEHDR g_waveHdrs[MAX_WAVE_HEADERS];
+static PcmTrack g_track = {0};
+static CRITICAL_SECTION g_csTrack;      /* guards g_track while the decode thread appends */
+static HANDLE g_hDecodeEvent = NULL;    /* signalled when the decode thread adds a block */
 static HANDLE g_hPlayThread = NULL;
 static volatile BOOL g_bStopRequested = FALSE;
+static volatile BOOL g_bThreadOutput = FALSE;  /* the refill thread owns the output (IAudioClient or
+                                                 * virtual clock) and follows g_bPaused when woken */
+static volatile LONG g_lPositionMs = 0;         /* play position in g_dwCurrentTrack */
+static volatile BOOL g_bEngineThread = FALSE;   /* a PlaybackThread is running; set under g_csSimdCheck */
+
+/* Command coalescing. Games send STOP, SEEK and PLAY in quick bursts, and
+ * some repeat PLAY for the track that is already playing. A STOP only
+ * pauses the device and parks the engine for CoalesceMs; a PLAY inside
+ * that window that the parked engine can serve restarts it in place
+ * instead of tearing down the device and the decode. Once the window
+ * passes, the refill thread settles the STOP itself. */
+#define PARK_NONE    0
+#define PARK_PARKED  1      /* STOP received, device paused, engine kept */
+#define PARK_SETTLED 2      /* window passed; the refill thread is stopping */
+
+static volatile LONG g_lParked = PARK_NONE;
+static DWORD g_dwParkTime;              /* GetTickCount() when the STOP arrived */
+static volatile LONG g_lRestartBlock = -1; /* block the refill thread restarts from, or -1 */
+static DWORD g_dwEngineTrack;           /* track and start offset the running engine was built for */
+static DWORD g_dwEngineStartMs;
 
 /* Function pointers for winmm.dll */
 typedef MMRESULT (WINAPI *pfnWaveOutOpen)(LPHWAVEOUT, UINT, LPCWAVEFORMATEX, DWORD_PTR, DWORD_PTR, DWORD);
@@ -85,6 +226,36 @@ static pfnWaveOutReset pWaveOutReset = NULL;
 static pfnWaveOutPause pWaveOutPause = NULL;
 static pfnWaveOutRestart pWaveOutRestart = NULL;
 
+/* Function pointer for winmm.dll's driver side, for MCI_NOTIFY */
+typedef BOOL (WINAPI *pfnMciDriverNotify)(HWND, UINT, UINT);
+
+static pfnMciDriverNotify pMciDriverNotify = NULL;
+
+/* Function pointers for avrt.dll (MMCSS), absent on older systems */
+typedef HANDLE (WINAPI *pfnAvSetMmThreadCharacteristicsA)(LPCSTR, LPDWORD);
+typedef BOOL (WINAPI *pfnAvRevertMmThreadCharacteristics)(HANDLE);
+
+static HMODULE g_hAvrt = NULL;
+static pfnAvSetMmThreadCharacteristicsA pAvSetMmThreadCharacteristicsA = NULL;
+static pfnAvRevertMmThreadCharacteristics pAvRevertMmThreadCharacteristics = NULL;
+
+/* Function pointer for kernel32.dll's GetSystemTimes, absent before XP SP1 */
+typedef BOOL (WINAPI *pfnGetSystemTimes)(LPFILETIME, LPFILETIME, LPFILETIME);
+
+static pfnGetSystemTimes pGetSystemTimes = NULL;
+
+/* Function pointers for ole32.dll, for the IAudioClient output */
+typedef HRESULT (WINAPI *pfnCoInitializeEx)(LPVOID, DWORD);
+typedef void (WINAPI *pfnCoUninitialize)(void);
+typedef HRESULT (WINAPI *pfnCoCreateInstance)(REFCLSID, LPUNKNOWN, DWORD, REFIID, LPVOID*);
+typedef void (WINAPI *pfnCoTaskMemFree)(LPVOID);
+
+static HMODULE g_hOle32 = NULL;
+static pfnCoInitializeEx pCoInitializeEx = NULL;
+static pfnCoUninitialize pCoUninitialize = NULL;
+static pfnCoCreateInstance pCoCreateInstance = NULL;
+static pfnCoTaskMemFree pCoTaskMemFree = NULL;
+
 /* Write a command to the log file (truncated on first write each session) */
 static void LogCommand(const char* fmt, ...)
 {
@@ -102,6 +273,324 @@ static void LogCommand(const char* fmt, ...)
     }
 }
 
+/* Timeline tracing. Each thread appends events to its own chunk, found
+ * through TLS, so recording takes no locks: only the owning thread writes
+ * a chunk, and it publishes an event by bumping count after filling it in.
+ * Chunks are pushed onto g_traceChunks with a compare-exchange and kept
+ * until the DLL unloads, so TRACE_FILE always holds the whole session in
+ * Chrome trace-event format (chrome://tracing, ui.perfetto.dev).
+ * Names must be string literals. */
+typedef struct {
+    const char* name;
+    const char* argName;    /* NULL for no argument */
+    LONGLONG ts;            /* QueryPerformanceCounter ticks */
+    LONGLONG dur;
+    LONG arg;
+    char phase;             /* 'X' span, 'i' instant, 'C' counter */
+} TraceEvent;
+
+typedef struct TraceChunk {
+    struct TraceChunk* next;
+    DWORD tid;
+    const char* threadName;
+    volatile LONG count;
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+} TraceChunk;
+
+static TraceChunk* volatile g_traceChunks = NULL;
+static volatile LONG g_traceChunkCount = 0;
+static volatile LONG g_traceDropped = 0;
+static DWORD g_traceTls = TLS_OUT_OF_INDEXES;
+static LARGE_INTEGER g_traceFreq;
+static LARGE_INTEGER g_traceStart;
+
+static LONGLONG TraceNow(void)
+{
+    LARGE_INTEGER now;
+    if (!g_config.trace) return 0;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+/* The calling thread's chunk, with room for one more event. NULL once
+ * TRACE_MAX_CHUNKS is reached. */
+static TraceChunk* TraceGetChunk(void)
+{
+    TraceChunk* chunk;
+    TraceChunk* head;
+
+    if (g_traceTls == TLS_OUT_OF_INDEXES) return NULL;
+    chunk = (TraceChunk*)TlsGetValue(g_traceTls);
+    if (chunk && chunk->count < TRACE_CHUNK_EVENTS) return chunk;
+
+    if (InterlockedIncrement(&g_traceChunkCount) > TRACE_MAX_CHUNKS) {
+        InterlockedDecrement(&g_traceChunkCount);
+        InterlockedIncrement(&g_traceDropped);
+        return NULL;
+    }
+    head = (TraceChunk*)calloc(1, sizeof(TraceChunk));
+    if (!head) return NULL;
+    head->tid = GetCurrentThreadId();
+    head->threadName = chunk ? chunk->threadName : NULL;
+
+    do {
+        head->next = g_traceChunks;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&g_traceChunks, head, head->next) != head->next);
+
+    TlsSetValue(g_traceTls, head);
+    return head;
+}
+
+static void TraceEmit(char phase, const char* name, LONGLONG ts, LONGLONG dur, const char* argName, LONG arg)
+{
+    TraceChunk* chunk;
+    TraceEvent* ev;
+
+    if (!g_config.trace || !(chunk = TraceGetChunk())) return;
+    ev = &chunk->events[chunk->count];
+    ev->name = name;
+    ev->argName = argName;
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->arg = arg;
+    ev->phase = phase;
+    InterlockedIncrement(&chunk->count);
+}
+
+/* Record a span from start (a TraceNow value) to now */
+static void TraceSpan(const char* name, LONGLONG start, const char* argName, LONG arg)
+{
+    LONGLONG now = TraceNow();
+    if (start) TraceEmit('X', name, start, now - start, argName, arg);
+}
+
+static void TraceInstant(const char* name, const char* argName, LONG arg)
+{
+    TraceEmit('i', name, TraceNow(), 0, argName, arg);
+}
+
+static void TraceCounter(const char* name, const char* argName, LONG value)
+{
+    TraceEmit('C', name, TraceNow(), 0, argName, value);
+}
+
+/* Label the calling thread in the timeline */
+static void TraceThreadName(const char* name)
+{
+    TraceChunk* chunk;
+    if (!g_config.trace || !(chunk = TraceGetChunk())) return;
+    chunk->threadName = name;
+}
+
+static double TraceMicros(LONGLONG ticks)
+{
+    return (double)ticks * 1000000.0 / (double)g_traceFreq.QuadPart;
+}
+
+/* Write every event recorded so far to TRACE_FILE. Safe while other
+ * threads are still recording; their newer events go in the next dump. */
+static void WriteTrace(void)
+{
+    TraceChunk* chunk;
+    const char* sep = "";
+    FILE* f;
+
+    if (!g_traceChunks) return;
+    f = fopen(TRACE_FILE, "w");
+    if (!f) {
+        LogCommand("ERROR: Cannot write %s", TRACE_FILE);
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (chunk = g_traceChunks; chunk; chunk = chunk->next) {
+        LONG count = InterlockedCompareExchange(&chunk->count, 0, 0);
+        LONG i;
+
+        if (chunk->threadName) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                       "\"args\":{\"name\":\"%s\"}}", sep, chunk->tid, chunk->threadName);
+            sep = ",";
+        }
+        for (i = 0; i < count; i++) {
+            const TraceEvent* ev = &chunk->events[i];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                    sep, ev->name, ev->phase, chunk->tid, TraceMicros(ev->ts - g_traceStart.QuadPart));
+            if (ev->phase == 'X')
+                fprintf(f, ",\"dur\":%.3f", TraceMicros(ev->dur));
+            else if (ev->phase == 'i')
+                fprintf(f, ",\"s\":\"t\"");
+            if (ev->argName)
+                fprintf(f, ",\"args\":{\"%s\":%d}", ev->argName, ev->arg);
+            fprintf(f, "}");
+            sep = ",";
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    LogCommand("Trace: %d chunks written to %s%s", g_traceChunkCount, TRACE_FILE,
+               g_traceDropped ? " (buffer full, later events dropped)" : "");
+}
+
+static void FreeTrace(void)
+{
+    TraceChunk* chunk = (TraceChunk*)InterlockedExchangePointer((PVOID volatile*)&g_traceChunks, NULL);
+    while (chunk) {
+        TraceChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/* Read settings from CONFIG_FILE. Missing keys keep their defaults. */
+static void LoadConfig(void)
+{
+    g_config.progressive = GetPrivateProfileIntA("mcicda", "Progressive", 1, CONFIG_FILE) != 0;
+    g_config.blockMs = GetPrivateProfileIntA("mcicda", "BlockMs", 250, CONFIG_FILE);
+    g_config.queueBlocks = GetPrivateProfileIntA("mcicda", "QueueBlocks", 4, CONFIG_FILE);
+    g_config.maxQueueBlocks = GetPrivateProfileIntA("mcicda", "MaxQueueBlocks", MAX_WAVE_HEADERS, CONFIG_FILE);
+    g_config.realtime = GetPrivateProfileIntA("mcicda", "Realtime", 1, CONFIG_FILE) != 0;
+    g_config.trace = GetPrivateProfileIntA("mcicda", "Trace", 0, CONFIG_FILE) != 0;
+    g_config.metrics = GetPrivateProfileIntA("mcicda", "Metrics", 0, CONFIG_FILE) != 0;
+    g_config.coalesceMs = GetPrivateProfileIntA("mcicda", "CoalesceMs", 100, CONFIG_FILE);
+    g_config.audioClient = GetPrivateProfileIntA("mcicda", "AudioClient", 0, CONFIG_FILE) != 0;
+    g_config.virtualClock = (LONG)GetPrivateProfileIntA("mcicda", "VirtualClock", 0, CONFIG_FILE);
+    g_config.simdCheck = GetPrivateProfileIntA("mcicda", "SimdCheck", 0, CONFIG_FILE) != 0;
+    g_config.preloadMB = GetPrivateProfileIntA("mcicda", "PreloadMB", 0, CONFIG_FILE);
+    g_config.pcmCacheMB = GetPrivateProfileIntA("mcicda", "PcmCacheMB", 0, CONFIG_FILE);
+
+    if (g_config.blockMs < 20) g_config.blockMs = 20;
+    if (g_config.blockMs > 5000) g_config.blockMs = 5000;
+    if (g_config.queueBlocks < 2) g_config.queueBlocks = 2;
+    if (g_config.queueBlocks > MAX_WAVE_HEADERS) g_config.queueBlocks = MAX_WAVE_HEADERS;
+    if (g_config.maxQueueBlocks < g_config.queueBlocks) g_config.maxQueueBlocks = g_config.queueBlocks;
+    if (g_config.maxQueueBlocks > MAX_WAVE_HEADERS) g_config.maxQueueBlocks = MAX_WAVE_HEADERS;
+    if (g_config.coalesceMs > 2000) g_config.coalesceMs = 2000;
+    if (g_config.virtualClock < -1) g_config.virtualClock = -1;
+    if (g_config.preloadMB > 1024) g_config.preloadMB = 1024;
+    if (g_config.pcmCacheMB > 1024) g_config.pcmCacheMB = 1024;
+
+    /* Trace timestamps are relative to the first open with tracing on */
+    if (g_config.trace && !g_traceStart.QuadPart) {
+        QueryPerformanceFrequency(&g_traceFreq);
+        QueryPerformanceCounter(&g_traceStart);
+    }
+
+    LogCommand("Config: Progressive=%d BlockMs=%u QueueBlocks=%u MaxQueueBlocks=%u Realtime=%d Trace=%d Metrics=%d CoalesceMs=%u AudioClient=%d VirtualClock=%d SimdCheck=%d PreloadMB=%u PcmCacheMB=%u",
+               g_config.progressive, g_config.blockMs, g_config.queueBlocks, g_config.maxQueueBlocks,
+               g_config.realtime, g_config.trace, g_config.metrics, g_config.coalesceMs, g_config.audioClient,
+               g_config.virtualClock, g_config.simdCheck, g_config.preloadMB, g_config.pcmCacheMB);
+}
+
+/* Map MCICDA_METRICS_FILE and initialize the metrics page. A file-backed
+ * mapping rather than a pagefile one, so the page can also be read from
+ * outside Wine. */
+static void OpenMetrics(void)
+{
+    if (g_metrics || !g_config.metrics) return;
+
+    g_hMetricsFile = CreateFileA(MCICDA_METRICS_FILE, GENERIC_READ | GENERIC_WRITE,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS,
+                                 FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_hMetricsFile == INVALID_HANDLE_VALUE) {
+        LogCommand("ERROR: Cannot create %s", MCICDA_METRICS_FILE);
+        return;
+    }
+
+    g_hMetricsMap = CreateFileMappingA(g_hMetricsFile, NULL, PAGE_READWRITE, 0, sizeof(McicdaMetrics),
+                                       MCICDA_METRICS_NAME);
+    if (g_hMetricsMap)
+        g_metrics = (McicdaMetrics*)MapViewOfFile(g_hMetricsMap, FILE_MAP_WRITE, 0, 0, sizeof(McicdaMetrics));
+    if (!g_metrics) {
+        LogCommand("ERROR: Cannot map %s", MCICDA_METRICS_FILE);
+        if (g_hMetricsMap) CloseHandle(g_hMetricsMap);
+        CloseHandle(g_hMetricsFile);
+        g_hMetricsMap = NULL;
+        g_hMetricsFile = INVALID_HANDLE_VALUE;
+        return;
+    }
+
+    QueryPerformanceFrequency(&g_metricsFreq);
+    ZeroMemory(g_metrics, sizeof(McicdaMetrics));
+    g_metrics->size = sizeof(McicdaMetrics);
+    g_metrics->version = MCICDA_METRICS_VERSION;
+    g_metrics->magic = MCICDA_METRICS_MAGIC;
+    LogCommand("Metrics: %s", MCICDA_METRICS_FILE);
+}
+
+static void CloseMetrics(void)
+{
+    if (g_metrics) {
+        g_metrics->playing = 0;
+        UnmapViewOfFile(g_metrics);
+        g_metrics = NULL;
+    }
+    if (g_hMetricsMap) {
+        CloseHandle(g_hMetricsMap);
+        g_hMetricsMap = NULL;
+    }
+    if (g_hMetricsFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_hMetricsFile);
+        g_hMetricsFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+static int MetricsCommandIndex(UINT msg)
+{
+    switch (msg) {
+    case MCI_OPEN_DRIVER:
+    case MCI_OPEN:         return MCICDA_CMD_OPEN;
+    case MCI_CLOSE_DRIVER:
+    case MCI_CLOSE:        return MCICDA_CMD_CLOSE;
+    case MCI_PLAY:         return MCICDA_CMD_PLAY;
+    case MCI_STOP:         return MCICDA_CMD_STOP;
+    case MCI_PAUSE:        return MCICDA_CMD_PAUSE;
+    case MCI_RESUME:       return MCICDA_CMD_RESUME;
+    case MCI_SEEK:         return MCICDA_CMD_SEEK;
+    case MCI_STATUS:       return MCICDA_CMD_STATUS;
+    case MCI_SET:          return MCICDA_CMD_SET;
+    case MCI_INFO:         return MCICDA_CMD_INFO;
+    default:               return MCICDA_CMD_OTHER;
+    }
+}
+
+/* Record how long an MCI command took. Commands arrive on one thread at
+ * a time, so the slot is only ever written by one thread. */
+static void MetricsCommandDone(UINT msg, LONGLONG start)
+{
+    McicdaCommandLatency* slot;
+    LARGE_INTEGER now;
+    DWORD us;
+
+    if (!g_metrics || !start) return;
+    QueryPerformanceCounter(&now);
+    us = (DWORD)((now.QuadPart - start) * 1000000 / g_metricsFreq.QuadPart);
+
+    slot = &g_metrics->commands[MetricsCommandIndex(msg)];
+    slot->lastUs = us;
+    if (us > slot->maxUs) slot->maxUs = us;
+    slot->totalUs += us;
+    slot->count++;
+    InterlockedIncrement((volatile LONG*)&g_metrics->updates);
+}
+
+/* Record how much of the track the refill thread has played, for
+ * MCI_STATUS_POSITION, and mirror its view into the metrics page */
+static void PublishPlaybackMetrics(DWORD playedMs)
+{
+    g_lPositionMs = (LONG)(g_dwEngineStartMs + playedMs);
+    if (!g_metrics) return;
+    g_metrics->positionMs = g_dwEngineStartMs + playedMs;
+    g_metrics->queuedMs = (uint32_t)g_stats.queuedMs;
+    g_metrics->queueDepth = (uint32_t)g_stats.queueDepth;
+    g_metrics->underruns = (uint32_t)g_stats.underruns;
+    g_metrics->lateRefills = (uint32_t)g_stats.lateRefills;
+    g_metrics->cacheHits = (uint32_t)g_stats.cacheHits;
+    g_metrics->cacheMisses = (uint32_t)g_stats.cacheMisses;
+    InterlockedIncrement((volatile LONG*)&g_metrics->updates);
+}
+
 /* Initialize winmm.dll function pointers */
 static BOOL InitWinMM(void)
 {
@@ -121,6 +610,7 @@ static BOOL InitWinMM(void)
     pWaveOutReset = (pfnWaveOutReset)GetProcAddress(g_hWinMM, "waveOutReset");
     pWaveOutPause = (pfnWaveOutPause)GetProcAddress(g_hWinMM, "waveOutPause");
     pWaveOutRestart = (pfnWaveOutRestart)GetProcAddress(g_hWinMM, "waveOutRestart");
+    pMciDriverNotify = (pfnMciDriverNotify)GetProcAddress(g_hWinMM, "mciDriverNotify");
 
     if (!pWaveOutOpen || !pWaveOutClose || !pWaveOutPrepareHeader ||
         !pWaveOutUnprepareHeader || !pWaveOutWrite || !pWaveOutReset) {
@@ -134,19 +624,74 @@ static BOOL InitWinMM(void)
     return TRUE;
 }
 
+/* Post an MCI_NOTIFY result to the window a command asked for */
+static void NotifyMci(HWND hwnd, UINT status)
+{
+    if (hwnd && pMciDriverNotify)
+        pMciDriverNotify(hwnd, g_wDeviceID, status);
+}
+
+/* Complete the notification of the current PLAY, if it asked for one.
+ * Only the first caller gets the window, so each PLAY is answered once. */
+static void FinishPlayNotify(UINT status)
+{
+    NotifyMci((HWND)InterlockedExchangePointer((PVOID volatile*)&g_hNotifyWnd, NULL), status);
+}
+
+/* Raise the calling thread for audio work. Uses the MMCSS "Pro Audio"
+ * task when avrt.dll is available (Wine maps it to host priorities),
+ * otherwise THREAD_PRIORITY_TIME_CRITICAL. Returns the MMCSS handle
+ * to pass to RevertAudioThreadPriority, or NULL. */
+static HANDLE BoostAudioThreadPriority(void)
+{
+    DWORD taskIndex = 0;
+    HANDLE hTask = NULL;
+
+    if (!g_config.realtime)
+        return NULL;
+
+    if (!g_hAvrt) {
+        g_hAvrt = LoadLibraryA("avrt.dll");
+        if (g_hAvrt) {
+            pAvSetMmThreadCharacteristicsA = (pfnAvSetMmThreadCharacteristicsA)GetProcAddress(g_hAvrt, "AvSetMmThreadCharacteristicsA");
+            pAvRevertMmThreadCharacteristics = (pfnAvRevertMmThreadCharacteristics)GetProcAddress(g_hAvrt, "AvRevertMmThreadCharacteristics");
+        }
+    }
+
+    if (pAvSetMmThreadCharacteristicsA && pAvRevertMmThreadCharacteristics)
+        hTask = pAvSetMmThreadCharacteristicsA("Pro Audio", &taskIndex);
+
+    if (hTask) {
+        LogCommand("Refill thread: MMCSS Pro Audio");
+    } else {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+        LogCommand("Refill thread: TIME_CRITICAL");
+    }
+    return hTask;
+}
+
+static void RevertAudioThreadPriority(HANDLE hTask)
+{
+    if (hTask)
+        pAvRevertMmThreadCharacteristics(hTask);
+}
+
 /* Build path to track file, trying multiple extensions.
  * Returns the detected format, or AUDIO_FMT_UNKNOWN if no file found. */
 static AudioFormat GetTrackPath(DWORD track, char* path, size_t pathSize)
 {
+    LONGLONG traceStart = TraceNow();
     int i;
     for (i = 0; g_extensions[i] != NULL; i++) {
         _snprintf(path, pathSize, "%strack%02d%s", MUSIC_DIR, track, g_extensions[i]);
         if (GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES) {
+            TraceSpan("Find track file", traceStart, "track", (LONG)track);
             return g_formats[i];
         }
     }
     /* No file found */
     path[0] = '\0';
+    TraceSpan("Find track file", traceStart, "track", (LONG)track);
     return AUDIO_FMT_UNKNOWN;
 }
 
@@ -157,246 +702,3108 @@ static BOOL TrackExists(DWORD track)
     return GetTrackPath(track, path, MAX_PATH) != AUDIO_FMT_UNKNOWN;
 }
 
-/* Decode audio file to 16-bit PCM.
- * Returns allocated buffer (caller must free), or NULL on failure.
- * Sets channels, sampleRate, and totalSamples (total int16 samples = frames * channels). */
-static short* DecodeAudioFile(const char* path, AudioFormat fmt,
-                              unsigned int* channels, unsigned int* sampleRate,
-                              size_t* totalSamples)
+/* Per-track index, rebuilt at open. A track can be on disk in several
+ * formats; every one is recorded, and each PLAY picks among them (see
+ * SelectTrackSource). Lengths are filled in by the probes. */
+typedef struct {
+    HANDLE hProbed;         /* manual-reset; set once lengthMs is final */
+    DWORD lengthMs;
+    DWORD sourceSize[AUDIO_FMT_OPUS + 1];   /* file size by AudioFormat, 0 if there is none */
+} TrackInfo;
+
+static TrackInfo g_tracks[MAX_TRACKS + 1];
+
+static void GetSourcePath(DWORD track, int extension, char* path, size_t pathSize)
+{
+    _snprintf(path, pathSize, "%strack%02d%s", MUSIC_DIR, track, g_extensions[extension]);
+    path[pathSize - 1] = '\0';
+}
+
+/* Record the file of every format for tracks 2..numTracks */
+static void IndexTrackSources(DWORD numTracks)
 {
-    short* pcm = NULL;
+    LONGLONG traceStart = TraceNow();
+    DWORD track;
+    int i;
 
-    switch (fmt) {
-    case AUDIO_FMT_WAV: {
-        drwav_uint64 frameCount = 0;
-        pcm = drwav_open_file_and_read_pcm_frames_s16(path, channels, sampleRate, &frameCount, NULL);
-        if (pcm) {
-            *totalSamples = (size_t)(frameCount * (*channels));
-            LogCommand("Decoded WAV: %uch %uHz, %llu frames", *channels, *sampleRate, (unsigned long long)frameCount);
+    for (track = 2; track <= MAX_TRACKS; track++) {
+        ZeroMemory(g_tracks[track].sourceSize, sizeof(g_tracks[track].sourceSize));
+        for (i = 0; track <= numTracks && g_extensions[i] != NULL; i++) {
+            WIN32_FILE_ATTRIBUTE_DATA attr;
+            char path[MAX_PATH];
+            GetSourcePath(track, i, path, MAX_PATH);
+            if (GetFileAttributesExA(path, GetFileExInfoStandard, &attr))
+                g_tracks[track].sourceSize[g_formats[i]] = attr.nFileSizeHigh ? MAXDWORD : attr.nFileSizeLow;
         }
-        break;
     }
-    case AUDIO_FMT_FLAC: {
-        drflac_uint64 frameCount = 0;
-        pcm = drflac_open_file_and_read_pcm_frames_s16(path, channels, sampleRate, &frameCount, NULL);
-        if (pcm) {
-            *totalSamples = (size_t)(frameCount * (*channels));
-            LogCommand("Decoded FLAC: %uch %uHz, %llu frames", *channels, *sampleRate, (unsigned long long)frameCount);
+    TraceSpan("Index track sources", traceStart, "tracks", (LONG)numTracks);
+}
+
+/* The smallest file the index has for a track, or GetTrackPath's pick
+ * for a track outside it */
+static AudioFormat GetSmallestTrackSource(DWORD track, char* path, size_t pathSize)
+{
+    AudioFormat best = AUDIO_FMT_UNKNOWN;
+    int i;
+
+    if (track < 2 || track > MAX_TRACKS)
+        return GetTrackPath(track, path, pathSize);
+    for (i = 0; g_extensions[i] != NULL; i++) {
+        DWORD size = g_tracks[track].sourceSize[g_formats[i]];
+        if (size && (best == AUDIO_FMT_UNKNOWN || size < g_tracks[track].sourceSize[best])) {
+            best = g_formats[i];
+            GetSourcePath(track, i, path, pathSize);
         }
-        break;
     }
-    case AUDIO_FMT_MP3: {
-        drmp3_config config = {0};
-        drmp3_uint64 frameCount = 0;
-        pcm = drmp3_open_file_and_read_pcm_frames_s16(path, &config, &frameCount, NULL);
-        if (pcm) {
-            *channels = config.channels;
-            *sampleRate = config.sampleRate;
-            *totalSamples = (size_t)(frameCount * config.channels);
-            LogCommand("Decoded MP3: %uch %uHz, %llu frames", *channels, *sampleRate, (unsigned long long)frameCount);
+    return best != AUDIO_FMT_UNKNOWN ? best : GetTrackPath(track, path, pathSize);
+}
+
+/* Header of a TOC cache file. The source file's size and write time
+ * must match for the cached data to be used. */
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    DWORD sourceSizeLow;
+    DWORD sourceSizeHigh;
+    FILETIME sourceWriteTime;
+    DWORD dataSize;
+} TocCacheHeader;
+
+/* Cache file for a track: TOC_CACHE_DIR\<track file name>.<kind> */
+static void GetTocCachePath(const char* trackPath, const char* kind, char* path, size_t pathSize)
+{
+    const char* name = strrchr(trackPath, '\\');
+    name = name ? name + 1 : trackPath;
+    _snprintf(path, pathSize, "%s%s.%s", TOC_CACHE_DIR, name, kind);
+    path[pathSize - 1] = '\0';
+}
+
+static BOOL GetTocCacheSource(const char* trackPath, TocCacheHeader* hdr)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(trackPath, GetFileExInfoStandard, &attr))
+        return FALSE;
+    ZeroMemory(hdr, sizeof(*hdr));
+    hdr->magic = TOC_CACHE_MAGIC;
+    hdr->version = TOC_CACHE_VERSION;
+    hdr->sourceSizeLow = attr.nFileSizeLow;
+    hdr->sourceSizeHigh = attr.nFileSizeHigh;
+    hdr->sourceWriteTime = attr.ftLastWriteTime;
+    return TRUE;
+}
+
+/* Load cached data for a track. Returns a malloc'd buffer, or NULL if
+ * there is no cache entry or the track file has changed since. */
+static void* LoadTocCache(const char* trackPath, const char* kind, DWORD* size)
+{
+    char path[MAX_PATH];
+    TocCacheHeader want, hdr;
+    void* data = NULL;
+    FILE* f;
+
+    if (!GetTocCacheSource(trackPath, &want))
+        return NULL;
+    GetTocCachePath(trackPath, kind, path, sizeof(path));
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == want.magic && hdr.version == want.version &&
+        hdr.sourceSizeLow == want.sourceSizeLow && hdr.sourceSizeHigh == want.sourceSizeHigh &&
+        CompareFileTime(&hdr.sourceWriteTime, &want.sourceWriteTime) == 0) {
+        data = malloc(hdr.dataSize ? hdr.dataSize : 1);
+        if (data && fread(data, 1, hdr.dataSize, f) == hdr.dataSize) {
+            *size = hdr.dataSize;
+        } else {
+            free(data);
+            data = NULL;
         }
-        break;
     }
-    case AUDIO_FMT_OGG: {
-        int ch = 0, sr = 0;
-        short* output = NULL;
-        int sampleFrames = stb_vorbis_decode_filename(path, &ch, &sr, &output);
-        if (sampleFrames > 0 && output) {
-            pcm = output;
-            *channels = (unsigned int)ch;
-            *sampleRate = (unsigned int)sr;
-            *totalSamples = (size_t)sampleFrames * (size_t)ch;
-            LogCommand("Decoded OGG: %uch %uHz, %d frames", *channels, *sampleRate, sampleFrames);
+    fclose(f);
+    return data;
+}
+
+static void SaveTocCache(const char* trackPath, const char* kind, const void* data, DWORD size)
+{
+    char path[MAX_PATH];
+    TocCacheHeader hdr;
+    FILE* f;
+
+    if (!GetTocCacheSource(trackPath, &hdr))
+        return;
+    hdr.dataSize = size;
+
+    CreateDirectoryA(TOC_CACHE_DIR, NULL);
+    GetTocCachePath(trackPath, kind, path, sizeof(path));
+    f = fopen(path, "wb");
+    if (!f) {
+        LogCommand("ERROR: Cannot write %s", path);
+        return;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(data, 1, size, f) != size) {
+        fclose(f);
+        DeleteFileA(path);
+        return;
+    }
+    fclose(f);
+}
+
+/* Scan the pages of an Ogg file and record the offset and granule position
+ * of a page every OGG_INDEX_SPACING bytes or so. Only page headers are
+ * parsed; the file is read sequentially once. Stops at the first link of
+ * a chained file. Returns the number of entries, with *points malloc'd,
+ * or 0 if playback is stopped meanwhile. */
+static int ScanOggPages(const char* path, stb_vorbis_seek_point** points)
+{
+    unsigned char header[27];
+    unsigned char lacing[255];
+    unsigned char* body;
+    stb_vorbis_seek_point* list = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long offset = 0, lastEntry = 0;
+    DWORD serial = 0;
+    FILE* f;
+
+    *points = NULL;
+    f = fopen(path, "rb");
+    if (!f) return 0;
+    body = (unsigned char*)malloc(255 * 255);
+    if (!body) {
+        fclose(f);
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, 65536);
+
+    while (!g_bStopRequested && fread(header, 1, 27, f) == 27 && memcmp(header, "OggS", 4) == 0) {
+        unsigned long long granule = 0;
+        DWORD pageSerial = header[14] | (header[15] << 8) | (header[16] << 16) | ((DWORD)header[17] << 24);
+        size_t bodySize = 0;
+        int i;
+
+        if (fread(lacing, 1, header[26], f) != header[26]) break;
+        for (i = 0; i < header[26]; i++)
+            bodySize += lacing[i];
+        if (fread(body, 1, bodySize, f) != bodySize) break;
+
+        for (i = 7; i >= 0; i--)
+            granule = (granule << 8) | header[6 + i];
+
+        if (offset == 0)
+            serial = pageSerial;
+        else if (pageSerial != serial)
+            break;
+
+        /* Granule -1 means no packet ends on this page */
+        if (granule != ~0ULL && granule > 0 && (count == 0 || offset - lastEntry >= OGG_INDEX_SPACING)) {
+            if (granule > 0xFFFFFFFFULL || offset > 0xFFFFFFFFULL) break;
+            if (count == capacity) {
+                stb_vorbis_seek_point* grown;
+                capacity = capacity ? capacity * 2 : 256;
+                grown = (stb_vorbis_seek_point*)realloc(list, capacity * sizeof(*list));
+                if (!grown) break;
+                list = grown;
+            }
+            list[count].page_offset = (unsigned int)offset;
+            list[count].last_sample = (unsigned int)granule;
+            count++;
+            lastEntry = offset;
         }
-        break;
+        offset += 27 + header[26] + bodySize;
     }
-    case AUDIO_FMT_OPUS: {
-        int error = 0;
-        OggOpusFile* of = op_open_file(path, &error);
-        if (of) {
-            ogg_int64_t totalPcmFrames = op_pcm_total(of, -1);
-            int ch = op_channel_count(of, -1);
-            /* Opus always decodes at 48000 Hz */
-            unsigned int sr = 48000;
-            if (totalPcmFrames > 0 && ch > 0) {
-                size_t totalSamp = (size_t)totalPcmFrames * (size_t)ch;
-                short* buf = (short*)malloc(totalSamp * sizeof(short));
-                if (buf) {
-                    size_t filled = 0;
-                    int link_index;
-                    while (filled < totalSamp) {
-                        int ret = op_read(of, buf + filled, (int)(totalSamp - filled), &link_index);
-                        if (ret <= 0) break;
-                        filled += (size_t)ret * (size_t)ch;
-                    }
-                    if (filled > 0) {
-                        pcm = buf;
-                        *channels = (unsigned int)ch;
-                        *sampleRate = sr;
-                        *totalSamples = filled;
-                        LogCommand("Decoded Opus: %uch %uHz, %llu frames", *channels, *sampleRate,
-                                   (unsigned long long)(filled / ch));
-                    } else {
-                        free(buf);
-                    }
+    fclose(f);
+    free(body);
+
+    /* A partial index would be cached as if it were complete */
+    if (g_bStopRequested) {
+        free(list);
+        return 0;
+    }
+    *points = list;
+    return count;
+}
+
+/* Build the page index of an Ogg Vorbis or Opus track unless the TOC
+ * cache already has one. Runs on the decode thread after the track is
+ * decoded, when the file is likely still in the OS cache. */
+static void EnsureOggPageIndex(const char* path)
+{
+    stb_vorbis_seek_point* points;
+    DWORD size;
+    void* cached = LoadTocCache(path, "pages", &size);
+    int count;
+
+    if (cached) {
+        free(cached);
+        return;
+    }
+    count = ScanOggPages(path, &points);
+    if (count > 0) {
+        SaveTocCache(path, "pages", points, count * sizeof(*points));
+        LogCommand("Page index: %d entries for %s", count, path);
+    }
+    free(points);
+}
+
+/* Parse a FLAC frame header at p (avail bytes readable). Checks the
+ * reserved bits and the header CRC-8. Returns the header length, or 0
+ * if p is not a frame header. */
+static int ParseFlacFrameHeader(const unsigned char* p, size_t avail, unsigned long long* number,
+                                BOOL* variable, DWORD* blockSize)
+{
+    static const DWORD blockSizes[16] = { 0, 192, 576, 1152, 2304, 4608, 0, 0,
+                                          256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+    unsigned char crc = 0;
+    unsigned long long n;
+    int len, extra, i, j;
+
+    if (avail < 16 || p[0] != 0xFF || (p[1] & 0xFE) != 0xF8)
+        return 0;
+    if ((p[2] >> 4) == 0 || (p[2] & 0x0F) == 0x0F || (p[3] >> 4) > 10 || (p[3] & 0x01))
+        return 0;
+
+    /* UTF-8 style coded frame or sample number */
+    if (p[4] < 0x80)      { n = p[4];        extra = 0; }
+    else if (p[4] < 0xC0) return 0;
+    else if (p[4] < 0xE0) { n = p[4] & 0x1F; extra = 1; }
+    else if (p[4] < 0xF0) { n = p[4] & 0x0F; extra = 2; }
+    else if (p[4] < 0xF8) { n = p[4] & 0x07; extra = 3; }
+    else if (p[4] < 0xFC) { n = p[4] & 0x03; extra = 4; }
+    else if (p[4] < 0xFE) { n = p[4] & 0x01; extra = 5; }
+    else if (p[4] == 0xFE) { n = 0;          extra = 6; }
+    else return 0;
+    for (i = 0; i < extra; i++) {
+        if ((p[5 + i] & 0xC0) != 0x80) return 0;
+        n = (n << 6) | (p[5 + i] & 0x3F);
+    }
+    len = 5 + extra;
+
+    *blockSize = blockSizes[p[2] >> 4];
+    if ((p[2] >> 4) == 6)      { *blockSize = p[len] + 1; len += 1; }
+    else if ((p[2] >> 4) == 7) { *blockSize = ((p[len] << 8) | p[len + 1]) + 1; len += 2; }
+    if ((p[2] & 0x0F) == 12)      len += 1;
+    else if ((p[2] & 0x0F) >= 13) len += 2;
+
+    /* CRC-8, polynomial x^8 + x^2 + x + 1 */
+    for (i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (j = 0; j < 8; j++)
+            crc = (unsigned char)((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    if (crc != p[len])
+        return 0;
+
+    *number = n;
+    *variable = p[1] & 0x01;
+    return len + 1;
+}
+
+/* Find every frame of a native FLAC file by scanning for frame sync codes
+ * from the first frame, without decoding any subframes. A candidate only
+ * counts if its header CRC matches and it starts exactly where the
+ * previous frame ended in samples, which rules out sync codes that happen
+ * to appear inside audio data. Returns the number of frames, with
+ * *points malloc'd; offsets are relative to the first frame. Returns 0
+ * if playback is stopped meanwhile. */
+static int ScanFlacFrames(const char* path, unsigned long long firstFrame, DWORD nominalBlockSize,
+                          drflac_seekpoint** points)
+{
+    enum { CHUNK = 65536, OVERLAP = 16 };
+    unsigned char* buf;
+    drflac_seekpoint* list = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long bufOffset = firstFrame;  /* file offset of buf[0] */
+    unsigned long long expected = 0;            /* first sample of the next frame */
+    size_t have = 0;
+    FILE* f;
+
+    *points = NULL;
+    f = fopen(path, "rb");
+    if (!f) return 0;
+    buf = (unsigned char*)malloc(CHUNK + OVERLAP);
+    if (!buf || fseek(f, (long)firstFrame, SEEK_SET) != 0) {
+        free(buf);
+        fclose(f);
+        return 0;
+    }
+
+    for (;;) {
+        size_t got = fread(buf + have, 1, CHUNK + OVERLAP - have, f);
+        size_t end, pos = 0;
+        BOOL eof;
+
+        have += got;
+        eof = have < CHUNK + OVERLAP;
+        /* Headers starting past 'end' may be cut off; they are looked at next time round */
+        end = eof ? have : have - OVERLAP;
+
+        while (pos < end) {
+            const unsigned char* hit = (const unsigned char*)memchr(buf + pos, 0xFF, end - pos);
+            unsigned long long number;
+            BOOL variable;
+            DWORD blockSize;
+            int len;
+
+            if (!hit) break;
+            pos = hit - buf;
+            len = ParseFlacFrameHeader(hit, have - pos, &number, &variable, &blockSize);
+            if (len > 0 && blockSize > 0 && (variable ? number : number * nominalBlockSize) == expected) {
+                if (count == capacity) {
+                    drflac_seekpoint* grown;
+                    capacity = capacity ? capacity * 2 : 1024;
+                    grown = (drflac_seekpoint*)realloc(list, capacity * sizeof(*list));
+                    if (!grown) break;
+                    list = grown;
                 }
+                list[count].firstPCMFrame = expected;
+                list[count].flacFrameOffset = bufOffset + pos - firstFrame;
+                list[count].pcmFrameCount = (drflac_uint16)blockSize;
+                count++;
+                expected += blockSize;
+                pos += len;
+            } else {
+                pos++;
             }
-            op_free(of);
-        } else {
-            LogCommand("ERROR: op_open_file failed (%d)", error);
         }
-        break;
+
+        if (eof || got == 0 || g_bStopRequested) break;
+        memmove(buf, buf + end, have - end);
+        bufOffset += end;
+        have -= end;
     }
-    default:
-        break;
+
+    fclose(f);
+    free(buf);
+    if (g_bStopRequested) {
+        free(list);
+        return 0;
+    }
+    *points = list;
+    return count;
+}
+
+/* Build the frame index of a FLAC track without a SEEKTABLE block unless
+ * the TOC cache already has one. Called on the decode thread once the
+ * track is decoded, with the decoder still open for its stream info. */
+static void EnsureFlacFrameIndex(const char* path, drflac* flac)
+{
+    drflac_seekpoint* points;
+    DWORD size;
+    void* cached;
+    int count;
+
+    if (flac->seekpointCount > 0 || flac->container != drflac_container_native || flac->firstFLACFramePosInBytes == 0)
+        return;
+    cached = LoadTocCache(path, "frames", &size);
+    if (cached) {
+        free(cached);
+        return;
+    }
+    count = ScanFlacFrames(path, flac->firstFLACFramePosInBytes, flac->maxBlockSizeInPCMFrames, &points);
+    if (count > 0) {
+        SaveTocCache(path, "frames", points, count * sizeof(*points));
+        LogCommand("Frame index: %d frames for %s", count, path);
+    }
+    free(points);
+}
+
+/* Decoded PCM cache (PcmCacheMB). Tracks decoded from their start are
+ * kept in memory, losslessly compressed, and playing one again reads it
+ * back instead of running the decoder. The codec is FLAC's without the
+ * framing: each channel of a PCM_CACHE_BLOCK_FRAMES block takes the
+ * fixed polynomial predictor (order 0-3) with the smallest residual,
+ * stereo uses whichever of left/right, left/side, side/right and mid/side
+ * is cheapest, and the residuals are Rice coded with one parameter per
+ * PCM_CACHE_PARTITION samples. Only lossy formats are cached: WAV and FLAC
+ * decode about as fast as this. Blocks stand alone, so a seek decompresses
+ * only the block it lands in; one that would not shrink is stored raw.
+ * Whole tracks are dropped least recently used to stay within the
+ * budget, except one that is being played. */
+#define PCM_CACHE_BLOCK_FRAMES 4096
+#define PCM_CACHE_PARTITION 256
+#define PCM_CACHE_MAX_CHANNELS 8
+#define RICE_ESCAPE 24              /* quotients from here on are followed by the value in full */
+#define RICE_ESCAPE_BITS 24         /* an order 3 residual of a side channel takes 21 */
+
+enum {
+    PCM_BLOCK_RAW,
+    PCM_BLOCK_INDEPENDENT,
+    PCM_BLOCK_LEFT_SIDE,
+    PCM_BLOCK_SIDE_RIGHT,
+    PCM_BLOCK_MID_SIDE
+};
+
+typedef struct PcmCacheEntry {
+    struct PcmCacheEntry* next;     /* most recently used first */
+    char path[MAX_PATH];
+    TocCacheHeader source;          /* size and write time of the file it was decoded from */
+    unsigned int channels;
+    unsigned int sampleRate;
+    unsigned long long totalFrames;
+    DWORD blockCount;
+    DWORD* offsets;                 /* blockCount + 1 offsets into data */
+    unsigned char* data;
+    LONG users;                     /* decoders reading it; guarded by g_csPcmCache */
+} PcmCacheEntry;
+
+static PcmCacheEntry* g_pcmCache = NULL;
+static size_t g_pcmCacheBytes = 0;
+static CRITICAL_SECTION g_csPcmCache;
+
+typedef struct {
+    unsigned char* p;
+    unsigned long long acc;
+    int bits;
+} BitWriter;
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    unsigned long long acc;         /* next bits, left aligned */
+    int bits;
+} BitReader;
+
+/* Scratch space for compressing one block */
+typedef struct {
+    int channel[PCM_CACHE_MAX_CHANNELS][PCM_CACHE_BLOCK_FRAMES];
+    int mid[PCM_CACHE_BLOCK_FRAMES];
+    int side[PCM_CACHE_BLOCK_FRAMES];
+    int residual[PCM_CACHE_BLOCK_FRAMES];
+    unsigned char out[PCM_CACHE_BLOCK_FRAMES * PCM_CACHE_MAX_CHANNELS * 7 + 64];
+} PcmCompressor;
+
+static int CountLeadingZeros32(DWORD x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, x);
+    return 31 - (int)index;
+#else
+    return __builtin_clz(x);
+#endif
+}
+
+/* value must fit in n bits, n <= 32 */
+static void PutBits(BitWriter* w, DWORD value, int n)
+{
+    w->acc = (w->acc << n) | value;
+    w->bits += n;
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        *w->p++ = (unsigned char)(w->acc >> w->bits);
+    }
+}
+
+static void PutRice(BitWriter* w, DWORD u, int k)
+{
+    DWORD q = u >> k;
+    if (q >= RICE_ESCAPE) {
+        PutBits(w, 1, RICE_ESCAPE + 1);
+        PutBits(w, u, RICE_ESCAPE_BITS);
+        return;
+    }
+    PutBits(w, 1, (int)q + 1);
+    if (k > 0)
+        PutBits(w, u & ((1u << k) - 1), k);
+}
+
+static void RefillBits(BitReader* r)
+{
+    while (r->bits <= 56) {
+        r->acc |= (unsigned long long)(r->p < r->end ? *r->p++ : 0) << (56 - r->bits);
+        r->bits += 8;
+    }
+}
+
+/* 1 <= n <= 32 */
+static DWORD GetBits(BitReader* r, int n)
+{
+    DWORD value;
+    RefillBits(r);
+    value = (DWORD)(r->acc >> (64 - n));
+    r->acc <<= n;
+    r->bits -= n;
+    return value;
+}
+
+static DWORD GetRice(BitReader* r, int k)
+{
+    DWORD hi;
+    int q;
+
+    RefillBits(r);
+    hi = (DWORD)(r->acc >> 32);
+    q = hi ? CountLeadingZeros32(hi) : RICE_ESCAPE;
+    if (q > RICE_ESCAPE) q = RICE_ESCAPE;
+    r->acc <<= q + 1;
+    r->bits -= q + 1;
+    if (q == RICE_ESCAPE)
+        return GetBits(r, RICE_ESCAPE_BITS);
+    return k > 0 ? ((DWORD)q << k) | GetBits(r, k) : (DWORD)q;
+}
+
+/* Fixed polynomial prediction of x[i]; order <= i */
+static int FixedPrediction(const int* x, DWORD i, int order)
+{
+    switch (order) {
+    case 1:  return x[i - 1];
+    case 2:  return 2 * x[i - 1] - x[i - 2];
+    case 3:  return 3 * (x[i - 1] - x[i - 2]) + x[i - 3];
+    default: return 0;
+    }
+}
+
+/* Order with the smallest residual over x, and that residual's size */
+static int ChooseFixedOrder(const int* x, DWORD n, unsigned long long* cost)
+{
+    unsigned long long sum[4] = {0};
+    int order = 0;
+    int i;
+    DWORD j;
+
+    for (j = 3; j < n; j++) {
+        int e0 = x[j];
+        int e1 = e0 - x[j - 1];
+        int e2 = e1 - (x[j - 1] - x[j - 2]);
+        int e3 = e2 - (x[j - 1] - 2 * x[j - 2] + x[j - 3]);
+        sum[0] += (unsigned)abs(e0);
+        sum[1] += (unsigned)abs(e1);
+        sum[2] += (unsigned)abs(e2);
+        sum[3] += (unsigned)abs(e3);
+    }
+    for (i = 1; i < 4; i++) {
+        if (sum[i] < sum[order])
+            order = i;
+    }
+    *cost = sum[order];
+    return order;
+}
+
+/* Code one channel: 2-bit order, then per partition a 5-bit Rice parameter
+ * and the residuals. The first samples use what history there is. */
+static void EncodeChannel(BitWriter* w, const int* x, DWORD n, int order, int* residual)
+{
+    DWORD i;
+    DWORD start;
+
+    for (i = 0; i < n; i++) {
+        int r = x[i] - FixedPrediction(x, i, (int)i < order ? (int)i : order);
+        residual[i] = (int)(((DWORD)r << 1) ^ (DWORD)(r >> 31));
+    }
+
+    PutBits(w, (DWORD)order, 2);
+    for (start = 0; start < n; start += PCM_CACHE_PARTITION) {
+        DWORD end = start + PCM_CACHE_PARTITION < n ? start + PCM_CACHE_PARTITION : n;
+        unsigned long long sum = 0;
+        int k = 0;
+
+        for (i = start; i < end; i++)
+            sum += (DWORD)residual[i];
+        while (k < 20 && ((unsigned long long)(end - start) << (k + 1)) <= sum)
+            k++;
+        PutBits(w, (DWORD)k, 5);
+        for (i = start; i < end; i++)
+            PutRice(w, (DWORD)residual[i], k);
+    }
+}
+
+static void DecodeChannel(BitReader* r, int* x, DWORD n)
+{
+    int order = (int)GetBits(r, 2);
+    DWORD start;
+    DWORD i;
+
+    for (start = 0; start < n; start += PCM_CACHE_PARTITION) {
+        DWORD end = start + PCM_CACHE_PARTITION < n ? start + PCM_CACHE_PARTITION : n;
+        int k = (int)GetBits(r, 5);
+        for (i = start; i < end; i++) {
+            DWORD u = GetRice(r, k);
+            x[i] = (int)(u >> 1) ^ -(int)(u & 1);
+        }
+    }
+
+    for (i = 0; i < n && (int)i < order; i++)
+        x[i] += FixedPrediction(x, i, (int)i);
+    switch (order) {
+    case 1:
+        for (; i < n; i++) x[i] += x[i - 1];
+        break;
+    case 2:
+        for (; i < n; i++) x[i] += 2 * x[i - 1] - x[i - 2];
+        break;
+    case 3:
+        for (; i < n; i++) x[i] += 3 * (x[i - 1] - x[i - 2]) + x[i - 3];
+        break;
+    }
+}
+
+/* Compress one block of interleaved PCM into c->out. Returns its size. */
+static DWORD CompressPcmBlock(PcmCompressor* c, const short* pcm, DWORD frames, unsigned int channels)
+{
+    DWORD raw = frames * channels * sizeof(short);
+    BitWriter w;
+    int orders[PCM_CACHE_MAX_CHANNELS];
+    unsigned long long costs[PCM_CACHE_MAX_CHANNELS];
+    const int* coded[PCM_CACHE_MAX_CHANNELS];
+    unsigned int ch;
+    DWORD i;
+    int mode = PCM_BLOCK_INDEPENDENT;
+    int codedOrders[PCM_CACHE_MAX_CHANNELS];
+
+    for (ch = 0; ch < channels; ch++) {
+        for (i = 0; i < frames; i++)
+            c->channel[ch][i] = pcm[i * channels + ch];
+        orders[ch] = ChooseFixedOrder(c->channel[ch], frames, &costs[ch]);
+        coded[ch] = c->channel[ch];
+        codedOrders[ch] = orders[ch];
+    }
+
+    if (channels == 2) {
+        unsigned long long midCost, sideCost, best = costs[0] + costs[1];
+        int midOrder, sideOrder;
+
+        for (i = 0; i < frames; i++) {
+            c->mid[i] = (c->channel[0][i] + c->channel[1][i]) >> 1;
+            c->side[i] = c->channel[0][i] - c->channel[1][i];
+        }
+        midOrder = ChooseFixedOrder(c->mid, frames, &midCost);
+        sideOrder = ChooseFixedOrder(c->side, frames, &sideCost);
+
+        if (costs[0] + sideCost < best) {
+            best = costs[0] + sideCost;
+            mode = PCM_BLOCK_LEFT_SIDE;
+        }
+        if (sideCost + costs[1] < best) {
+            best = sideCost + costs[1];
+            mode = PCM_BLOCK_SIDE_RIGHT;
+        }
+        if (midCost + sideCost < best)
+            mode = PCM_BLOCK_MID_SIDE;
+
+        if (mode == PCM_BLOCK_LEFT_SIDE) {
+            coded[1] = c->side;
+            codedOrders[1] = sideOrder;
+        } else if (mode == PCM_BLOCK_SIDE_RIGHT) {
+            coded[0] = c->side;
+            codedOrders[0] = sideOrder;
+        } else if (mode == PCM_BLOCK_MID_SIDE) {
+            coded[0] = c->mid;
+            codedOrders[0] = midOrder;
+            coded[1] = c->side;
+            codedOrders[1] = sideOrder;
+        }
+    }
+
+    w.p = c->out;
+    w.acc = 0;
+    w.bits = 0;
+    PutBits(&w, (DWORD)mode, 8);
+    for (ch = 0; ch < channels; ch++)
+        EncodeChannel(&w, coded[ch], frames, codedOrders[ch], c->residual);
+    if (w.bits > 0)
+        PutBits(&w, 0, 8 - w.bits);
+
+    if ((DWORD)(w.p - c->out) <= raw)
+        return (DWORD)(w.p - c->out);
+
+    c->out[0] = PCM_BLOCK_RAW;
+    memcpy(c->out + 1, pcm, raw);
+    return raw + 1;
+}
+
+/* Decompress one block into interleaved PCM. work holds channels * frames ints. */
+static void DecompressPcmBlock(const unsigned char* data, DWORD size, DWORD frames, unsigned int channels,
+                               short* pcm, int* work)
+{
+    BitReader r;
+    int mode = data[0];
+    unsigned int ch;
+    DWORD i;
+
+    if (mode == PCM_BLOCK_RAW) {
+        memcpy(pcm, data + 1, frames * channels * sizeof(short));
+        return;
+    }
+
+    r.p = data + 1;
+    r.end = data + size;
+    r.acc = 0;
+    r.bits = 0;
+    for (ch = 0; ch < channels; ch++)
+        DecodeChannel(&r, work + ch * frames, frames);
+
+    if (mode == PCM_BLOCK_INDEPENDENT) {
+        for (ch = 0; ch < channels; ch++) {
+            const int* x = work + ch * frames;
+            for (i = 0; i < frames; i++)
+                pcm[i * channels + ch] = (short)x[i];
+        }
+        return;
+    }
+
+    for (i = 0; i < frames; i++) {
+        int a = work[i];
+        int b = work[frames + i];
+        int left, right;
+
+        switch (mode) {
+        case PCM_BLOCK_LEFT_SIDE:
+            left = a;
+            right = a - b;
+            break;
+        case PCM_BLOCK_SIDE_RIGHT:
+            left = a + b;
+            right = b;
+            break;
+        default:
+            a = (int)((DWORD)a << 1) | (b & 1);
+            left = (a + b) >> 1;
+            right = (a - b) >> 1;
+            break;
+        }
+        pcm[i * 2] = (short)left;
+        pcm[i * 2 + 1] = (short)right;
+    }
+}
+
+static size_t PcmCacheEntrySize(const PcmCacheEntry* entry)
+{
+    return sizeof(*entry) + (entry->blockCount + 1) * sizeof(DWORD) + entry->offsets[entry->blockCount];
+}
+
+static void FreePcmCacheEntry(PcmCacheEntry* entry)
+{
+    free(entry->offsets);
+    free(entry->data);
+    free(entry);
+}
+
+/* Drop the least recently used idle entries until the cache fits budget.
+ * Call with g_csPcmCache held. */
+static void TrimPcmCache(size_t budget)
+{
+    while (g_pcmCacheBytes > budget) {
+        PcmCacheEntry** link;
+        PcmCacheEntry** victim = NULL;
+
+        for (link = &g_pcmCache; *link; link = &(*link)->next) {
+            if ((*link)->users == 0)
+                victim = link;
+        }
+        if (!victim)
+            break;
+
+        {
+            PcmCacheEntry* entry = *victim;
+            *victim = entry->next;
+            g_pcmCacheBytes -= PcmCacheEntrySize(entry);
+            LogCommand("PCM cache: dropped %s", entry->path);
+            FreePcmCacheEntry(entry);
+        }
+    }
+}
+
+static size_t PcmCacheBudget(void)
+{
+    return (size_t)g_config.pcmCacheMB * 1024 * 1024;
+}
+
+static BOOL UsePcmCache(AudioFormat fmt)
+{
+    return g_config.pcmCacheMB > 0 &&
+           (fmt == AUDIO_FMT_MP3 || fmt == AUDIO_FMT_OGG || fmt == AUDIO_FMT_OPUS);
+}
+
+/* Find path's entry and hold it for reading, or NULL. An entry for an
+ * older version of the file is dropped. */
+static PcmCacheEntry* AcquireCachedTrack(const char* path)
+{
+    TocCacheHeader source;
+    PcmCacheEntry** link;
+    PcmCacheEntry* entry = NULL;
+
+    if (!GetTocCacheSource(path, &source))
+        return NULL;
+
+    EnterCriticalSection(&g_csPcmCache);
+    for (link = &g_pcmCache; *link; link = &(*link)->next) {
+        if (_stricmp((*link)->path, path) == 0)
+            break;
+    }
+    if (*link) {
+        entry = *link;
+        *link = entry->next;
+        if (memcmp(&entry->source, &source, sizeof(source)) == 0) {
+            entry->next = g_pcmCache;
+            g_pcmCache = entry;
+            entry->users++;
+        } else if (entry->users == 0) {
+            g_pcmCacheBytes -= PcmCacheEntrySize(entry);
+            FreePcmCacheEntry(entry);
+            entry = NULL;
+        } else {
+            /* Still being read; unlinked here, freed on release */
+            g_pcmCacheBytes -= PcmCacheEntrySize(entry);
+            entry->next = NULL;
+            entry->path[0] = '\0';
+            entry = NULL;
+        }
+    }
+    LeaveCriticalSection(&g_csPcmCache);
+    return entry;
+}
+
+/* Whether path has an entry, without checking it is current */
+static BOOL PcmCacheHas(const char* path)
+{
+    PcmCacheEntry* entry;
+
+    EnterCriticalSection(&g_csPcmCache);
+    for (entry = g_pcmCache; entry; entry = entry->next) {
+        if (_stricmp(entry->path, path) == 0)
+            break;
+    }
+    LeaveCriticalSection(&g_csPcmCache);
+    return entry != NULL;
+}
+
+static void ReleaseCachedTrack(PcmCacheEntry* entry)
+{
+    EnterCriticalSection(&g_csPcmCache);
+    entry->users--;
+    if (entry->path[0] == '\0') {
+        if (entry->users == 0)
+            FreePcmCacheEntry(entry);
+    } else {
+        TrimPcmCache(PcmCacheBudget());
+    }
+    LeaveCriticalSection(&g_csPcmCache);
+}
+
+/* Compress a completely decoded track into the cache. Runs on the decode
+ * thread after the last block, and gives up if playback is stopped. */
+static void CacheDecodedTrack(const char* path, const PcmTrack* track)
+{
+    DWORD startTime = GetTickCount();
+    LONGLONG traceStart = TraceNow();
+    PcmCacheEntry* entry;
+    PcmCompressor* c;
+    short* pcm;
+    size_t capacity;
+    size_t used = 0;
+    size_t rawBytes;
+    DWORD block = 0;
+    DWORD source = 0;
+    DWORD sourceOffset = 0;
+    BOOL ok = TRUE;
+
+    if (track->channels == 0 || track->channels > PCM_CACHE_MAX_CHANNELS || track->totalFrames == 0)
+        return;
+    rawBytes = (size_t)(track->totalFrames * track->channels * sizeof(short));
+
+    entry = (PcmCacheEntry*)calloc(1, sizeof(*entry));
+    c = (PcmCompressor*)malloc(sizeof(*c));
+    pcm = (short*)malloc(PCM_CACHE_BLOCK_FRAMES * track->channels * sizeof(short));
+    if (!entry || !c || !pcm || !GetTocCacheSource(path, &entry->source)) {
+        free(entry);
+        free(c);
+        free(pcm);
+        return;
+    }
+    strncpy(entry->path, path, MAX_PATH - 1);
+    entry->channels = track->channels;
+    entry->sampleRate = track->sampleRate;
+    entry->totalFrames = track->totalFrames;
+    entry->blockCount = (DWORD)((track->totalFrames + PCM_CACHE_BLOCK_FRAMES - 1) / PCM_CACHE_BLOCK_FRAMES);
+    entry->offsets = (DWORD*)malloc((entry->blockCount + 1) * sizeof(DWORD));
+    capacity = (rawBytes < PcmCacheBudget() ? rawBytes : PcmCacheBudget()) / 2 + 4096;
+    entry->data = (unsigned char*)malloc(capacity);
+    ok = entry->offsets && entry->data;
+
+    /* Regroup the playback blocks into cache blocks */
+    for (block = 0; ok && block < entry->blockCount; block++) {
+        DWORD frames = 0;
+        DWORD size;
+
+        if (g_bStopRequested || used > PcmCacheBudget()) {
+            ok = FALSE;
+            break;
+        }
+        while (frames < PCM_CACHE_BLOCK_FRAMES && source < track->count) {
+            const PcmBlock* b = &track->blocks[source];
+            DWORD n = b->frames - sourceOffset;
+            if (n > PCM_CACHE_BLOCK_FRAMES - frames)
+                n = PCM_CACHE_BLOCK_FRAMES - frames;
+            memcpy(pcm + frames * track->channels, b->samples + sourceOffset * track->channels,
+                   n * track->channels * sizeof(short));
+            frames += n;
+            sourceOffset += n;
+            if (sourceOffset == b->frames) {
+                source++;
+                sourceOffset = 0;
+            }
+        }
+
+        size = CompressPcmBlock(c, pcm, frames, track->channels);
+        if (used + size > capacity) {
+            size_t newCapacity = capacity * 2 > used + size ? capacity * 2 : used + size;
+            unsigned char* data = (unsigned char*)realloc(entry->data, newCapacity);
+            if (!data) {
+                ok = FALSE;
+                break;
+            }
+            entry->data = data;
+            capacity = newCapacity;
+        }
+        entry->offsets[block] = (DWORD)used;
+        memcpy(entry->data + used, c->out, size);
+        used += size;
+    }
+    free(c);
+    free(pcm);
+
+    if (!ok) {
+        free(entry->offsets);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+    entry->offsets[entry->blockCount] = (DWORD)used;
+    if (used < capacity) {
+        unsigned char* data = (unsigned char*)realloc(entry->data, used ? used : 1);
+        if (data) entry->data = data;
+    }
+
+    EnterCriticalSection(&g_csPcmCache);
+    entry->next = g_pcmCache;
+    g_pcmCache = entry;
+    g_pcmCacheBytes += PcmCacheEntrySize(entry);
+    TrimPcmCache(PcmCacheBudget());
+    LogCommand("PCM cache: %u KB -> %u KB (%u%%) in %u ms, %u of %u KB used",
+               (DWORD)(rawBytes / 1024), (DWORD)(used / 1024), (DWORD)((unsigned long long)used * 100 / rawBytes),
+               GetTickCount() - startTime, (DWORD)(g_pcmCacheBytes / 1024), (DWORD)(PcmCacheBudget() / 1024));
+    LeaveCriticalSection(&g_csPcmCache);
+    TraceSpan("Cache PCM", traceStart, "KB", (LONG)(used / 1024));
+}
+
+static void FreePcmCache(void)
+{
+    while (g_pcmCache) {
+        PcmCacheEntry* entry = g_pcmCache;
+        g_pcmCache = entry->next;
+        FreePcmCacheEntry(entry);
+    }
+    g_pcmCacheBytes = 0;
+}
+
+/* Reads a cached track back as a decoder would */
+typedef struct {
+    PcmCacheEntry* entry;
+    unsigned long long frame;       /* next frame to return */
+    DWORD block;                    /* block held in pcm, or MAXDWORD */
+    short* pcm;
+    int* work;
+} PcmCacheReader;
+
+static BOOL OpenCacheReader(PcmCacheReader* reader, const char* path)
+{
+    ZeroMemory(reader, sizeof(*reader));
+    reader->entry = AcquireCachedTrack(path);
+    if (!reader->entry)
+        return FALSE;
+    reader->block = MAXDWORD;
+    reader->pcm = (short*)malloc(PCM_CACHE_BLOCK_FRAMES * reader->entry->channels * sizeof(short));
+    reader->work = (int*)malloc(PCM_CACHE_BLOCK_FRAMES * reader->entry->channels * sizeof(int));
+    if (!reader->pcm || !reader->work) {
+        free(reader->pcm);
+        free(reader->work);
+        ReleaseCachedTrack(reader->entry);
+        ZeroMemory(reader, sizeof(*reader));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void CloseCacheReader(PcmCacheReader* reader)
+{
+    if (!reader->entry)
+        return;
+    free(reader->pcm);
+    free(reader->work);
+    ReleaseCachedTrack(reader->entry);
+    ZeroMemory(reader, sizeof(*reader));
+}
+
+static size_t ReadCacheReader(PcmCacheReader* reader, short* out, size_t maxFrames)
+{
+    const PcmCacheEntry* entry = reader->entry;
+    unsigned int channels = entry->channels;
+    size_t filled = 0;
+
+    while (filled < maxFrames && reader->frame < entry->totalFrames) {
+        DWORD block = (DWORD)(reader->frame / PCM_CACHE_BLOCK_FRAMES);
+        DWORD offset = (DWORD)(reader->frame % PCM_CACHE_BLOCK_FRAMES);
+        DWORD frames = block + 1 < entry->blockCount
+                     ? PCM_CACHE_BLOCK_FRAMES
+                     : (DWORD)(entry->totalFrames - (unsigned long long)block * PCM_CACHE_BLOCK_FRAMES);
+        size_t n = frames - offset;
+
+        if (block != reader->block) {
+            DecompressPcmBlock(entry->data + entry->offsets[block],
+                               entry->offsets[block + 1] - entry->offsets[block],
+                               frames, channels, reader->pcm, reader->work);
+            reader->block = block;
+        }
+        if (n > maxFrames - filled)
+            n = maxFrames - filled;
+        memcpy(out + filled * channels, reader->pcm + offset * channels, n * channels * sizeof(short));
+        filled += n;
+        reader->frame += n;
+    }
+    return filled;
+}
+
+/* Track files read into memory at open (PreloadMB), by track number.
+ * Decoders hold the file they read from, so closing the device unlinks
+ * the files and the last decoder still reading one frees it. */
+typedef struct {
+    char path[MAX_PATH];            /* "" once unlinked; freed by the last user */
+    unsigned char* data;
+    size_t size;
+    LONG users;                     /* decoders reading it; guarded by g_csPreload */
+} PreloadedFile;
+
+static PreloadedFile* g_preloaded[MAX_TRACKS + 1];
+static CRITICAL_SECTION g_csPreload;
+
+static void FreePreloadedFile(PreloadedFile* file)
+{
+    free(file->data);
+    free(file);
+}
+
+/* The preloaded copy of a track file, held until ReleasePreloadedFile,
+ * or NULL if it is not in memory yet */
+static PreloadedFile* AcquirePreloadedFile(const char* path)
+{
+    PreloadedFile* file = NULL;
+    int i;
+
+    EnterCriticalSection(&g_csPreload);
+    for (i = 2; i <= MAX_TRACKS; i++) {
+        if (g_preloaded[i] && _stricmp(g_preloaded[i]->path, path) == 0) {
+            file = g_preloaded[i];
+            file->users++;
+            break;
+        }
+    }
+    LeaveCriticalSection(&g_csPreload);
+    return file;
+}
+
+static void ReleasePreloadedFile(PreloadedFile* file)
+{
+    EnterCriticalSection(&g_csPreload);
+    file->users--;
+    if (file->path[0] == '\0' && file->users == 0)
+        FreePreloadedFile(file);
+    LeaveCriticalSection(&g_csPreload);
+}
+
+/* Whether path is in memory, without holding it */
+static BOOL IsPreloaded(const char* path)
+{
+    PreloadedFile* file = AcquirePreloadedFile(path);
+    if (!file)
+        return FALSE;
+    ReleasePreloadedFile(file);
+    return TRUE;
+}
+
+/* Streaming decoder for any supported format. Produces interleaved 16-bit PCM. */
+typedef struct {
+    AudioFormat format;
+    unsigned int channels;
+    unsigned int sampleRate;
+    union {
+        drwav wav;
+        drflac* flac;
+        drmp3 mp3;
+        stb_vorbis* vorbis;
+        OggOpusFile* opus;
+    } u;
+    const unsigned char* mapped;    /* read-only view of the file, if decoding from a mapping */
+    PreloadedFile* preload;         /* held while decoding from it */
+    const unsigned char* memory;    /* the preloaded file's data, if decoding from it */
+    size_t memorySize;
+    char* arena;                    /* stb_vorbis memory, from the Vorbis pool */
+    int arenaSize;
+    PcmCacheReader cache;           /* set when reading the track from the PCM cache instead */
+} AudioDecoder;
+
+/* Decoder pools. Closing a decoder hands its memory to its format's pool
+ * and the next track in that format takes it back, so track switches
+ * reuse warm buffers instead of going to the heap: an idle OggOpusFile is
+ * reopened in place (its Opus decoder is re-initialized in the same
+ * memory, see op_reopen_callbacks), Vorbis decodes out of a recycled
+ * stb_vorbis arena, and dr_libs decoders allocate through callbacks that
+ * keep freed blocks for the next open. Besides the playing track, the
+ * length probes and the SIMD check's decoder pairs open decoders at the
+ * same time, so each format keeps up to POOL_DECODERS idle ones.
+ * Released at DLL unload. */
+#define POOL_DECODERS 8     /* playback, PROBE_THREADS probes and a SIMD check pair, plus one */
+#define POOL_BLOCKS (2 * POOL_DECODERS)
+#define VORBIS_ARENA_BYTES (256 * 1024)
+#define VORBIS_ARENA_MAX (16 * 1024 * 1024)
+
+typedef struct {
+    size_t size;                    /* usable bytes after the header */
+    size_t reserved;                /* keeps the payload at malloc alignment */
+} PoolBlock;
+
+typedef struct {
+    PoolBlock* blocks[POOL_BLOCKS]; /* freed dr_libs buffers */
+    int count;
+    OggOpusFile* opus[POOL_DECODERS];   /* idle Opus decoders */
+    int opusCount;
+    char* arenas[POOL_DECODERS];    /* idle stb_vorbis arenas */
+    int arenaSizes[POOL_DECODERS];
+    int arenaCount;
+} DecoderPool;
+
+static DecoderPool g_pools[AUDIO_FMT_OPUS + 1];
+static CRITICAL_SECTION g_csPool;
+
+/* dr_libs allocation callbacks; pUserData is the format's pool. Reuses the
+ * smallest free block that fits. */
+static void* PoolMalloc(size_t size, void* pUserData)
+{
+    DecoderPool* pool = (DecoderPool*)pUserData;
+    PoolBlock* block = NULL;
+    int best = -1;
+    int i;
+
+    EnterCriticalSection(&g_csPool);
+    for (i = 0; i < pool->count; i++) {
+        if (pool->blocks[i]->size >= size && (best < 0 || pool->blocks[i]->size < pool->blocks[best]->size))
+            best = i;
+    }
+    if (best >= 0) {
+        block = pool->blocks[best];
+        pool->blocks[best] = pool->blocks[--pool->count];
+    }
+    LeaveCriticalSection(&g_csPool);
+
+    if (!block) {
+        block = (PoolBlock*)malloc(sizeof(PoolBlock) + size);
+        if (!block) return NULL;
+        block->size = size;
+    }
+    return block + 1;
+}
+
+static void PoolFree(void* p, void* pUserData)
+{
+    DecoderPool* pool = (DecoderPool*)pUserData;
+    PoolBlock* block;
+
+    if (!p) return;
+    block = (PoolBlock*)p - 1;
+    EnterCriticalSection(&g_csPool);
+    if (pool->count < POOL_BLOCKS) {
+        pool->blocks[pool->count++] = block;
+        block = NULL;
+    }
+    LeaveCriticalSection(&g_csPool);
+    free(block);
+}
+
+static void* PoolRealloc(void* p, size_t size, void* pUserData)
+{
+    void* grown;
+
+    if (!p) return PoolMalloc(size, pUserData);
+    if (((PoolBlock*)p - 1)->size >= size) return p;
+    grown = PoolMalloc(size, pUserData);
+    if (!grown) return NULL;
+    memcpy(grown, p, ((PoolBlock*)p - 1)->size);
+    PoolFree(p, pUserData);
+    return grown;
+}
+
+/* Take a pooled Opus decoder, or NULL if there is none */
+static OggOpusFile* TakePooledOpus(void)
+{
+    DecoderPool* pool = &g_pools[AUDIO_FMT_OPUS];
+    OggOpusFile* of = NULL;
+
+    EnterCriticalSection(&g_csPool);
+    if (pool->opusCount > 0)
+        of = pool->opus[--pool->opusCount];
+    LeaveCriticalSection(&g_csPool);
+    return of;
+}
+
+/* Take the largest pooled Vorbis arena into dec, or allocate a fresh one */
+static void TakeVorbisArena(AudioDecoder* dec)
+{
+    DecoderPool* pool = &g_pools[AUDIO_FMT_OGG];
+    int best = -1;
+    int i;
+
+    dec->arena = NULL;
+    dec->arenaSize = 0;
+    EnterCriticalSection(&g_csPool);
+    for (i = 0; i < pool->arenaCount; i++) {
+        if (best < 0 || pool->arenaSizes[i] > pool->arenaSizes[best])
+            best = i;
+    }
+    if (best >= 0) {
+        dec->arena = pool->arenas[best];
+        dec->arenaSize = pool->arenaSizes[best];
+        pool->arenaCount--;
+        pool->arenas[best] = pool->arenas[pool->arenaCount];
+        pool->arenaSizes[best] = pool->arenaSizes[pool->arenaCount];
+    }
+    LeaveCriticalSection(&g_csPool);
+
+    if (!dec->arena) {
+        dec->arena = (char*)malloc(VORBIS_ARENA_BYTES);
+        dec->arenaSize = dec->arena ? VORBIS_ARENA_BYTES : 0;
+    }
+}
+
+/* Return a closed decoder's Opus state or Vorbis arena to its pool */
+static void RecycleDecoder(AudioDecoder* dec)
+{
+    DecoderPool* pool = &g_pools[dec->format];
+    OggOpusFile* opus = NULL;
+    char* arena = NULL;
+
+    EnterCriticalSection(&g_csPool);
+    if (dec->format == AUDIO_FMT_OPUS && dec->u.opus) {
+        if (pool->opusCount < POOL_DECODERS)
+            pool->opus[pool->opusCount++] = dec->u.opus;
+        else
+            opus = dec->u.opus;
+    }
+    if (dec->arena) {
+        arena = dec->arena;
+        if (pool->arenaCount < POOL_DECODERS) {
+            pool->arenas[pool->arenaCount] = dec->arena;
+            pool->arenaSizes[pool->arenaCount++] = dec->arenaSize;
+            arena = NULL;
+        } else {
+            /* Full: keep the larger of it and the smallest pooled one */
+            int smallest = 0;
+            int i;
+            for (i = 1; i < pool->arenaCount; i++) {
+                if (pool->arenaSizes[i] < pool->arenaSizes[smallest])
+                    smallest = i;
+            }
+            if (dec->arenaSize > pool->arenaSizes[smallest]) {
+                arena = pool->arenas[smallest];
+                pool->arenas[smallest] = dec->arena;
+                pool->arenaSizes[smallest] = dec->arenaSize;
+            }
+        }
+    }
+    LeaveCriticalSection(&g_csPool);
+    if (opus) op_free(opus);
+    free(arena);
+}
+
+static void FreeDecoderPools(void)
+{
+    int fmt;
+    int i;
+
+    for (fmt = 0; fmt <= AUDIO_FMT_OPUS; fmt++) {
+        DecoderPool* pool = &g_pools[fmt];
+        for (i = 0; i < pool->count; i++)
+            free(pool->blocks[i]);
+        for (i = 0; i < pool->opusCount; i++)
+            op_free(pool->opus[i]);
+        for (i = 0; i < pool->arenaCount; i++)
+            free(pool->arenas[i]);
+        ZeroMemory(pool, sizeof(*pool));
+    }
+}
+
+/* Open a Vorbis file in the decoder's arena, growing it if the stream needs
+ * more (long comments, say) and falling back to the heap past VORBIS_ARENA_MAX */
+static stb_vorbis* OpenVorbisInArena(AudioDecoder* dec, const char* path, int* error)
+{
+    stb_vorbis_alloc alloc;
+    stb_vorbis* vorbis;
+
+    while (dec->arena) {
+        alloc.alloc_buffer = dec->arena;
+        alloc.alloc_buffer_length_in_bytes = dec->arenaSize;
+        vorbis = dec->memory ? stb_vorbis_open_memory(dec->memory, (int)dec->memorySize, error, &alloc)
+                             : stb_vorbis_open_filename(path, error, &alloc);
+        if (vorbis || *error != VORBIS_outofmem)
+            return vorbis;
+        free(dec->arena);
+        dec->arena = NULL;
+        if (dec->arenaSize < VORBIS_ARENA_MAX) {
+            dec->arenaSize *= 2;
+            dec->arena = (char*)malloc(dec->arenaSize);
+        }
+    }
+    dec->arenaSize = 0;
+    if (dec->memory)
+        return stb_vorbis_open_memory(dec->memory, (int)dec->memorySize, error, NULL);
+    return stb_vorbis_open_filename(path, error, NULL);
+}
+
+static const char* FormatName(AudioFormat fmt)
+{
+    switch (fmt) {
+    case AUDIO_FMT_WAV:  return "WAV";
+    case AUDIO_FMT_FLAC: return "FLAC";
+    case AUDIO_FMT_MP3:  return "MP3";
+    case AUDIO_FMT_OGG:  return "OGG";
+    case AUDIO_FMT_OPUS: return "Opus";
+    default:             return "unknown";
+    }
+}
+
+static void CloseDecoder(AudioDecoder* dec)
+{
+    if (dec->cache.entry) {
+        CloseCacheReader(&dec->cache);
+        ZeroMemory(dec, sizeof(*dec));
+        return;
+    }
+
+    switch (dec->format) {
+    case AUDIO_FMT_WAV:
+        drwav_uninit(&dec->u.wav);
+        break;
+    case AUDIO_FMT_FLAC:
+        if (dec->u.flac) drflac_close(dec->u.flac);
+        break;
+    case AUDIO_FMT_MP3:
+        drmp3_uninit(&dec->u.mp3);
+        break;
+    case AUDIO_FMT_OGG:
+        if (dec->u.vorbis) stb_vorbis_close(dec->u.vorbis);
+        break;
+    case AUDIO_FMT_OPUS:
+        /* Decoders reading memory go back to the pool; a file-backed one
+           would keep its file open while idle */
+        if (dec->u.opus && !dec->mapped && !dec->memory) {
+            op_free(dec->u.opus);
+            dec->u.opus = NULL;
+        }
+        break;
+    default:
+        break;
+    }
+    RecycleDecoder(dec);
+    if (dec->mapped) UnmapViewOfFile(dec->mapped);
+    if (dec->preload) ReleasePreloadedFile(dec->preload);
+    ZeroMemory(dec, sizeof(*dec));
+}
+
+/* Map a whole file read-only. Returns the view (release with UnmapViewOfFile) or NULL. */
+static const unsigned char* MapTrackFile(const char* path, size_t* size)
+{
+    HANDLE file;
+    HANDLE mapping;
+    DWORD sizeHigh = 0;
+    DWORD sizeLow;
+    const unsigned char* view = NULL;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    sizeLow = GetFileSize(file, &sizeHigh);
+    if (sizeLow != INVALID_FILE_SIZE && sizeLow > 0 && sizeHigh == 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            view = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+
+    if (view) *size = sizeLow;
+    return view;
+}
+
+/* Open a decoder for the file, from its preloaded copy when there is one.
+ * Fills in channels and sampleRate. */
+static BOOL OpenDecoder(AudioDecoder* dec, const char* path, AudioFormat fmt)
+{
+    DecoderPool* pool = &g_pools[fmt];
+
+    ZeroMemory(dec, sizeof(*dec));
+    dec->format = fmt;
+    dec->preload = AcquirePreloadedFile(path);
+    if (dec->preload) {
+        dec->memory = dec->preload->data;
+        dec->memorySize = dec->preload->size;
+    }
+
+    switch (fmt) {
+    case AUDIO_FMT_WAV: {
+        drwav_allocation_callbacks alloc = { pool, PoolMalloc, PoolRealloc, PoolFree };
+        if (dec->memory ? !drwav_init_memory(&dec->u.wav, dec->memory, dec->memorySize, &alloc)
+                        : !drwav_init_file(&dec->u.wav, path, &alloc)) {
+            if (dec->preload) ReleasePreloadedFile(dec->preload);
+            return FALSE;
+        }
+        dec->channels = dec->u.wav.channels;
+        dec->sampleRate = dec->u.wav.sampleRate;
+        break;
+    }
+    case AUDIO_FMT_FLAC: {
+        drflac_allocation_callbacks alloc = { pool, PoolMalloc, PoolRealloc, PoolFree };
+        dec->u.flac = dec->memory ? drflac_open_memory(dec->memory, dec->memorySize, &alloc)
+                                  : drflac_open_file(path, &alloc);
+        if (!dec->u.flac) {
+            if (dec->preload) ReleasePreloadedFile(dec->preload);
+            return FALSE;
+        }
+        dec->channels = dec->u.flac->channels;
+        dec->sampleRate = dec->u.flac->sampleRate;
+        break;
+    }
+    case AUDIO_FMT_MP3: {
+        drmp3_allocation_callbacks alloc = { pool, PoolMalloc, PoolRealloc, PoolFree };
+        if (dec->memory ? !drmp3_init_memory(&dec->u.mp3, dec->memory, dec->memorySize, &alloc)
+                        : !drmp3_init_file(&dec->u.mp3, path, &alloc)) {
+            if (dec->preload) ReleasePreloadedFile(dec->preload);
+            return FALSE;
+        }
+        dec->channels = dec->u.mp3.channels;
+        dec->sampleRate = dec->u.mp3.sampleRate;
+        break;
+    }
+    case AUDIO_FMT_OGG: {
+        int error = 0;
+        stb_vorbis_info info;
+        TakeVorbisArena(dec);
+        dec->u.vorbis = OpenVorbisInArena(dec, path, &error);
+        if (!dec->u.vorbis) {
+            LogCommand("ERROR: stb_vorbis_open_filename failed (%d)", error);
+            CloseDecoder(dec);
+            return FALSE;
+        }
+        info = stb_vorbis_get_info(dec->u.vorbis);
+        dec->channels = (unsigned int)info.channels;
+        dec->sampleRate = info.sample_rate;
+        break;
+    }
+    case AUDIO_FMT_OPUS: {
+        int error = 0;
+        size_t size = dec->memorySize;
+        const unsigned char* data = dec->memory;
+        /* From memory or a mapping, opusfile parses pages and packets in
+           place instead of copying every byte through its sync buffer */
+        if (!data)
+            data = dec->mapped = MapTrackFile(path, &size);
+        if (data) {
+            OggOpusFile* idle = TakePooledOpus();
+            if (!idle) {
+                dec->u.opus = op_open_memory(data, size, &error);
+            } else if ((error = op_reopen_memory(idle, data, size)) == 0) {
+                dec->u.opus = idle;
+            } else {
+                op_free(idle);
+            }
+        } else
+            dec->u.opus = op_open_file(path, &error);
+        if (!dec->u.opus) {
+            LogCommand("ERROR: op_open failed (%d)", error);
+            CloseDecoder(dec);
+            return FALSE;
+        }
+        dec->channels = (unsigned int)op_channel_count(dec->u.opus, -1);
+        /* Opus always decodes at 48000 Hz */
+        dec->sampleRate = 48000;
+        break;
+    }
+    default:
+        if (dec->preload) ReleasePreloadedFile(dec->preload);
+        return FALSE;
+    }
+
+    if (dec->channels == 0 || dec->sampleRate == 0) {
+        CloseDecoder(dec);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Decode up to maxFrames frames. Returns the number of frames decoded, 0 at end of stream. */
+static size_t ReadDecoder(AudioDecoder* dec, short* out, size_t maxFrames)
+{
+    size_t filled = 0;
+
+    if (dec->cache.entry)
+        return ReadCacheReader(&dec->cache, out, maxFrames);
+
+    switch (dec->format) {
+    case AUDIO_FMT_WAV:
+        return (size_t)drwav_read_pcm_frames_s16(&dec->u.wav, maxFrames, out);
+    case AUDIO_FMT_FLAC:
+        return (size_t)drflac_read_pcm_frames_s16(dec->u.flac, maxFrames, out);
+    case AUDIO_FMT_MP3:
+        return (size_t)drmp3_read_pcm_frames_s16(&dec->u.mp3, maxFrames, out);
+    case AUDIO_FMT_OGG:
+        return (size_t)stb_vorbis_get_samples_short_interleaved(dec->u.vorbis, (int)dec->channels,
+                                                                out, (int)(maxFrames * dec->channels));
+    case AUDIO_FMT_OPUS:
+        /* op_read returns at most one packet per call */
+        while (filled < maxFrames) {
+            int ret = op_read(dec->u.opus, out + filled * dec->channels,
+                              (int)((maxFrames - filled) * dec->channels), NULL);
+            if (ret <= 0) break;
+            filled += (size_t)ret;
+        }
+        return filled;
+    default:
+        return 0;
+    }
+}
+
+/* Opus seek through the page index: jump to an indexed page at least
+ * OPUS_PREROLL_FRAMES before the target, then decode and discard up to
+ * it so the decoder has converged. */
+static BOOL SeekOpusIndexed(AudioDecoder* dec, unsigned long long frame,
+                            const stb_vorbis_seek_point* points, int count)
+{
+    const OpusHead* head = op_head(dec->u.opus, 0);
+    long long want = (long long)frame + head->pre_skip - OPUS_PREROLL_FRAMES;
+    ogg_int64_t pos;
+    short* scratch;
+    int lo = 0, hi = count;
+
+    if (op_link_count(dec->u.opus) != 1 || want <= 0)
+        return FALSE;
+
+    /* Last entry with granule <= want */
+    while (lo < hi) {
+        int m = (lo + hi) / 2;
+        if ((long long)points[m].last_sample <= want)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    if (lo == 0 || op_raw_seek(dec->u.opus, points[lo - 1].page_offset) != 0)
+        return FALSE;
+
+    pos = op_pcm_tell(dec->u.opus);
+    if (pos < 0 || (unsigned long long)pos > frame)
+        return FALSE;
+
+    scratch = (short*)malloc(4096 * dec->channels * sizeof(short));
+    if (!scratch) return FALSE;
+    while ((unsigned long long)pos < frame) {
+        unsigned long long left = frame - (unsigned long long)pos;
+        int ret = op_read(dec->u.opus, scratch, (int)((left < 4096 ? left : 4096) * dec->channels), NULL);
+        if (ret <= 0) break;
+        pos += ret;
+    }
+    free(scratch);
+    return (unsigned long long)pos == frame;
+}
+
+/* Move the decoder to the given frame. Ogg Vorbis and Opus use the page
+ * index, and FLAC files without a SEEKTABLE the frame index, from the TOC
+ * cache when there is one, instead of bisecting the file. */
+static BOOL SeekDecoder(AudioDecoder* dec, const char* path, unsigned long long frame)
+{
+    stb_vorbis_seek_point* points = NULL;
+    DWORD size = 0;
+    BOOL ok = FALSE;
+
+    if (dec->cache.entry) {
+        if (frame > dec->cache.entry->totalFrames)
+            return FALSE;
+        dec->cache.frame = frame;
+        return TRUE;
+    }
+
+    if (dec->format == AUDIO_FMT_OGG || dec->format == AUDIO_FMT_OPUS)
+        points = (stb_vorbis_seek_point*)LoadTocCache(path, "pages", &size);
+
+    switch (dec->format) {
+    case AUDIO_FMT_WAV:
+        ok = drwav_seek_to_pcm_frame(&dec->u.wav, frame);
+        break;
+    case AUDIO_FMT_FLAC:
+        if (dec->u.flac->seekpointCount == 0) {
+            drflac_seekpoint* frames = (drflac_seekpoint*)LoadTocCache(path, "frames", &size);
+            drflac_set_seek_table(dec->u.flac, frames, size / sizeof(*frames));
+            ok = drflac_seek_to_pcm_frame(dec->u.flac, frame);
+            drflac_set_seek_table(dec->u.flac, NULL, 0);
+            free(frames);
+        } else {
+            ok = drflac_seek_to_pcm_frame(dec->u.flac, frame);
+        }
+        break;
+    case AUDIO_FMT_MP3:
+        ok = drmp3_seek_to_pcm_frame(&dec->u.mp3, frame);
+        break;
+    case AUDIO_FMT_OGG:
+        stb_vorbis_set_seek_index(dec->u.vorbis, points, (int)(size / sizeof(*points)));
+        ok = stb_vorbis_seek(dec->u.vorbis, (unsigned int)frame);
+        stb_vorbis_set_seek_index(dec->u.vorbis, NULL, 0);
+        break;
+    case AUDIO_FMT_OPUS:
+        if (points)
+            ok = SeekOpusIndexed(dec, frame, points, (int)(size / sizeof(*points)));
+        if (!ok)
+            ok = op_pcm_seek(dec->u.opus, (ogg_int64_t)frame) == 0;
+        break;
+    default:
+        break;
+    }
+
+    free(points);
+    return ok;
+}
+
+/* Decode the next block of the track. Returns FALSE once the end of the stream is reached.
+ * Called from the decode thread only; new blocks are published under g_csTrack. */
+static BOOL DecodeNextBlock(AudioDecoder* dec, PcmTrack* track)
+{
+    short* samples;
+    size_t frames;
+    BOOL added = TRUE;
+    LONGLONG traceStart = TraceNow();
+
+    if (track->complete)
+        return FALSE;
+
+    samples = (short*)malloc(track->blockFrames * track->channels * sizeof(short));
+    frames = samples ? ReadDecoder(dec, samples, track->blockFrames) : 0;
+    TraceSpan("Decode block", traceStart, "block", (LONG)track->count);
+
+    EnterCriticalSection(&g_csTrack);
+    if (frames > 0 && track->count == track->capacity) {
+        DWORD newCapacity = track->capacity ? track->capacity * 2 : 64;
+        PcmBlock* blocks = (PcmBlock*)realloc(track->blocks, newCapacity * sizeof(PcmBlock));
+        if (blocks) {
+            track->blocks = blocks;
+            track->capacity = newCapacity;
+        } else {
+            frames = 0;
+        }
+    }
+    if (frames > 0) {
+        track->blocks[track->count].samples = samples;
+        track->blocks[track->count].frames = (DWORD)frames;
+        track->count++;
+        track->totalFrames += frames;
+        if (frames < track->blockFrames)
+            track->complete = TRUE;
+    } else {
+        added = FALSE;
+        track->complete = TRUE;
+    }
+    LeaveCriticalSection(&g_csTrack);
+
+    if (!added) {
+        if (!samples)
+            LogCommand("ERROR: Out of memory after %u blocks", track->count);
+        free(samples);
+    }
+    return added;
+}
+
+static void FreeTrack(PcmTrack* track)
+{
+    DWORD i;
+    for (i = 0; i < track->count; i++)
+        free(track->blocks[i].samples);
+    free(track->blocks);
+    ZeroMemory(track, sizeof(*track));
+}
+
+/* Close the device and drop the decoded track, once the refill and decode
+ * threads are gone. g_bStopRequested is left for the caller. */
+static void ReleasePlayback(void)
+{
+    int i;
+
+    if (g_hWaveOut && pWaveOutReset && pWaveOutUnprepareHeader && pWaveOutClose) {
+        pWaveOutReset(g_hWaveOut);
+        for (i = 0; i < MAX_WAVE_HEADERS; i++) {
+            if (g_waveHdrs[i].dwFlags & WHDR_PREPARED) {
+                pWaveOutUnprepareHeader(g_hWaveOut, &g_waveHdrs[i], sizeof(WAVEHDR));
+            }
+        }
+        pWaveOutClose(g_hWaveOut);
+        g_hWaveOut = NULL;
+    }
+
+    if (g_hWaveEvent) {
+        CloseHandle(g_hWaveEvent);
+        g_hWaveEvent = NULL;
+    }
+
+    FreeTrack(&g_track);
+
+    ZeroMemory(g_waveHdrs, sizeof(g_waveHdrs));
+    g_bPlaying = FALSE;
+    g_bPaused = FALSE;
+    g_bThreadOutput = FALSE;
+    g_lParked = PARK_NONE;
+    g_lRestartBlock = -1;
+
+    g_stats.bytesResident = 0;
+    if (g_metrics) {
+        g_metrics->playing = 0;
+        g_metrics->positionMs = 0;
+        g_metrics->queuedMs = 0;
+        g_metrics->decodedMs = 0;
+        g_metrics->bytesResident = 0;
+        InterlockedIncrement((volatile LONG*)&g_metrics->updates);
+    }
+}
+
+/* Stop current playback */
+static void StopPlayback(void)
+{
+    g_bStopRequested = TRUE;
+
+    if (g_hPlayThread) {
+        WaitForSingleObject(g_hPlayThread, 2000);
+        CloseHandle(g_hPlayThread);
+        g_hPlayThread = NULL;
+    }
+
+    ReleasePlayback();
+    g_bStopRequested = FALSE;
+}
+
+/* Playback thread argument */
+typedef struct {
+    char path[MAX_PATH];
+    AudioFormat format;
+    DWORD startMs;          /* offset into the track to start from */
+    DWORD requestTime;      /* GetTickCount() when the PLAY arrived */
+} PlaybackArgs;
+
+static void LogDecoded(const AudioDecoder* dec, DWORD elapsed)
+{
+    LogCommand("Decoded %s%s: %uch %uHz, %llu frames in %u ms", FormatName(dec->format),
+               dec->cache.entry ? " (PCM cache)" : "", g_track.channels, g_track.sampleRate,
+               g_track.totalFrames, elapsed);
+}
+
+/* Change the adaptive queue depth, within QueueBlocks..MaxQueueBlocks */
+static void SetQueueDepth(LONG depth, const char* reason)
+{
+    LONG old = g_stats.queueDepth;
+
+    if (depth < (LONG)g_config.queueBlocks) depth = (LONG)g_config.queueBlocks;
+    if (depth > (LONG)g_config.maxQueueBlocks) depth = (LONG)g_config.maxQueueBlocks;
+    if (depth == old) return;
+
+    InterlockedExchange(&g_stats.queueDepth, depth);
+    LogCommand("Queue depth %d -> %d (%s)", old, depth, reason);
+}
+
+static void LogHealth(void)
+{
+    LogCommand("Health: underruns=%d late_refills=%d depth=%d min_queued=%d ms",
+               g_stats.underruns, g_stats.lateRefills, g_stats.queueDepth, g_stats.minQueuedMs);
+}
+
+/* One-line summary of g_stats, returned as the MCI_INFO product string */
+static void FormatStats(char* buf, size_t size)
+{
+    _snprintf(buf, size, "mcicda-stub track=%u %s underruns=%d late=%d depth=%d queued=%dms "
+              "decode=%dms first=%dms cache=%d/%d resident=%dKB",
+              g_dwCurrentTrack, g_bPlaying ? (g_bPaused ? "paused" : "playing") : "stopped",
+              g_stats.underruns, g_stats.lateRefills, g_stats.queueDepth, g_stats.queuedMs,
+              g_stats.decodeMs, g_stats.firstSampleMs, g_stats.cacheHits,
+              g_stats.cacheHits + g_stats.cacheMisses, g_stats.bytesResident / 1024);
+    buf[size - 1] = '\0';
+}
+
+/* Queue a decoded block on the device. Blocks use header slots round-robin. */
+static BOOL QueueBlock(DWORD block)
+{
+    WAVEHDR* hdr = &g_waveHdrs[block % MAX_WAVE_HEADERS];
+    MMRESULT result;
+    LONGLONG traceStart;
+
+    ZeroMemory(hdr, sizeof(*hdr));
+    EnterCriticalSection(&g_csTrack);
+    hdr->lpData = (LPSTR)g_track.blocks[block].samples;
+    hdr->dwBufferLength = g_track.blocks[block].frames * g_track.channels * sizeof(short);
+    LeaveCriticalSection(&g_csTrack);
+
+    traceStart = TraceNow();
+    result = pWaveOutPrepareHeader(g_hWaveOut, hdr, sizeof(WAVEHDR));
+    TraceSpan("waveOutPrepareHeader", traceStart, "block", (LONG)block);
+    if (result != MMSYSERR_NOERROR) {
+        LogCommand("ERROR: waveOutPrepareHeader failed %d", result);
+        return FALSE;
+    }
+
+    traceStart = TraceNow();
+    result = pWaveOutWrite(g_hWaveOut, hdr, sizeof(WAVEHDR));
+    TraceSpan("waveOutWrite", traceStart, "block", (LONG)block);
+    if (result != MMSYSERR_NOERROR) {
+        LogCommand("ERROR: waveOutWrite failed %d", result);
+        pWaveOutUnprepareHeader(g_hWaveOut, hdr, sizeof(WAVEHDR));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Snapshot of how far the decode thread has got */
+static void GetTrackProgress(DWORD* count, BOOL* complete)
+{
+    EnterCriticalSection(&g_csTrack);
+    *count = g_track.count;
+    *complete = g_track.complete;
+    LeaveCriticalSection(&g_csTrack);
+}
+
+/* Source selection. When a track is on disk in several formats, each PLAY
+ * takes the one estimated to cost least to play right now, instead of the
+ * first in g_extensions order. The estimate, in ms, adds up:
+ *   decode  the format's measured decode time per minute of audio, times
+ *           the track length, scaled up as the CPU gets busier; a track in
+ *           the PCM cache costs the cache's measured rate instead
+ *   read    the file at SOURCE_READ_BYTES_PER_MS, unless it is preloaded
+ *           or cached
+ *   memory  when memory is tight, a millisecond per KB of file, so the
+ *           smallest source wins
+ * Decode rates start from rough priors and follow every track decoded
+ * from its start. Ties go to the g_extensions order. */
+#define SOURCE_READ_BYTES_PER_MS 100000     /* 100 MB/s */
+#define SOURCE_MIN_FREE_VIRTUAL (256 * 1024 * 1024)
+#define COST_SLOT_PCM_CACHE (AUDIO_FMT_OPUS + 1)
+
+/* Decode ms per minute of audio, by AudioFormat, then the PCM cache */
+static volatile LONG g_decodeCost[COST_SLOT_PCM_CACHE + 1] = { 0, 5, 60, 120, 100, 200, 20 };
+
+/* CPU time counters at the last load sample, in 100 ns units */
+static ULONGLONG g_cpuIdleTime = 0;
+static ULONGLONG g_cpuTotalTime = 0;
+static DWORD g_dwCpuLoad = 0;
+
+static void RecordDecodeCost(int slot, DWORD elapsed, const PcmTrack* track)
+{
+    unsigned long long audioMs = track->sampleRate ? track->totalFrames * 1000 / track->sampleRate : 0;
+    LONG sample;
+
+    /* Too short to time with GetTickCount */
+    if (audioMs < 10000)
+        return;
+    sample = (LONG)((unsigned long long)elapsed * 60000 / audioMs);
+    InterlockedExchange(&g_decodeCost[slot], (g_decodeCost[slot] * 3 + sample) / 4);
+}
+
+static ULONGLONG FileTimeToTicks(const FILETIME* ft)
+{
+    return ((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+/* Percent of CPU time spent busy since the previous sample, or the
+ * previous value if that was under 100 ms ago; 0 if unknown */
+static DWORD SampleCpuLoad(void)
+{
+    FILETIME idle, kernel, user;
+    ULONGLONG idleTime, totalTime;
+
+    if (!pGetSystemTimes) {
+        HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+        if (kernel32)
+            pGetSystemTimes = (pfnGetSystemTimes)GetProcAddress(kernel32, "GetSystemTimes");
+    }
+    if (!pGetSystemTimes || !pGetSystemTimes(&idle, &kernel, &user))
+        return 0;
+
+    /* Kernel time includes the idle time */
+    idleTime = FileTimeToTicks(&idle);
+    totalTime = FileTimeToTicks(&kernel) + FileTimeToTicks(&user);
+    if (g_cpuTotalTime && totalTime - g_cpuTotalTime < 1000000)
+        return g_dwCpuLoad;
+    if (g_cpuTotalTime && totalTime > g_cpuTotalTime && idleTime >= g_cpuIdleTime) {
+        ULONGLONG busy = (totalTime - g_cpuTotalTime) - (idleTime - g_cpuIdleTime);
+        g_dwCpuLoad = (DWORD)(busy * 100 / (totalTime - g_cpuTotalTime));
+    }
+    g_cpuIdleTime = idleTime;
+    g_cpuTotalTime = totalTime;
+    return g_dwCpuLoad;
+}
+
+/* Pick the source for a PLAY of track. Returns its format and path, like GetTrackPath. */
+static AudioFormat SelectTrackSource(DWORD track, char* path, size_t pathSize)
+{
+    const TrackInfo* info;
+    MEMORYSTATUSEX memory;
+    BOOL tight = FALSE;
+    DWORD cpuLoad;
+    AudioFormat best = AUDIO_FMT_UNKNOWN;
+    ULONGLONG bestCost = 0;
+    char costs[256];
+    int len = 0;
+    int sources = 0;
+    int i;
+
+    if (track < 2 || track > g_dwNumTracks || track > MAX_TRACKS)
+        return GetTrackPath(track, path, pathSize);
+    info = &g_tracks[track];
+    for (i = 0; g_extensions[i] != NULL; i++) {
+        if (info->sourceSize[g_formats[i]])
+            sources++;
+    }
+    if (sources < 2)
+        return GetTrackPath(track, path, pathSize);
+
+    cpuLoad = SampleCpuLoad();
+    memory.dwLength = sizeof(memory);
+    if (GlobalMemoryStatusEx(&memory))
+        tight = memory.dwMemoryLoad >= 90 || memory.ullAvailVirtual < SOURCE_MIN_FREE_VIRTUAL;
+    else
+        memory.dwMemoryLoad = 0;
+
+    costs[0] = '\0';
+    for (i = 0; g_extensions[i] != NULL; i++) {
+        AudioFormat fmt = g_formats[i];
+        DWORD size = info->sourceSize[fmt];
+        char candidate[MAX_PATH];
+        ULONGLONG cost;
+        BOOL cached;
+
+        if (!size)
+            continue;
+        GetSourcePath(track, i, candidate, MAX_PATH);
+        cached = UsePcmCache(fmt) && PcmCacheHas(candidate);
+
+        cost = (ULONGLONG)g_decodeCost[cached ? COST_SLOT_PCM_CACHE : fmt] * info->lengthMs / 60000;
+        cost = cost * 100 / (100 - (cpuLoad < 90 ? cpuLoad : 90));
+        if (!cached && !IsPreloaded(candidate))
+            cost += size / SOURCE_READ_BYTES_PER_MS;
+        if (tight && !cached)
+            cost += size / 1024;
+
+        if (len < (int)sizeof(costs)) {
+            int n = _snprintf(costs + len, sizeof(costs) - len, " %s=%u%s", FormatName(fmt), (DWORD)cost,
+                              cached ? "(cached)" : "");
+            len = n < 0 ? (int)sizeof(costs) : len + n;
+        }
+        if (best == AUDIO_FMT_UNKNOWN || cost < bestCost) {
+            best = fmt;
+            bestCost = cost;
+            strcpy(path, candidate);
+        }
+    }
+    costs[sizeof(costs) - 1] = '\0';
+
+    LogCommand("Source for track %u: %s (cpu %u%%, memory %u%%%s; est. ms%s)", track, FormatName(best),
+               cpuLoad, memory.dwMemoryLoad, tight ? ", tight" : "", costs);
+    return best;
+}
+
+/* Decode-ahead thread. Runs below normal priority and fills g_track
+ * block by block until the end of the track, signalling g_hDecodeEvent
+ * after each block. */
+static DWORD WINAPI DecodeThread(LPVOID param)
+{
+    PlaybackArgs* args = (PlaybackArgs*)param;
+    AudioDecoder dec;
+    DWORD startTime = GetTickCount();
+    LONGLONG traceStart;
+    BOOL opened;
+    BOOL cached = FALSE;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    TraceThreadName("Decode");
+
+    traceStart = TraceNow();
+    if (UsePcmCache(args->format)) {
+        ZeroMemory(&dec, sizeof(dec));
+        cached = OpenCacheReader(&dec.cache, args->path);
+        if (cached) {
+            dec.format = args->format;
+            dec.channels = dec.cache.entry->channels;
+            dec.sampleRate = dec.cache.entry->sampleRate;
+        }
+        InterlockedIncrement(cached ? &g_stats.cacheHits : &g_stats.cacheMisses);
+    }
+    opened = cached || OpenDecoder(&dec, args->path, args->format);
+    TraceSpan(cached ? "Open PCM cache" : "Open decoder", traceStart, "format", (LONG)args->format);
+    if (!opened) {
+        LogCommand("ERROR: Failed to decode %s", args->path);
+        EnterCriticalSection(&g_csTrack);
+        g_track.complete = TRUE;
+        LeaveCriticalSection(&g_csTrack);
+        SetEvent(g_hDecodeEvent);
+        return 1;
+    }
+
+    if (args->startMs > 0) {
+        unsigned long long frame = (unsigned long long)args->startMs * dec.sampleRate / 1000;
+        traceStart = TraceNow();
+        if (!SeekDecoder(&dec, args->path, frame))
+            LogCommand("ERROR: Cannot seek to %u ms in %s", args->startMs, args->path);
+        TraceSpan("Seek", traceStart, "ms", (LONG)args->startMs);
+    }
+
+    /* Format is fixed before the first block is published */
+    g_track.channels = dec.channels;
+    g_track.sampleRate = dec.sampleRate;
+    g_track.blockFrames = dec.sampleRate * g_config.blockMs / 1000;
+
+    while (!g_bStopRequested && DecodeNextBlock(&dec, &g_track)) {
+        SetEvent(g_hDecodeEvent);
+        g_stats.bytesResident = (LONG)(g_track.totalFrames * g_track.channels * sizeof(short));
+        if (g_metrics) {
+            DWORD decodedMs = (DWORD)(g_track.totalFrames * 1000 / g_track.sampleRate);
+            DWORD elapsed = GetTickCount() - startTime;
+            g_metrics->decodedMs = decodedMs;
+            if (elapsed > 0)
+                g_metrics->decodeSpeedX100 = (uint32_t)((unsigned long long)decodedMs * 100 / elapsed);
+            g_metrics->bytesResident = (uint32_t)g_stats.bytesResident;
+            InterlockedIncrement((volatile LONG*)&g_metrics->updates);
+        }
+    }
+
+    if (g_track.complete) {
+        g_stats.decodeMs = (LONG)(GetTickCount() - startTime);
+        LogDecoded(&dec, (DWORD)g_stats.decodeMs);
+        if (args->startMs == 0)
+            RecordDecodeCost(cached ? COST_SLOT_PCM_CACHE : (int)args->format, (DWORD)g_stats.decodeMs, &g_track);
+    }
+    SetEvent(g_hDecodeEvent);
+
+    if (g_track.complete && !cached && args->format == AUDIO_FMT_FLAC) {
+        traceStart = TraceNow();
+        EnsureFlacFrameIndex(args->path, dec.u.flac);
+        TraceSpan("Index FLAC frames", traceStart, NULL, 0);
+    }
+    CloseDecoder(&dec);
+
+    if (g_track.complete && !cached && args->startMs == 0 && UsePcmCache(args->format))
+        CacheDecodedTrack(args->path, &g_track);
+
+    /* Index the pages for later seeks while the file is still warm */
+    if (g_track.complete && !cached && (args->format == AUDIO_FMT_OGG || args->format == AUDIO_FMT_OPUS)) {
+        traceStart = TraceNow();
+        EnsureOggPageIndex(args->path);
+        TraceSpan("Index Ogg pages", traceStart, NULL, 0);
+    }
+    return 0;
+}
+
+/* SIMD self-check (SimdCheck=1). The decoders pick SIMD paths by CPUID,
+ * and each can be capped at a lower level. For every track, each level
+ * the CPU has is decoded in lockstep with the scalar path and compared
+ * sample by sample; the log gets the result and the speed of each. The
+ * Vorbis and FLAC kernels and the Ogg CRC (used by Opus) must match
+ * exactly; dr_mp3's SSE2 float code may round differently, so MP3 is
+ * allowed SIMD_CHECK_MP3_TOLERANCE. The levels are process-wide, so the
+ * check only runs while the engine is idle, which also keeps its timings
+ * clean: each chunk is decoded at the lowered levels under g_csSimdCheck
+ * and the levels are back at their widest outside it, and a PLAY takes the
+ * lock before starting the engine. A variant interrupted by a PLAY is
+ * checked again from the start once playback has finished. */
+#define SIMD_CHECK_FRAMES 4096
+#define SIMD_CHECK_MP3_TOLERANCE 1
+#define SIMD_CHECK_IDLE_POLL_MS 250
+
+typedef struct {
+    AudioFormat format;
+    int level;              /* 0 is the scalar reference */
+    const char* name;
+} SimdVariant;
+
+static const SimdVariant g_simdVariants[] = {
+    { AUDIO_FMT_FLAC, DRFLAC_SIMD_SSE2, "SSE2" },
+    { AUDIO_FMT_FLAC, DRFLAC_SIMD_SSE41, "SSE4.1" },
+    { AUDIO_FMT_FLAC, DRFLAC_SIMD_AVX2, "AVX2" },
+    { AUDIO_FMT_MP3, 1, "SSE2" },
+    { AUDIO_FMT_OGG, STB_VORBIS_SIMD_SSE2, "SSE2" },
+    { AUDIO_FMT_OGG, STB_VORBIS_SIMD_AVX2, "AVX2" },
+    { AUDIO_FMT_OPUS, 1, "PCLMUL CRC" },
+};
+
+static HANDLE g_hSimdCheckThread = NULL;
+static volatile BOOL g_bSimdCheckStop = FALSE;
+static CRITICAL_SECTION g_csSimdCheck;
+
+/* Cap a format's SIMD paths at level; returns the level in effect */
+static int SetSimdLevel(AudioFormat fmt, int level)
+{
+    switch (fmt) {
+    case AUDIO_FMT_FLAC: return drflac_set_simd_level(level);
+    case AUDIO_FMT_MP3:  return drmp3dec_set_simd_enabled(level > 0) ? 1 : 0;
+    case AUDIO_FMT_OGG:  return stb_vorbis_set_simd_level(level);
+    case AUDIO_FMT_OPUS: return ogg_crc_set_simd(level > 0) ? 1 : 0;
+    default:             return 0;
+    }
+}
+
+/* Fill out with frames from dec, however many calls that takes */
+static size_t ReadDecoderFull(AudioDecoder* dec, short* out, size_t frames)
+{
+    size_t filled = 0;
+    while (filled < frames) {
+        size_t got = ReadDecoder(dec, out + filled * dec->channels, frames - filled);
+        if (got == 0) break;
+        filled += got;
+    }
+    return filled;
+}
+
+/* Decode a track at variant->level and at scalar side by side and log
+ * how they compare. Returns FALSE on a mismatch. Sets *deferred if the
+ * engine started meanwhile; the caller then runs it again from the start. */
+static BOOL CheckSimdVariant(const char* path, const char* name, const SimdVariant* variant, BOOL* deferred)
+{
+    AudioDecoder ref, test;
+    LARGE_INTEGER freq, t0, t1;
+    LONGLONG refTicks = 0, testTicks = 0;
+    unsigned long long frames = 0;
+    short* refBuf = NULL;
+    short* testBuf = NULL;
+    int maxDiff = 0;
+    int tolerance = variant->format == AUDIO_FMT_MP3 ? SIMD_CHECK_MP3_TOLERANCE : 0;
+    const char* verdict = NULL;
+    BOOL ok = FALSE;
+
+    *deferred = FALSE;
+    if (!OpenDecoder(&ref, path, variant->format))
+        return TRUE;
+    if (!OpenDecoder(&test, path, variant->format)) {
+        CloseDecoder(&ref);
+        return TRUE;
+    }
+    refBuf = (short*)malloc(SIMD_CHECK_FRAMES * ref.channels * sizeof(short));
+    testBuf = (short*)malloc(SIMD_CHECK_FRAMES * ref.channels * sizeof(short));
+    QueryPerformanceFrequency(&freq);
+
+    while (refBuf && testBuf && !g_bSimdCheckStop) {
+        size_t refFrames, testFrames, i;
+
+        EnterCriticalSection(&g_csSimdCheck);
+        if (g_bEngineThread) {
+            LeaveCriticalSection(&g_csSimdCheck);
+            *deferred = TRUE;
+            verdict = NULL;
+            break;
+        }
+        SetSimdLevel(variant->format, 0);
+        QueryPerformanceCounter(&t0);
+        refFrames = ReadDecoderFull(&ref, refBuf, SIMD_CHECK_FRAMES);
+        QueryPerformanceCounter(&t1);
+        refTicks += t1.QuadPart - t0.QuadPart;
+
+        SetSimdLevel(variant->format, variant->level);
+        QueryPerformanceCounter(&t0);
+        testFrames = ReadDecoderFull(&test, testBuf, SIMD_CHECK_FRAMES);
+        QueryPerformanceCounter(&t1);
+        testTicks += t1.QuadPart - t0.QuadPart;
+        SetSimdLevel(variant->format, INT_MAX);
+        LeaveCriticalSection(&g_csSimdCheck);
+
+        for (i = 0; i < (refFrames < testFrames ? refFrames : testFrames) * ref.channels; i++) {
+            int diff = abs(refBuf[i] - testBuf[i]);
+            if (diff > maxDiff) maxDiff = diff;
+        }
+        if (maxDiff > tolerance && !verdict) {
+            LogCommand("SIMD check %s %s: differs by up to %d within frames %llu-%llu", name, variant->name,
+                       maxDiff, frames, frames + refFrames);
+            verdict = "MISMATCH";
+        }
+        frames += refFrames;
+        if (refFrames != testFrames) {
+            LogCommand("SIMD check %s %s: length differs, %llu vs %llu frames", name, variant->name,
+                       frames, frames - refFrames + testFrames);
+            verdict = "MISMATCH";
+            break;
+        }
+        if (refFrames < SIMD_CHECK_FRAMES) {
+            if (!verdict) {
+                verdict = maxDiff ? "within tolerance" : "identical";
+                ok = TRUE;
+            }
+            break;
+        }
+    }
+
+    if (verdict && refTicks > 0 && testTicks > 0) {
+        DWORD seconds10 = (DWORD)(frames * 10 / ref.sampleRate);
+        LogCommand("SIMD check %s %s: %s (max diff %d), %u.%u s of audio, scalar %u ms, %s %u ms (%u.%02ux)",
+                   name, variant->name, verdict, maxDiff, seconds10 / 10, seconds10 % 10,
+                   (DWORD)(refTicks * 1000 / freq.QuadPart), variant->name,
+                   (DWORD)(testTicks * 1000 / freq.QuadPart),
+                   (DWORD)(refTicks / testTicks), (DWORD)(refTicks * 100 / testTicks % 100));
+    }
+    free(refBuf);
+    free(testBuf);
+    CloseDecoder(&ref);
+    CloseDecoder(&test);
+    return ok || !verdict;
+}
+
+/* Wait until no PlaybackThread is running. Returns FALSE if the check is
+ * stopped first. */
+static BOOL WaitForIdleEngine(void)
+{
+    while (g_bEngineThread && !g_bSimdCheckStop)
+        Sleep(SIMD_CHECK_IDLE_POLL_MS);
+    return !g_bSimdCheckStop;
+}
+
+static DWORD WINAPI SimdCheckThread(LPVOID param)
+{
+    DWORD numTracks = (DWORD)(DWORD_PTR)param;
+    DWORD checked = 0, failed = 0;
+    DWORD track;
+    int i;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    TraceThreadName("SIMD check");
+
+    for (track = 2; track <= numTracks && !g_bSimdCheckStop; track++) {
+        char path[MAX_PATH];
+        AudioFormat fmt = GetTrackPath(track, path, MAX_PATH);
+        const char* name = strrchr(path, '\\');
+
+        name = name ? name + 1 : path;
+        for (i = 0; i < (int)(sizeof(g_simdVariants) / sizeof(g_simdVariants[0])) && !g_bSimdCheckStop; i++) {
+            const SimdVariant* variant = &g_simdVariants[i];
+            BOOL available, ok;
+            BOOL deferred = FALSE;
+
+            if (variant->format != fmt || !WaitForIdleEngine())
+                continue;
+            /* 64-bit dr_mp3 has no scalar path to compare against */
+            EnterCriticalSection(&g_csSimdCheck);
+            available = SetSimdLevel(fmt, 0) == 0 && SetSimdLevel(fmt, variant->level) == variant->level;
+            SetSimdLevel(fmt, INT_MAX);
+            LeaveCriticalSection(&g_csSimdCheck);
+            if (!available) {
+                LogCommand("SIMD check %s %s: not available in this build or CPU", name, variant->name);
+                continue;
+            }
+            do {
+                ok = CheckSimdVariant(path, name, variant, &deferred);
+            } while (deferred && WaitForIdleEngine());
+            if (deferred)
+                continue;
+            checked++;
+            if (!ok)
+                failed++;
+        }
+    }
+
+    LogCommand("SIMD check %s: %u variants, %u mismatched", g_bSimdCheckStop ? "cancelled" : "done",
+               checked, failed);
+    return 0;
+}
+
+static void StartSimdCheck(void)
+{
+    if (!g_config.simdCheck || g_hSimdCheckThread) return;
+    g_bSimdCheckStop = FALSE;
+    g_hSimdCheckThread = CreateThread(NULL, 0, SimdCheckThread, (LPVOID)(DWORD_PTR)g_dwNumTracks, 0, NULL);
+}
+
+static void StopSimdCheck(void)
+{
+    if (!g_hSimdCheckThread) return;
+    g_bSimdCheckStop = TRUE;
+    /* It stops within a chunk, or one idle poll */
+    WaitForSingleObject(g_hSimdCheckThread, INFINITE);
+    CloseHandle(g_hSimdCheckThread);
+    g_hSimdCheckThread = NULL;
+}
+
+/* Refill threads: settle a parked STOP once CoalesceMs has passed without
+ * a PLAY. Returns TRUE when the thread should stop; otherwise shortens
+ * *waitMs so the thread wakes in time to check again. */
+static BOOL SettleParkedStop(DWORD* waitMs)
+{
+    DWORD parkedMs;
+
+    if (g_lParked != PARK_PARKED)
+        return FALSE;
+    parkedMs = GetTickCount() - g_dwParkTime;
+    if (parkedMs < g_config.coalesceMs) {
+        if (g_config.coalesceMs - parkedMs < *waitMs)
+            *waitMs = g_config.coalesceMs - parkedMs;
+        return FALSE;
+    }
+    if (InterlockedCompareExchange(&g_lParked, PARK_SETTLED, PARK_PARKED) != PARK_PARKED)
+        return FALSE;
+    g_bStopRequested = TRUE;
+    return TRUE;
+}
+
+/* Refill threads: the last block has played. Like a drive reaching the
+ * end of a track, the device reports stopped and the PLAY is answered. */
+static void TrackFinished(void)
+{
+    LogCommand("PLAYBACK_DONE");
+    g_dwEngineTrack = 0;    /* nothing left for a PLAY to continue */
+    g_bPlaying = FALSE;
+    if (g_metrics) g_metrics->playing = 0;
+    FinishPlayNotify(MCI_NOTIFY_SUCCESSFUL);
+}
+
+/* Output through mmdevapi. Under Wine, waveOut is itself layered on
+ * mmdevapi and adds a copy and its own buffering; with AudioClient set,
+ * the refill thread instead runs a shared-mode, event-driven IAudioClient
+ * and copies decoded blocks straight into its render buffer. The stream
+ * uses the engine's mix format when the track's sample rate matches it,
+ * converting samples during the copy, so the engine has nothing to
+ * resample; otherwise the engine converts the track's own format. All
+ * COM calls stay on the refill thread. Without mmdevapi, or if the
+ * stream cannot be opened, playback falls back to waveOut. */
+#define AUDIO_CLIENT_BUFFER_MS 100
+
+#ifndef AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM
+#define AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM 0x80000000
+#endif
+#ifndef AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY
+#define AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY 0x08000000
+#endif
+
+/* Defined here rather than taken from uuid.lib / ksuser.lib */
+static const GUID g_clsidMMDeviceEnumerator = { 0xBCDE0395, 0xE52F, 0x467C, { 0x8E, 0x3D, 0xC4, 0x57, 0x92, 0x91, 0x69, 0x2E } };
+static const GUID g_iidIMMDeviceEnumerator = { 0xA95664D2, 0x9614, 0x4F35, { 0xA7, 0x46, 0xDE, 0x8D, 0xB6, 0x36, 0x17, 0xE6 } };
+static const GUID g_iidIAudioClient = { 0x1CB9AD4C, 0xDBFA, 0x4C32, { 0xB1, 0x78, 0xC2, 0xF5, 0x68, 0xA7, 0x03, 0xB2 } };
+static const GUID g_iidIAudioRenderClient = { 0xF294ACFC, 0x3146, 0x4483, { 0xA7, 0xBF, 0xAD, 0xDC, 0xA7, 0xC2, 0x60, 0xE2 } };
+static const GUID g_subtypePcm = { 0x00000001, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 } };
+static const GUID g_subtypeIeeeFloat = { 0x00000003, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 } };
+
+typedef struct {
+    IMMDeviceEnumerator* enumerator;
+    IMMDevice* device;
+    IAudioClient* client;
+    IAudioRenderClient* render;
+    UINT32 bufferFrames;
+    unsigned int channels;  /* stream channels; extra ones past the track's stay silent */
+    BOOL floatSamples;      /* stream takes 32-bit float rather than 16-bit PCM */
+} AudioClientOutput;
+
+/* Initialize ole32.dll function pointers */
+static BOOL InitOle32(void)
+{
+    if (g_hOle32) return pCoCreateInstance != NULL;
+
+    g_hOle32 = LoadLibraryA("ole32.dll");
+    if (!g_hOle32) {
+        LogCommand("AudioClient: cannot load ole32.dll");
+        return FALSE;
+    }
+
+    pCoInitializeEx = (pfnCoInitializeEx)GetProcAddress(g_hOle32, "CoInitializeEx");
+    pCoUninitialize = (pfnCoUninitialize)GetProcAddress(g_hOle32, "CoUninitialize");
+    pCoCreateInstance = (pfnCoCreateInstance)GetProcAddress(g_hOle32, "CoCreateInstance");
+    pCoTaskMemFree = (pfnCoTaskMemFree)GetProcAddress(g_hOle32, "CoTaskMemFree");
+
+    if (!pCoInitializeEx || !pCoUninitialize || !pCoCreateInstance || !pCoTaskMemFree) {
+        LogCommand("AudioClient: cannot get ole32 function pointers");
+        pCoCreateInstance = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Can the refill thread write the mix format itself: 16-bit PCM or
+ * 32-bit float? */
+static BOOL MixFormatUsable(const WAVEFORMATEX* mix, BOOL* floatSamples)
+{
+    WORD tag = mix->wFormatTag;
+
+    if (tag == WAVE_FORMAT_EXTENSIBLE && mix->cbSize >= 22) {
+        const WAVEFORMATEXTENSIBLE* ext = (const WAVEFORMATEXTENSIBLE*)mix;
+        if (IsEqualGUID(&ext->SubFormat, &g_subtypeIeeeFloat))
+            tag = WAVE_FORMAT_IEEE_FLOAT;
+        else if (IsEqualGUID(&ext->SubFormat, &g_subtypePcm))
+            tag = WAVE_FORMAT_PCM;
+        if (ext->Samples.wValidBitsPerSample != mix->wBitsPerSample)
+            return FALSE;
+    }
+
+    *floatSamples = tag == WAVE_FORMAT_IEEE_FLOAT;
+    if (tag == WAVE_FORMAT_IEEE_FLOAT)
+        return mix->wBitsPerSample == 32;
+    return tag == WAVE_FORMAT_PCM && mix->wBitsPerSample == 16;
+}
+
+static void CloseAudioClient(AudioClientOutput* out)
+{
+    if (out->render) IAudioRenderClient_Release(out->render);
+    if (out->client) {
+        IAudioClient_Stop(out->client);
+        IAudioClient_Release(out->client);
+    }
+    if (out->device) IMMDevice_Release(out->device);
+    if (out->enumerator) IMMDeviceEnumerator_Release(out->enumerator);
+    ZeroMemory(out, sizeof(*out));
+}
+
+/* Open a shared-mode, event-driven stream on the default render device
+ * for g_track's format, signalling hEvent whenever it wants data */
+static BOOL OpenAudioClient(AudioClientOutput* out, HANDLE hEvent)
+{
+    WAVEFORMATEX* mix = NULL;
+    WAVEFORMATEX pcm;
+    const WAVEFORMATEX* fmt;
+    DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+    HRESULT hr;
+
+    ZeroMemory(out, sizeof(*out));
+    hr = pCoCreateInstance(&g_clsidMMDeviceEnumerator, NULL, CLSCTX_ALL, &g_iidIMMDeviceEnumerator,
+                           (void**)&out->enumerator);
+    if (SUCCEEDED(hr))
+        hr = IMMDeviceEnumerator_GetDefaultAudioEndpoint(out->enumerator, eRender, eConsole, &out->device);
+    if (SUCCEEDED(hr))
+        hr = IMMDevice_Activate(out->device, &g_iidIAudioClient, CLSCTX_ALL, NULL, (void**)&out->client);
+    if (SUCCEEDED(hr))
+        hr = IAudioClient_GetMixFormat(out->client, &mix);
+    if (FAILED(hr)) {
+        LogCommand("AudioClient: no render device (0x%08x), using waveOut", (unsigned)hr);
+        CloseAudioClient(out);
+        return FALSE;
+    }
+
+    if (mix->nSamplesPerSec == g_track.sampleRate && MixFormatUsable(mix, &out->floatSamples) &&
+        (g_track.channels <= 2 ? mix->nChannels >= g_track.channels : mix->nChannels == g_track.channels)) {
+        fmt = mix;
+        out->channels = mix->nChannels;
+    } else {
+        pcm.wFormatTag = WAVE_FORMAT_PCM;
+        pcm.nChannels = (WORD)g_track.channels;
+        pcm.nSamplesPerSec = g_track.sampleRate;
+        pcm.wBitsPerSample = 16;
+        pcm.nBlockAlign = (WORD)(g_track.channels * 2);
+        pcm.nAvgBytesPerSec = g_track.sampleRate * g_track.channels * 2;
+        pcm.cbSize = 0;
+        fmt = &pcm;
+        out->channels = g_track.channels;
+        out->floatSamples = FALSE;
+        flags |= AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+    }
+
+    LogCommand("AudioClient: mix %uch %uHz %ubit, stream %uch %uHz %s%s", mix->nChannels, mix->nSamplesPerSec,
+               mix->wBitsPerSample, out->channels, fmt->nSamplesPerSec, out->floatSamples ? "float" : "16bit",
+               fmt == mix ? "" : " (converted by the engine)");
+
+    hr = IAudioClient_Initialize(out->client, AUDCLNT_SHAREMODE_SHARED, flags,
+                                 (REFERENCE_TIME)AUDIO_CLIENT_BUFFER_MS * 10000, 0, fmt, NULL);
+    pCoTaskMemFree(mix);
+    if (SUCCEEDED(hr))
+        hr = IAudioClient_SetEventHandle(out->client, hEvent);
+    if (SUCCEEDED(hr))
+        hr = IAudioClient_GetBufferSize(out->client, &out->bufferFrames);
+    if (SUCCEEDED(hr))
+        hr = IAudioClient_GetService(out->client, &g_iidIAudioRenderClient, (void**)&out->render);
+    if (FAILED(hr)) {
+        LogCommand("AudioClient: cannot open stream (0x%08x), using waveOut", (unsigned)hr);
+        CloseAudioClient(out);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Copy 16-bit frames into the render buffer in the stream's format. A
+ * mono track fills the first two channels. */
+static void WriteAudioClientFrames(const AudioClientOutput* out, BYTE* dst, const short* src, DWORD frames)
+{
+    unsigned int inChannels = g_track.channels;
+    unsigned int c;
+    DWORD i;
+
+    if (!out->floatSamples && out->channels == inChannels) {
+        memcpy(dst, src, frames * inChannels * sizeof(short));
+        return;
+    }
+
+    for (i = 0; i < frames; i++, src += inChannels) {
+        for (c = 0; c < out->channels; c++) {
+            short sample = 0;
+            if (c < inChannels)
+                sample = src[c];
+            else if (c == 1 && inChannels == 1)
+                sample = src[0];
+            if (out->floatSamples)
+                ((float*)dst)[c] = sample * (1.0f / 32768.0f);
+            else
+                ((short*)dst)[c] = sample;
+        }
+        dst += out->channels * (out->floatSamples ? sizeof(float) : sizeof(short));
+    }
+}
+
+/* Refill loop for the IAudioClient output, run by PlaybackThread once the
+ * first block is decoded. Returns FALSE, having played nothing, when the
+ * stream cannot be opened, and the caller falls back to waveOut. */
+static BOOL RenderAudioClient(PlaybackArgs* args)
+{
+    AudioClientOutput out;
+    HANDLE waitHandles[2];
+    HRESULT coInit;
+    DWORD block = 0;        /* next frame to write: block, and frame within it */
+    DWORD offset = 0;
+    DWORD baseBlock = 0;    /* block the stream was last (re)started from */
+    unsigned long long written = 0;     /* frames written since then */
+    DWORD count;
+    BOOL complete;
+    BOOL running = FALSE;
+    BOOL started = FALSE;
+    BOOL dry = FALSE;
+
+    if (!InitOle32())
+        return FALSE;
+
+    /* RPC_E_CHANGED_MODE still leaves COM usable; only balance our own init */
+    coInit = pCoInitializeEx(NULL, COINIT_MULTITHREADED);
+    g_hWaveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!OpenAudioClient(&out, g_hWaveEvent)) {
+        CloseHandle(g_hWaveEvent);
+        g_hWaveEvent = NULL;
+        if (SUCCEEDED(coInit)) pCoUninitialize();
+        return FALSE;
+    }
+
+    LogCommand("PCM: %dch %dHz 16bit, %u ms blocks, AudioClient buffer %u frames",
+               g_track.channels, g_track.sampleRate, g_config.blockMs, out.bufferFrames);
+    g_bThreadOutput = TRUE;
+    g_stats.queuedMs = 0;
+    g_stats.minQueuedMs = 0;
+
+    waitHandles[0] = g_hWaveEvent;
+    waitHandles[1] = g_hDecodeEvent;
+
+    while (!g_bStopRequested) {
+        UINT32 padding;
+        UINT32 space;
+        DWORD waitMs = 100;
+        LONG restart;
+        HRESULT hr;
+
+        if (SettleParkedStop(&waitMs))
+            break;
+
+        /* A PLAY restarted the parked engine: flush the stream and write
+         * again from the requested block */
+        restart = InterlockedExchange(&g_lRestartBlock, -1);
+        if (restart >= 0) {
+            IAudioClient_Stop(out.client);
+            IAudioClient_Reset(out.client);
+            running = FALSE;
+            dry = FALSE;
+            block = baseBlock = (DWORD)restart;
+            offset = 0;
+            written = 0;
+            TraceInstant("Restart", "block", restart);
+        }
+
+        GetTrackProgress(&count, &complete);
+        hr = IAudioClient_GetCurrentPadding(out.client, &padding);
+        if (FAILED(hr)) {
+            LogCommand("ERROR: AudioClient stream lost (0x%08x)", (unsigned)hr);
+            break;
+        }
+
+        if (complete && block == count && padding == 0) {
+            PublishPlaybackMetrics(baseBlock * g_config.blockMs + (DWORD)(written * 1000 / g_track.sampleRate));
+            TrackFinished();
+            break;
+        }
+
+        /* The engine only runs dry mid-track if we fell behind */
+        if (running && padding == 0 && !dry) {
+            InterlockedIncrement(&g_stats.underruns);
+            TraceInstant("Underrun", "block", (LONG)block);
+            LogCommand("UNDERRUN at block %u (%s)", block, block == count ? "decoder behind" : "refill late");
+            dry = TRUE;
+        } else if (padding > 0) {
+            dry = FALSE;
+        }
+
+        /* Fill the free part of the buffer from the decoded blocks */
+        space = out.bufferFrames - padding;
+        while (space > 0 && block < count) {
+            const short* src;
+            DWORD blockFrames;
+            DWORD frames;
+            BYTE* data;
+
+            EnterCriticalSection(&g_csTrack);
+            src = g_track.blocks[block].samples + (size_t)offset * g_track.channels;
+            blockFrames = g_track.blocks[block].frames;
+            LeaveCriticalSection(&g_csTrack);
+            frames = blockFrames - offset;
+            if (frames > space)
+                frames = space;
+
+            hr = IAudioRenderClient_GetBuffer(out.render, frames, &data);
+            if (FAILED(hr)) {
+                LogCommand("ERROR: AudioClient GetBuffer failed (0x%08x)", (unsigned)hr);
+                break;
+            }
+            WriteAudioClientFrames(&out, data, src, frames);
+            IAudioRenderClient_ReleaseBuffer(out.render, frames, 0);
+
+            space -= frames;
+            written += frames;
+            offset += frames;
+            if (offset == blockFrames) {
+                block++;
+                offset = 0;
+            }
+        }
+
+        /* Follow PAUSE/RESUME and a parked STOP */
+        if (!g_bPaused && g_lParked == PARK_NONE) {
+            if (!running && written > 0) {
+                IAudioClient_Start(out.client);
+                running = TRUE;
+                if (!started) {
+                    g_stats.firstSampleMs = (LONG)(GetTickCount() - args->requestTime);
+                    LogCommand("PLAYING (first block after %u ms)", (DWORD)g_stats.firstSampleMs);
+                    g_bPlaying = TRUE;
+                    if (g_metrics) g_metrics->playing = 1;
+                    started = TRUE;
+                }
+            }
+        } else if (running) {
+            IAudioClient_Stop(out.client);
+            running = FALSE;
+        }
+
+        g_stats.queuedMs = (LONG)((unsigned long long)(out.bufferFrames - space) * 1000 / g_track.sampleRate);
+        if (running && !(complete && block == count) &&
+            (g_stats.minQueuedMs == 0 || g_stats.queuedMs < g_stats.minQueuedMs))
+            g_stats.minQueuedMs = g_stats.queuedMs;
+        TraceCounter("Queued", "ms", g_stats.queuedMs);
+        PublishPlaybackMetrics(baseBlock * g_config.blockMs +
+                               (DWORD)((written - (out.bufferFrames - space)) * 1000 / g_track.sampleRate));
+
+        WaitForMultipleObjects(2, waitHandles, FALSE, waitMs);
     }
 
-    return pcm;
+    g_stats.queuedMs = 0;
+    LogHealth();
+    CloseAudioClient(&out);
+    if (SUCCEEDED(coInit)) pCoUninitialize();
+    return TRUE;
 }
 
-/* Stop current playback */
-static void StopPlayback(void)
+/* Test output for VirtualClock: no device at all. Decoded audio is
+ * "played" by a clock running VirtualClock times real time, or at -1 by
+ * one that jumps to the end of whatever has been decoded, so a whole
+ * track runs in about the time it takes to decode. Position,
+ * PLAYBACK_DONE and the PLAY notification follow the clock the same way
+ * they follow a device. */
+static void RenderVirtualClock(PlaybackArgs* args)
 {
-    g_bStopRequested = TRUE;
+    HANDLE waitHandles[2];
+    LARGE_INTEGER freq, last, now;
+    DWORD baseBlock = 0;                /* block the clock was last (re)started from */
+    unsigned long long clockUs = 0;     /* audio played since then */
+    BOOL started = FALSE;
+    BOOL dry = FALSE;
 
-    if (g_hPlayThread) {
-        WaitForSingleObject(g_hPlayThread, 2000);
-        CloseHandle(g_hPlayThread);
-        g_hPlayThread = NULL;
-    }
+    g_hWaveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (g_config.virtualClock < 0)
+        LogCommand("PCM: %dch %dHz 16bit, %u ms blocks, virtual clock unthrottled",
+                   g_track.channels, g_track.sampleRate, g_config.blockMs);
+    else
+        LogCommand("PCM: %dch %dHz 16bit, %u ms blocks, virtual clock %dx",
+                   g_track.channels, g_track.sampleRate, g_config.blockMs, g_config.virtualClock);
+    g_bThreadOutput = TRUE;
+    g_stats.queuedMs = 0;
+    g_stats.minQueuedMs = 0;
+    if (g_stats.queueDepth == 0)
+        g_stats.queueDepth = (LONG)g_config.queueBlocks;
 
-    if (g_hWaveOut && pWaveOutReset && pWaveOutUnprepareHeader && pWaveOutClose) {
-        pWaveOutReset(g_hWaveOut);
-        if (g_waveHdr.dwFlags & WHDR_PREPARED) {
-            pWaveOutUnprepareHeader(g_hWaveOut, &g_waveHdr, sizeof(WAVEHDR));
+    waitHandles[0] = g_hWaveEvent;
+    waitHandles[1] = g_hDecodeEvent;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&last);
+
+    while (!g_bStopRequested) {
+        unsigned long long availableUs;     /* audio decoded past baseBlock */
+        unsigned long long aheadUs;
+        DWORD waitMs = 100;
+        BOOL complete;
+        LONG restart;
+
+        if (SettleParkedStop(&waitMs))
+            break;
+
+        restart = InterlockedExchange(&g_lRestartBlock, -1);
+        if (restart >= 0) {
+            baseBlock = (DWORD)restart;
+            clockUs = 0;
+            dry = FALSE;
+            TraceInstant("Restart", "block", restart);
+        }
+
+        EnterCriticalSection(&g_csTrack);
+        availableUs = (g_track.totalFrames - (unsigned long long)baseBlock * g_track.blockFrames) *
+                      1000000 / g_track.sampleRate;
+        complete = g_track.complete;
+        LeaveCriticalSection(&g_csTrack);
+
+        /* The clock only runs while playing */
+        QueryPerformanceCounter(&now);
+        if (!g_bPaused && g_lParked == PARK_NONE) {
+            if (!started) {
+                g_stats.firstSampleMs = (LONG)(GetTickCount() - args->requestTime);
+                LogCommand("PLAYING (first block after %u ms)", (DWORD)g_stats.firstSampleMs);
+                g_bPlaying = TRUE;
+                if (g_metrics) g_metrics->playing = 1;
+                started = TRUE;
+            } else if (g_config.virtualClock > 0) {
+                clockUs += (unsigned long long)(now.QuadPart - last.QuadPart) * 1000000 /
+                           freq.QuadPart * g_config.virtualClock;
+            }
+            if (g_config.virtualClock < 0 || clockUs > availableUs)
+                clockUs = availableUs;
+
+            /* Unthrottled, the clock waits for the decoder by design */
+            if (clockUs == availableUs && !complete && g_config.virtualClock > 0 && !dry) {
+                InterlockedIncrement(&g_stats.underruns);
+                TraceInstant("Underrun", "block", (LONG)(baseBlock + clockUs / 1000 / g_config.blockMs));
+                LogCommand("UNDERRUN at block %u (decoder behind)",
+                           baseBlock + (DWORD)(clockUs / 1000 / g_config.blockMs));
+                dry = TRUE;
+            } else if (clockUs < availableUs) {
+                dry = FALSE;
+            }
+        }
+        last = now;
+
+        aheadUs = availableUs - clockUs;
+        if (aheadUs > (unsigned long long)g_stats.queueDepth * g_config.blockMs * 1000)
+            aheadUs = (unsigned long long)g_stats.queueDepth * g_config.blockMs * 1000;
+        g_stats.queuedMs = (LONG)(aheadUs / 1000);
+        if (started && !complete && (g_stats.minQueuedMs == 0 || g_stats.queuedMs < g_stats.minQueuedMs))
+            g_stats.minQueuedMs = g_stats.queuedMs;
+        TraceCounter("Queued", "ms", g_stats.queuedMs);
+        PublishPlaybackMetrics(baseBlock * g_config.blockMs + (DWORD)(clockUs / 1000));
+
+        if (complete && clockUs == availableUs) {
+            TrackFinished();
+            break;
         }
-        pWaveOutClose(g_hWaveOut);
-        g_hWaveOut = NULL;
-    }
 
-    if (g_pAudioData) {
-        free(g_pAudioData);
-        g_pAudioData = NULL;
+        /* Wake when the decoded audio runs out on the clock */
+        if (g_config.virtualClock > 0 && clockUs < availableUs &&
+            (availableUs - clockUs) / 1000 / g_config.virtualClock < waitMs)
+            waitMs = (DWORD)((availableUs - clockUs) / 1000 / g_config.virtualClock) + 1;
+
+        WaitForMultipleObjects(2, waitHandles, FALSE, waitMs);
     }
 
-    ZeroMemory(&g_waveHdr, sizeof(g_waveHdr));
-    g_bPlaying = FALSE;
-    g_bPaused = FALSE;
-    g_bStopRequested = FALSE;
+    g_stats.queuedMs = 0;
+    LogHealth();
 }
 
-/* Playback thread argument */
-typedef struct {
-    char path[MAX_PATH];
-    AudioFormat format;
-} PlaybackArgs;
-
-/* Playback thread */
+/* Playback (refill) thread. Starts the decode thread, opens the device
+ * once there is something to play and keeps up to the adaptive queue
+ * depth of blocks queued on it. Only this short refill path runs at
+ * raised priority. With Progressive set, playback starts as soon as the
+ * first block is decoded. */
 static DWORD WINAPI PlaybackThread(LPVOID param)
 {
     PlaybackArgs* args = (PlaybackArgs*)param;
-    unsigned int channels = 0, sampleRate = 0;
-    size_t totalSamples = 0;
-    short* pcmData;
+    HANDLE hDecodeThread;
+    HANDLE hTask;
+    HANDLE waitHandles[2];
     WAVEFORMATEX wfx;
-    DWORD dataSize;
+    DWORD nextBlock = 0;    /* next block to queue */
+    DWORD doneBlock = 0;    /* next block to come back from the device */
+    DWORD healthyBlocks = 0;
+    DWORD count;
+    BOOL complete;
+    BOOL started = FALSE;
     MMRESULT result;
 
     LogCommand("PlaybackThread: %s", args->path);
+    TraceThreadName("Refill");
 
     if (!InitWinMM()) {
         free(args);
+        g_bEngineThread = FALSE;
         return 1;
     }
 
-    /* Decode audio to PCM */
-    pcmData = DecodeAudioFile(args->path, args->format, &channels, &sampleRate, &totalSamples);
-    if (!pcmData) {
-        LogCommand("ERROR: Failed to decode %s", args->path);
+    hTask = BoostAudioThreadPriority();
+
+    g_hDecodeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    hDecodeThread = CreateThread(NULL, 0, DecodeThread, args, 0, NULL);
+    if (!hDecodeThread) {
+        LogCommand("ERROR: CreateThread failed");
+        CloseHandle(g_hDecodeEvent);
+        g_hDecodeEvent = NULL;
+        RevertAudioThreadPriority(hTask);
         free(args);
+        g_bEngineThread = FALSE;
         return 1;
     }
 
-    dataSize = (DWORD)(totalSamples * sizeof(short));
-    g_pAudioData = (BYTE*)pcmData;
+    /* Wait for the first block, or the whole track without progressive start */
+    for (;;) {
+        GetTrackProgress(&count, &complete);
+        if (complete || g_bStopRequested || (g_config.progressive && count > 0))
+            break;
+        WaitForSingleObject(g_hDecodeEvent, 100);
+    }
+
+    if (count == 0 || g_bStopRequested) {
+        if (count == 0) {
+            LogCommand("ERROR: Failed to decode %s", args->path);
+            FinishPlayNotify(MCI_NOTIFY_FAILURE);
+        }
+        goto done;
+    }
+
+    if (g_config.virtualClock) {
+        RenderVirtualClock(args);
+        goto done;
+    }
+    if (g_config.audioClient && RenderAudioClient(args))
+        goto done;
 
     /* Set up waveOut format (16-bit PCM) */
     wfx.wFormatTag = WAVE_FORMAT_PCM;
-    wfx.nChannels = (WORD)channels;
-    wfx.nSamplesPerSec = sampleRate;
+    wfx.nChannels = (WORD)g_track.channels;
+    wfx.nSamplesPerSec = g_track.sampleRate;
     wfx.wBitsPerSample = 16;
-    wfx.nBlockAlign = (WORD)(channels * 2);
-    wfx.nAvgBytesPerSec = sampleRate * channels * 2;
+    wfx.nBlockAlign = (WORD)(g_track.channels * 2);
+    wfx.nAvgBytesPerSec = g_track.sampleRate * g_track.channels * 2;
     wfx.cbSize = 0;
 
-    LogCommand("PCM: %dch %dHz 16bit %d bytes", channels, sampleRate, dataSize);
+    LogCommand("PCM: %dch %dHz 16bit, %u ms blocks", g_track.channels, g_track.sampleRate, g_config.blockMs);
 
-    /* Open waveOut */
-    result = pWaveOutOpen(&g_hWaveOut, WAVE_MAPPER, &wfx, 0, 0, CALLBACK_NULL);
+    /* Open waveOut. The event is signalled whenever a header is done. */
+    g_hWaveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    result = pWaveOutOpen(&g_hWaveOut, WAVE_MAPPER, &wfx, (DWORD_PTR)g_hWaveEvent, 0, CALLBACK_EVENT);
     if (result != MMSYSERR_NOERROR) {
         LogCommand("ERROR: waveOutOpen failed %d", result);
-        free(args);
-        free(g_pAudioData);
-        g_pAudioData = NULL;
-        return 1;
-    }
-
-    /* Prepare header */
-    g_waveHdr.lpData = (LPSTR)g_pAudioData;
-    g_waveHdr.dwBufferLength = dataSize;
-    g_waveHdr.dwFlags = 0;
-
-    result = pWaveOutPrepareHeader(g_hWaveOut, &g_waveHdr, sizeof(WAVEHDR));
-    if (result != MMSYSERR_NOERROR) {
-        LogCommand("ERROR: waveOutPrepareHeader failed");
-        pWaveOutClose(g_hWaveOut);
         g_hWaveOut = NULL;
-        free(args);
-        free(g_pAudioData);
-        g_pAudioData = NULL;
-        return 1;
+        FinishPlayNotify(MCI_NOTIFY_FAILURE);
+        goto done;
     }
 
-    /* Start playback */
-    result = pWaveOutWrite(g_hWaveOut, &g_waveHdr, sizeof(WAVEHDR));
-    if (result != MMSYSERR_NOERROR) {
-        LogCommand("ERROR: waveOutWrite failed");
-        pWaveOutUnprepareHeader(g_hWaveOut, &g_waveHdr, sizeof(WAVEHDR));
-        pWaveOutClose(g_hWaveOut);
-        g_hWaveOut = NULL;
-        free(args);
-        free(g_pAudioData);
-        g_pAudioData = NULL;
-        return 1;
-    }
+    g_stats.queuedMs = 0;
+    g_stats.minQueuedMs = 0;
+    if (g_stats.queueDepth == 0)
+        g_stats.queueDepth = (LONG)g_config.queueBlocks;
 
-    LogCommand("PLAYING");
-    g_bPlaying = TRUE;
+    waitHandles[0] = g_hWaveEvent;
+    waitHandles[1] = g_hDecodeEvent;
 
-    /* Wait for completion */
     while (!g_bStopRequested) {
-        if (g_waveHdr.dwFlags & WHDR_DONE) {
-            LogCommand("PLAYBACK_DONE");
+        DWORD reaped = 0;
+        DWORD queued;
+        DWORD waitMs = 100;
+        LONG restart;
+
+        if (SettleParkedStop(&waitMs))
+            break;
+
+        /* A PLAY restarted the parked engine: drop what is queued and go
+         * again from the requested block */
+        restart = InterlockedExchange(&g_lRestartBlock, -1);
+        if (restart >= 0) {
+            pWaveOutReset(g_hWaveOut);
+            for (; doneBlock < nextBlock; doneBlock++)
+                pWaveOutUnprepareHeader(g_hWaveOut, &g_waveHdrs[doneBlock % MAX_WAVE_HEADERS], sizeof(WAVEHDR));
+            pWaveOutRestart(g_hWaveOut);
+            nextBlock = doneBlock = (DWORD)restart;
+            healthyBlocks = 0;
+            TraceInstant("Restart", "block", restart);
+        }
+
+        GetTrackProgress(&count, &complete);
+
+        /* Collect blocks the device has finished with. They complete in order. */
+        while (doneBlock < nextBlock && (g_waveHdrs[doneBlock % MAX_WAVE_HEADERS].dwFlags & WHDR_DONE)) {
+            pWaveOutUnprepareHeader(g_hWaveOut, &g_waveHdrs[doneBlock % MAX_WAVE_HEADERS], sizeof(WAVEHDR));
+            TraceInstant("Block done", "block", (LONG)doneBlock);
+            doneBlock++;
+            reaped++;
+        }
+
+        /* Check how close the device came to running dry. The block it is
+         * playing counts as queued, so one left means we only just made it. */
+        queued = nextBlock - doneBlock;
+        if (reaped > 0 && !(complete && nextBlock == count)) {
+            LONG queuedMs = (LONG)(queued * g_config.blockMs);
+            if (queued == 0) {
+                InterlockedIncrement(&g_stats.underruns);
+                TraceInstant("Underrun", "block", (LONG)doneBlock);
+                LogCommand("UNDERRUN at block %u (%s)", doneBlock,
+                           nextBlock == count ? "decoder behind" : "refill late");
+                SetQueueDepth(g_stats.queueDepth + 2, "underrun");
+                healthyBlocks = 0;
+            } else if (queued == 1) {
+                InterlockedIncrement(&g_stats.lateRefills);
+                TraceInstant("Late refill", "block", (LONG)doneBlock);
+                SetQueueDepth(g_stats.queueDepth + 1, "late refill");
+                healthyBlocks = 0;
+            } else {
+                healthyBlocks += reaped;
+                if (healthyBlocks * g_config.blockMs >= QUEUE_SHRINK_MS) {
+                    SetQueueDepth(g_stats.queueDepth - 1, "idle");
+                    healthyBlocks = 0;
+                }
+            }
+            if (g_stats.minQueuedMs == 0 || queuedMs < g_stats.minQueuedMs)
+                g_stats.minQueuedMs = queuedMs;
+        }
+
+        /* Keep the queue topped up with whatever has been decoded */
+        while (nextBlock < count && nextBlock - doneBlock < (DWORD)g_stats.queueDepth) {
+            if (!QueueBlock(nextBlock)) {
+                g_bStopRequested = TRUE;
+                break;
+            }
+            if (!started) {
+                g_stats.firstSampleMs = (LONG)(GetTickCount() - args->requestTime);
+                LogCommand("PLAYING (first block after %u ms)", (DWORD)g_stats.firstSampleMs);
+                g_bPlaying = TRUE;
+                if (g_metrics) g_metrics->playing = 1;
+                started = TRUE;
+            }
+            nextBlock++;
+        }
+        g_stats.queuedMs = (LONG)((nextBlock - doneBlock) * g_config.blockMs);
+        TraceCounter("Queued", "ms", g_stats.queuedMs);
+        PublishPlaybackMetrics(doneBlock * g_config.blockMs);
+
+        if (complete && doneBlock == count) {
+            PublishPlaybackMetrics((DWORD)(g_track.totalFrames * 1000 / g_track.sampleRate));
+            TrackFinished();
             break;
         }
-        Sleep(100);
+
+        /* Sleep until the device returns a header or a new block is decoded */
+        WaitForMultipleObjects(2, waitHandles, FALSE, waitMs);
     }
 
+    g_stats.queuedMs = 0;
+    LogHealth();
+
+done:
+    /* The decode thread checks g_bStopRequested between blocks and
+       while it indexes the file */
+    WaitForSingleObject(hDecodeThread, INFINITE);
+    CloseHandle(hDecodeThread);
+    CloseHandle(g_hDecodeEvent);
+    g_hDecodeEvent = NULL;
+    if (g_lParked == PARK_SETTLED) {
+        LogCommand("STOP settled after %u ms", GetTickCount() - g_dwParkTime);
+        ReleasePlayback();
+    }
+    RevertAudioThreadPriority(hTask);
     free(args);
+    g_bEngineThread = FALSE;
     return 0;
 }
 
-/* Play a track */
-static BOOL PlayTrack(DWORD track)
+/* TRUE while the refill thread is still working through a track */
+static BOOL EngineRunning(void)
+{
+    return g_hPlayThread && WaitForSingleObject(g_hPlayThread, 0) == WAIT_TIMEOUT && !g_bStopRequested;
+}
+
+/* STOP: pause the device and park the engine for CoalesceMs rather than
+ * tearing it down. Returns FALSE when there is nothing to park, and the
+ * caller stops for real. */
+static BOOL ParkPlayback(void)
+{
+    if (g_lParked == PARK_PARKED) return TRUE;
+    if (!g_config.coalesceMs || (!g_bThreadOutput && (!pWaveOutPause || !pWaveOutRestart)))
+        return FALSE;
+    if (g_lParked != PARK_NONE || !g_bPlaying || g_bPaused || !EngineRunning())
+        return FALSE;
+
+    /* A refill thread that owns its output stops it when woken below */
+    if (!g_bThreadOutput)
+        pWaveOutPause(g_hWaveOut);
+    g_dwParkTime = GetTickCount();
+    g_bPlaying = FALSE;
+    if (g_metrics) g_metrics->playing = 0;
+    InterlockedExchange(&g_lParked, PARK_PARKED);
+    SetEvent(g_hWaveEvent);
+    TraceInstant("Park", "track", (LONG)g_dwEngineTrack);
+    return TRUE;
+}
+
+/* PLAY: serve it from the running engine when possible. A repeat PLAY of
+ * what is already playing carries on untouched. After a STOP, a PLAY of
+ * the same track whose start block is already decoded restarts the
+ * parked engine in place. Returns FALSE when the engine must be rebuilt. */
+static BOOL ContinuePlayback(DWORD track, DWORD startMs)
+{
+    DWORD count, block;
+    BOOL complete;
+
+    if (!g_config.coalesceMs || track != g_dwEngineTrack || startMs < g_dwEngineStartMs || !EngineRunning())
+        return FALSE;
+
+    if (g_lParked == PARK_NONE) {
+        if (startMs != g_dwEngineStartMs || g_bPaused)
+            return FALSE;
+        LogCommand("PLAY %d (already playing)", track);
+        return TRUE;
+    }
+
+    /* Blocks are whole BlockMs steps from where the engine started */
+    if ((startMs - g_dwEngineStartMs) % g_config.blockMs != 0)
+        return FALSE;
+    block = (startMs - g_dwEngineStartMs) / g_config.blockMs;
+    GetTrackProgress(&count, &complete);
+    if (block >= count)
+        return FALSE;
+
+    /* The refill thread may be settling the STOP right now */
+    if (InterlockedCompareExchange(&g_lParked, PARK_NONE, PARK_PARKED) != PARK_PARKED)
+        return FALSE;
+    g_lPositionMs = (LONG)startMs;
+    InterlockedExchange(&g_lRestartBlock, (LONG)block);
+    SetEvent(g_hWaveEvent);
+    g_bPlaying = TRUE;
+    if (g_metrics) g_metrics->playing = 1;
+    LogCommand("PLAY %d at %u ms (restarted in place after %u ms)", track, startMs,
+               GetTickCount() - g_dwParkTime);
+    return TRUE;
+}
+
+/* Play a track, starting startMs into it */
+static BOOL PlayTrack(DWORD track, DWORD startMs)
 {
     char path[MAX_PATH];
     AudioFormat fmt;
     PlaybackArgs* args;
+    DWORD requestTime = GetTickCount();
 
+    if (ContinuePlayback(track, startMs)) {
+        g_dwCurrentTrack = track;
+        return TRUE;
+    }
     StopPlayback();
 
-    fmt = GetTrackPath(track, path, MAX_PATH);
-    LogCommand("PLAY %d (%s)", track, path);
+    fmt = SelectTrackSource(track, path, MAX_PATH);
+    if (startMs > 0)
+        LogCommand("PLAY %d at %u ms (%s)", track, startMs, path);
+    else
+        LogCommand("PLAY %d (%s)", track, path);
 
     if (fmt == AUDIO_FMT_UNKNOWN) {
         LogCommand("ERROR: No audio file found for track %d", track);
@@ -409,13 +3816,25 @@ static BOOL PlayTrack(DWORD track)
     strncpy(args->path, path, MAX_PATH - 1);
     args->path[MAX_PATH - 1] = '\0';
     args->format = fmt;
+    args->startMs = startMs;
+    args->requestTime = requestTime;
 
     g_dwCurrentTrack = track;
+    g_dwEngineTrack = track;
+    g_dwEngineStartMs = startMs;
+    g_lPositionMs = (LONG)startMs;
     g_bStopRequested = FALSE;
+    if (g_metrics) g_metrics->currentTrack = track;
+
+    /* A SIMD check chunk may be running at lowered levels; wait it out */
+    EnterCriticalSection(&g_csSimdCheck);
+    g_bEngineThread = TRUE;
+    LeaveCriticalSection(&g_csSimdCheck);
 
     g_hPlayThread = CreateThread(NULL, 0, PlaybackThread, args, 0, NULL);
     if (!g_hPlayThread) {
         LogCommand("ERROR: CreateThread failed");
+        g_bEngineThread = FALSE;
         free(args);
         return FALSE;
     }
@@ -423,24 +3842,40 @@ static BOOL PlayTrack(DWORD track)
     return TRUE;
 }
 
-/* Pause playback */
+/* Pause playback. A refill thread that owns its output follows g_bPaused when woken. */
 static void PausePlayback(void)
 {
-    if (g_hWaveOut && pWaveOutPause && g_bPlaying && !g_bPaused) {
+    if (!g_bPlaying || g_bPaused) return;
+
+    if (g_bThreadOutput) {
+        g_bPaused = TRUE;
+        SetEvent(g_hWaveEvent);
+    } else if (g_hWaveOut && pWaveOutPause) {
         pWaveOutPause(g_hWaveOut);
         g_bPaused = TRUE;
-        LogCommand("PAUSE");
+    } else {
+        return;
     }
+    if (g_metrics) g_metrics->playing = 2;
+    LogCommand("PAUSE");
 }
 
 /* Resume playback */
 static void ResumePlayback(void)
 {
-    if (g_hWaveOut && pWaveOutRestart && g_bPaused) {
+    if (!g_bPaused) return;
+
+    if (g_bThreadOutput) {
+        g_bPaused = FALSE;
+        SetEvent(g_hWaveEvent);
+    } else if (g_hWaveOut && pWaveOutRestart) {
         pWaveOutRestart(g_hWaveOut);
         g_bPaused = FALSE;
-        LogCommand("RESUME");
+    } else {
+        return;
     }
+    if (g_metrics) g_metrics->playing = 1;
+    LogCommand("RESUME");
 }
 
 /* Count available tracks */
@@ -455,36 +3890,304 @@ static DWORD CountTracks(void)
     return count > 0 ? count + 1 : 18;
 }
 
-/* MCI driver procedure */
-LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
-                            LPARAM lParam1, LPARAM lParam2)
+/* Track lengths. MCI_OPEN_DRIVER only scans the directory; the headers
+ * are read afterwards by PROBE_THREADS below-normal workers, and a status
+ * query that needs a length not probed yet waits on that track's event.
+ * A track that cannot be probed reports DEFAULT_TRACK_MS. */
+#define PROBE_THREADS 4
+#define DEFAULT_TRACK_MS 180000
+
+static HANDLE g_hProbeThreads[PROBE_THREADS];
+static volatile LONG g_lNextProbe;      /* last track handed to a worker */
+static volatile LONG g_lProbesLeft;
+static volatile BOOL g_bProbeStop = FALSE;
+static DWORD g_dwProbeStart;
+
+/* Read a track's length from its headers. Decodes no audio, except that
+ * an MP3 without a Xing/VBRI header has to have its frame headers walked. */
+static DWORD ProbeTrackLength(DWORD track)
 {
-    switch (msg) {
-    case DRV_LOAD:
-    case DRV_ENABLE:
-        return 1;
-    case DRV_OPEN:
-    case DRV_CLOSE:
-    case DRV_DISABLE:
-    case DRV_FREE:
-        return 1;
-    case DRV_QUERYCONFIGURE:
+    char path[MAX_PATH];
+    AudioFormat fmt = GetTrackPath(track, path, MAX_PATH);
+    AudioDecoder dec;
+    unsigned long long frames = 0;
+    DWORD ms;
+
+    if (fmt == AUDIO_FMT_UNKNOWN || !OpenDecoder(&dec, path, fmt))
+        return DEFAULT_TRACK_MS;
+
+    switch (fmt) {
+    case AUDIO_FMT_WAV:  frames = dec.u.wav.totalPCMFrameCount; break;
+    case AUDIO_FMT_FLAC: frames = dec.u.flac->totalPCMFrameCount; break;
+    case AUDIO_FMT_MP3:  frames = drmp3_get_pcm_frame_count(&dec.u.mp3); break;
+    case AUDIO_FMT_OGG:  frames = stb_vorbis_stream_length_in_samples(dec.u.vorbis); break;
+    case AUDIO_FMT_OPUS: {
+        ogg_int64_t total = op_pcm_total(dec.u.opus, -1);
+        frames = total > 0 ? (unsigned long long)total : 0;
+        break;
+    }
+    default: break;
+    }
+    ms = (DWORD)(frames * 1000 / dec.sampleRate);
+    CloseDecoder(&dec);
+    return ms ? ms : DEFAULT_TRACK_MS;
+}
+
+static DWORD WINAPI ProbeThread(LPVOID param)
+{
+    LONG track;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    TraceThreadName("Probe");
+
+    while (!g_bProbeStop && (track = InterlockedIncrement(&g_lNextProbe)) <= (LONG)g_dwNumTracks) {
+        LONGLONG traceStart = TraceNow();
+        g_tracks[track].lengthMs = ProbeTrackLength((DWORD)track);
+        TraceSpan("Probe track", traceStart, "track", track);
+        SetEvent(g_tracks[track].hProbed);
+        if (InterlockedDecrement(&g_lProbesLeft) == 0)
+            LogCommand("Probed %u tracks in %u ms", g_dwNumTracks - 1, GetTickCount() - g_dwProbeStart);
+    }
+    return 0;
+}
+
+/* Stop the probe workers early and drop the events. A worker only sees
+ * the stop between tracks, so each is joined until it has returned, or it
+ * could signal a closed event. That takes at most one probe. */
+static void StopProbes(void)
+{
+    DWORD i;
+
+    g_bProbeStop = TRUE;
+    for (i = 0; i < PROBE_THREADS; i++) {
+        if (g_hProbeThreads[i]) {
+            WaitForSingleObject(g_hProbeThreads[i], INFINITE);
+            CloseHandle(g_hProbeThreads[i]);
+            g_hProbeThreads[i] = NULL;
+        }
+    }
+    for (i = 0; i <= MAX_TRACKS; i++) {
+        if (g_tracks[i].hProbed) {
+            CloseHandle(g_tracks[i].hProbed);
+            g_tracks[i].hProbed = NULL;
+        }
+    }
+    g_bProbeStop = FALSE;
+}
+
+/* Start probing tracks 2..g_dwNumTracks in the background */
+static void StartProbes(void)
+{
+    DWORD i;
+
+    StopProbes();
+    for (i = 2; i <= g_dwNumTracks; i++) {
+        g_tracks[i].lengthMs = DEFAULT_TRACK_MS;
+        g_tracks[i].hProbed = CreateEventA(NULL, TRUE, FALSE, NULL);
+    }
+    g_lNextProbe = 1;
+    g_lProbesLeft = (LONG)g_dwNumTracks - 1;
+    g_dwProbeStart = GetTickCount();
+    for (i = 0; i < PROBE_THREADS && i + 2 <= g_dwNumTracks; i++)
+        g_hProbeThreads[i] = CreateThread(NULL, 0, ProbeThread, NULL, 0, NULL);
+}
+
+/* Length of a track, waiting for its probe if it is still running */
+static DWORD GetTrackLengthMs(DWORD track)
+{
+    if (track < 2 || track > g_dwNumTracks)
         return 0;
-    case DRV_INSTALL:
-    case DRV_REMOVE:
-        return DRV_OK;
+    /* No worker could be started; probe it here */
+    if (!g_hProbeThreads[0]) {
+        if (g_tracks[track].hProbed && WaitForSingleObject(g_tracks[track].hProbed, 0) != WAIT_OBJECT_0) {
+            g_tracks[track].lengthMs = ProbeTrackLength(track);
+            SetEvent(g_tracks[track].hProbed);
+        }
+        return g_tracks[track].lengthMs;
+    }
+    if (g_tracks[track].hProbed) {
+        LONGLONG traceStart = TraceNow();
+        WaitForSingleObject(g_tracks[track].hProbed, INFINITE);
+        TraceSpan("Wait for probe", traceStart, "track", (LONG)track);
+    }
+    return g_tracks[track].lengthMs;
+}
+
+/* Preload (PreloadMB). Encoded files are 5-10x smaller than their PCM,
+ * so a whole disc usually fits: after open, a below-normal thread reads
+ * the smallest file of each track, in order, into memory until the budget
+ * is spent, and decoders then run from those copies without touching the
+ * disk. Tracks not loaded yet, or over budget, are read from disk as usual. */
+#define PRELOAD_CHUNK (1024 * 1024)
+
+static HANDLE g_hPreloadThread = NULL;
+static volatile BOOL g_bPreloadStop = FALSE;
+
+/* Read a whole file into memory, in chunks so a close can cut it short */
+static unsigned char* ReadWholeFile(const char* path, size_t maxSize, size_t* size)
+{
+    HANDLE file;
+    DWORD sizeHigh = 0;
+    DWORD sizeLow;
+    unsigned char* data = NULL;
+    size_t done = 0;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    sizeLow = GetFileSize(file, &sizeHigh);
+    if (sizeLow != INVALID_FILE_SIZE && sizeLow > 0 && sizeHigh == 0 && sizeLow <= maxSize)
+        data = (unsigned char*)malloc(sizeLow);
+    while (data && done < sizeLow) {
+        DWORD chunk = sizeLow - (DWORD)done < PRELOAD_CHUNK ? sizeLow - (DWORD)done : PRELOAD_CHUNK;
+        DWORD got = 0;
+        if (g_bPreloadStop || !ReadFile(file, data + done, chunk, &got, NULL) || got == 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += got;
+    }
+    CloseHandle(file);
+
+    *size = sizeLow;
+    return data;
+}
+
+static DWORD WINAPI PreloadThread(LPVOID param)
+{
+    size_t budget = (size_t)g_config.preloadMB * 1024 * 1024;
+    size_t used = 0;
+    DWORD loaded = 0;
+    DWORD start = GetTickCount();
+    DWORD track;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    TraceThreadName("Preload");
+
+    for (track = 2; track <= g_dwNumTracks && used < budget && !g_bPreloadStop; track++) {
+        PreloadedFile* file;
+        char path[MAX_PATH];
+        unsigned char* data;
+        size_t size = 0;
+        LONGLONG traceStart;
+
+        if (GetSmallestTrackSource(track, path, MAX_PATH) == AUDIO_FMT_UNKNOWN)
+            continue;
+
+        traceStart = TraceNow();
+        data = ReadWholeFile(path, budget - used, &size);
+        TraceSpan("Preload track", traceStart, "track", (LONG)track);
+        if (!data) {
+            if (!g_bPreloadStop && size > budget - used)
+                LogCommand("Preload: %s skipped, %u KB over the budget", path, (DWORD)((size - (budget - used)) / 1024));
+            continue;
+        }
+        file = (PreloadedFile*)calloc(1, sizeof(*file));
+        if (!file) {
+            free(data);
+            continue;
+        }
+        strcpy(file->path, path);
+        file->data = data;
+        file->size = size;
+        EnterCriticalSection(&g_csPreload);
+        g_preloaded[track] = file;
+        LeaveCriticalSection(&g_csPreload);
+        used += size;
+        loaded++;
+    }
+
+    LogCommand("Preloaded %u tracks, %u KB in %u ms%s", loaded, (DWORD)(used / 1024),
+               GetTickCount() - start, g_bPreloadStop ? " (cancelled)" : "");
+    return 0;
+}
+
+static void StartPreload(void)
+{
+    if (!g_config.preloadMB || g_hPreloadThread) return;
+    g_bPreloadStop = FALSE;
+    g_hPreloadThread = CreateThread(NULL, 0, PreloadThread, NULL, 0, NULL);
+}
+
+/* Stop preloading and unlink the files. Files a decoder is still reading
+ * are freed when it closes them. */
+static void FreePreload(void)
+{
+    int i;
+
+    if (g_hPreloadThread) {
+        /* ReadWholeFile checks the flag between chunks, so this is short */
+        g_bPreloadStop = TRUE;
+        WaitForSingleObject(g_hPreloadThread, INFINITE);
+        CloseHandle(g_hPreloadThread);
+        g_hPreloadThread = NULL;
+    }
+    EnterCriticalSection(&g_csPreload);
+    for (i = 0; i <= MAX_TRACKS; i++) {
+        PreloadedFile* file = g_preloaded[i];
+        if (!file)
+            continue;
+        g_preloaded[i] = NULL;
+        file->path[0] = '\0';
+        if (file->users == 0)
+            FreePreloadedFile(file);
+    }
+    LeaveCriticalSection(&g_csPreload);
+}
+
+/* Name of an MCI message, for the trace timeline */
+static const char* MciCommandName(UINT msg)
+{
+    switch (msg) {
+    case MCI_OPEN_DRIVER:  return "MCI_OPEN_DRIVER";
+    case MCI_CLOSE_DRIVER: return "MCI_CLOSE_DRIVER";
+    case MCI_OPEN:         return "MCI_OPEN";
+    case MCI_CLOSE:        return "MCI_CLOSE";
+    case MCI_PLAY:         return "MCI_PLAY";
+    case MCI_STOP:         return "MCI_STOP";
+    case MCI_PAUSE:        return "MCI_PAUSE";
+    case MCI_RESUME:       return "MCI_RESUME";
+    case MCI_SEEK:         return "MCI_SEEK";
+    case MCI_STATUS:       return "MCI_STATUS";
+    case MCI_SET:          return "MCI_SET";
+    case MCI_GETDEVCAPS:   return "MCI_GETDEVCAPS";
+    case MCI_INFO:         return "MCI_INFO";
+    default:               return "MCI (other)";
     }
+}
 
+/* Handle an MCI command message */
+static LRESULT HandleMciCommand(UINT msg, LPARAM lParam1, LPARAM lParam2)
+{
     if (msg == MCI_OPEN_DRIVER) {
+        LoadConfig();
+        InitWinMM();
+        OpenMetrics();
+        ZeroMemory(&g_stats, sizeof(g_stats));
         g_bOpen = TRUE;
         g_dwNumTracks = CountTracks();
         LogCommand("OPEN (%d tracks)", g_dwNumTracks);
+        IndexTrackSources(g_dwNumTracks);
+        SampleCpuLoad();
+        StartProbes();
+        StartPreload();
+        EnterCriticalSection(&g_csPcmCache);
+        TrimPcmCache(PcmCacheBudget());
+        LeaveCriticalSection(&g_csPcmCache);
+        StartSimdCheck();
         return 0;
     }
 
     if (msg == MCI_CLOSE_DRIVER) {
         LogCommand("CLOSE");
+        FinishPlayNotify(MCI_NOTIFY_ABORTED);
         StopPlayback();
+        StopSimdCheck();
+        StopProbes();
+        FreePreload();
         g_bOpen = FALSE;
         return 0;
     }
@@ -499,31 +4202,45 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
 
     case MCI_CLOSE:
         LogCommand("MCI_CLOSE");
+        FinishPlayNotify(MCI_NOTIFY_ABORTED);
         StopPlayback();
         return 0;
 
     case MCI_PLAY:
         {
             DWORD dwFrom = g_dwCurrentTrack;
+            DWORD dwStartMs = 0;
 
             if (lParam1 & MCI_FROM) {
                 MCI_PLAY_PARMS* parms = (MCI_PLAY_PARMS*)lParam2;
-                if (g_dwTimeFormat == MCI_FORMAT_TMSF)
+                if (g_dwTimeFormat == MCI_FORMAT_TMSF) {
+                    /* Minutes/seconds/frames (75 per second) into the track */
                     dwFrom = MCI_TMSF_TRACK(parms->dwFrom);
-                else
+                    dwStartMs = (MCI_TMSF_MINUTE(parms->dwFrom) * 60 + MCI_TMSF_SECOND(parms->dwFrom)) * 1000 +
+                                MCI_TMSF_FRAME(parms->dwFrom) * 1000 / 75;
+                } else {
                     dwFrom = parms->dwFrom;
+                }
             }
 
-            PlayTrack(dwFrom);
+            /* Answered when the track ends, or by whatever cuts it short */
+            FinishPlayNotify(MCI_NOTIFY_SUPERSEDED);
+            if ((lParam1 & MCI_NOTIFY) && lParam2)
+                g_hNotifyWnd = (HWND)((MCI_GENERIC_PARMS*)lParam2)->dwCallback;
+            if (!PlayTrack(dwFrom, dwStartMs))
+                FinishPlayNotify(MCI_NOTIFY_FAILURE);
         }
         return 0;
 
     case MCI_STOP:
         LogCommand("STOP");
-        StopPlayback();
+        FinishPlayNotify(MCI_NOTIFY_ABORTED);
+        if (!ParkPlayback())
+            StopPlayback();
         return 0;
 
     case MCI_PAUSE:
+        FinishPlayNotify(MCI_NOTIFY_ABORTED);
         PausePlayback();
         return 0;
 
@@ -540,6 +4257,7 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
             else
                 dwTrack = parms->dwTo;
             g_dwCurrentTrack = dwTrack;
+            g_lPositionMs = 0;
             LogCommand("SEEK %d", dwTrack);
         }
         return 0;
@@ -558,7 +4276,19 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
                     parms->dwReturn = g_dwCurrentTrack;
                     break;
                 case MCI_STATUS_LENGTH:
-                    parms->dwReturn = 180000;
+                    {
+                        DWORD ms = 0;
+                        DWORD i;
+                        if (lParam1 & MCI_TRACK)
+                            ms = GetTrackLengthMs(parms->dwTrack);
+                        else
+                            for (i = 2; i <= g_dwNumTracks; i++)
+                                ms += GetTrackLengthMs(i);
+                        if (g_dwTimeFormat == MCI_FORMAT_MILLISECONDS)
+                            parms->dwReturn = ms;
+                        else
+                            parms->dwReturn = MCI_MAKE_MSF(ms / 60000, ms / 1000 % 60, ms % 1000 * 75 / 1000);
+                    }
                     break;
                 case MCI_STATUS_MODE:
                     if (g_bPlaying)
@@ -573,7 +4303,11 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
                     parms->dwReturn = TRUE;
                     break;
                 case MCI_STATUS_POSITION:
-                    parms->dwReturn = MCI_MAKE_TMSF(g_dwCurrentTrack, 0, 0, 0);
+                    {
+                        DWORD ms = (DWORD)g_lPositionMs;
+                        parms->dwReturn = MCI_MAKE_TMSF(g_dwCurrentTrack, ms / 60000, ms / 1000 % 60,
+                                                        ms % 1000 * 75 / 1000);
+                    }
                     break;
                 case MCI_STATUS_TIME_FORMAT:
                     parms->dwReturn = g_dwTimeFormat;
@@ -581,6 +4315,33 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
                 case MCI_CDA_STATUS_TYPE_TRACK:
                     parms->dwReturn = MCI_CDA_TRACK_AUDIO;
                     break;
+                case MCICDA_STATUS_UNDERRUNS:
+                    parms->dwReturn = (DWORD)g_stats.underruns;
+                    break;
+                case MCICDA_STATUS_LATE_REFILLS:
+                    parms->dwReturn = (DWORD)g_stats.lateRefills;
+                    break;
+                case MCICDA_STATUS_QUEUE_DEPTH:
+                    parms->dwReturn = (DWORD)g_stats.queueDepth;
+                    break;
+                case MCICDA_STATUS_QUEUED_MS:
+                    parms->dwReturn = (DWORD)g_stats.queuedMs;
+                    break;
+                case MCICDA_STATUS_DECODE_MS:
+                    parms->dwReturn = (DWORD)g_stats.decodeMs;
+                    break;
+                case MCICDA_STATUS_FIRST_SAMPLE_MS:
+                    parms->dwReturn = (DWORD)g_stats.firstSampleMs;
+                    break;
+                case MCICDA_STATUS_CACHE_HITS:
+                    parms->dwReturn = (DWORD)g_stats.cacheHits;
+                    break;
+                case MCICDA_STATUS_CACHE_MISSES:
+                    parms->dwReturn = (DWORD)g_stats.cacheMisses;
+                    break;
+                case MCICDA_STATUS_BYTES_RESIDENT:
+                    parms->dwReturn = (DWORD)g_stats.bytesResident;
+                    break;
                 default:
                     parms->dwReturn = 0;
                 }
@@ -629,8 +4390,17 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
     case MCI_INFO:
         if (lParam2) {
             MCI_INFO_PARMS* parms = (MCI_INFO_PARMS*)lParam2;
-            if (parms->lpstrReturn && parms->dwRetSize > 0)
+            if (parms->lpstrReturn && parms->dwRetSize > 0) {
                 parms->lpstrReturn[0] = '\0';
+                /* The product string carries the playback stats, for scripts and test tools */
+                if (lParam1 & MCI_INFO_PRODUCT) {
+                    char info[256];
+                    FormatStats(info, sizeof(info));
+                    if (strlen(info) >= parms->dwRetSize)
+                        return MCIERR_PARAM_OVERFLOW;
+                    strcpy(parms->lpstrReturn, info);
+                }
+            }
         }
         return 0;
 
@@ -641,19 +4411,99 @@ LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
     return 0;
 }
 
+/* MCI driver procedure */
+LRESULT CALLBACK DriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT msg,
+                            LPARAM lParam1, LPARAM lParam2)
+{
+    LONGLONG traceStart;
+    LARGE_INTEGER metricsStart;
+    LRESULT result;
+
+    switch (msg) {
+    case DRV_LOAD:
+    case DRV_ENABLE:
+        return 1;
+    case DRV_OPEN:
+        if (lParam2)
+            g_wDeviceID = ((MciOpenDriverParms*)lParam2)->wDeviceID;
+        return 1;
+    case DRV_CLOSE:
+    case DRV_DISABLE:
+    case DRV_FREE:
+        return 1;
+    case DRV_QUERYCONFIGURE:
+        return 0;
+    case DRV_INSTALL:
+    case DRV_REMOVE:
+        return DRV_OK;
+    }
+
+    traceStart = TraceNow();
+    metricsStart.QuadPart = 0;
+    if (g_metrics) QueryPerformanceCounter(&metricsStart);
+    result = HandleMciCommand(msg, lParam1, lParam2);
+    if (traceStart) {
+        TraceThreadName("MCI");
+        TraceSpan(MciCommandName(msg), traceStart, "result", (LONG)result);
+    }
+    MetricsCommandDone(msg, metricsStart.QuadPart);
+    /* PLAY answers its MCI_NOTIFY when the track ends; the rest finish here */
+    if (result == 0 && (lParam1 & MCI_NOTIFY) && lParam2 && msg != MCI_PLAY &&
+        msg != MCI_OPEN_DRIVER && msg != MCI_CLOSE_DRIVER)
+        NotifyMci((HWND)((MCI_GENERIC_PARMS*)lParam2)->dwCallback, MCI_NOTIFY_SUCCESSFUL);
+    if (msg == MCI_CLOSE_DRIVER)
+        WriteTrace();
+    return result;
+}
+
 /* DLL entry point */
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 {
     switch (fdwReason) {
     case DLL_PROCESS_ATTACH:
         DisableThreadLibraryCalls(hinstDLL);
+        InitializeCriticalSection(&g_csTrack);
+        InitializeCriticalSection(&g_csPool);
+        InitializeCriticalSection(&g_csPcmCache);
+        InitializeCriticalSection(&g_csSimdCheck);
+        InitializeCriticalSection(&g_csPreload);
+        g_traceTls = TlsAlloc();
         break;
     case DLL_PROCESS_DETACH:
+        /* MCI_CLOSE_DRIVER has joined the background threads before a
+           FreeLibrary, and at process exit they are already gone, so
+           these do not wait under the loader lock */
         StopPlayback();
+        StopSimdCheck();
+        StopProbes();
+        FreePreload();
         if (g_hWinMM) {
             FreeLibrary(g_hWinMM);
             g_hWinMM = NULL;
         }
+        if (g_hAvrt) {
+            FreeLibrary(g_hAvrt);
+            g_hAvrt = NULL;
+        }
+        if (g_hOle32) {
+            FreeLibrary(g_hOle32);
+            g_hOle32 = NULL;
+        }
+        DeleteCriticalSection(&g_csTrack);
+        FreeDecoderPools();
+        DeleteCriticalSection(&g_csPool);
+        FreePcmCache();
+        DeleteCriticalSection(&g_csPcmCache);
+        DeleteCriticalSection(&g_csSimdCheck);
+        DeleteCriticalSection(&g_csPreload);
+        stb_vorbis_flush_setup_cache();
+        WriteTrace();
+        FreeTrace();
+        CloseMetrics();
+        if (g_traceTls != TLS_OUT_OF_INDEXES) {
+            TlsFree(g_traceTls);
+            g_traceTls = TLS_OUT_OF_INDEXES;
+        }
         break;
     }
     return TRUE;
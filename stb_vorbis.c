@@ -169,6 +169,27 @@ extern int stb_vorbis_get_sample_offset(stb_vorbis *f);
 // of the memory buffer. In pushdata mode it returns 0.
 extern unsigned int stb_vorbis_get_file_offset(stb_vorbis *f);
 
+// SIMD kernel selection (x86 only; elsewhere the level is always NONE).
+// The IMDCT butterflies, window overlap-add and float->short conversion
+// use the widest kernels the CPU supports, detected on first open. All
+// levels produce bit-identical output; set_simd_level lets you force a
+// lower level (e.g. to compare against the scalar reference) and returns
+// the level actually in effect, which is clamped to what the CPU has.
+enum STBVorbisSimdLevel
+{
+   STB_VORBIS_SIMD_NONE = 0,
+   STB_VORBIS_SIMD_SSE2,
+   STB_VORBIS_SIMD_AVX2
+};
+
+extern int stb_vorbis_get_simd_level(void);
+extern int stb_vorbis_set_simd_level(int level);
+
+// Setup cache (compiled in with STB_VORBIS_SETUP_CACHE, see below).
+// Frees every cached setup; only call it when no decoder is open. A
+// no-op when the cache is not compiled in.
+extern void stb_vorbis_flush_setup_cache(void);
+
 ///////////   PUSHDATA API
 
 #ifndef STB_VORBIS_NO_PUSHDATA_API
@@ -307,6 +328,19 @@ extern int stb_vorbis_seek(stb_vorbis *f, unsigned int sample_number);
 extern int stb_vorbis_seek_start(stb_vorbis *f);
 // this function is equivalent to stb_vorbis_seek(f,0)
 
+typedef struct
+{
+   unsigned int page_offset;  // file offset of an Ogg page, relative to the stream start
+   unsigned int last_sample;  // granule position of that page
+} stb_vorbis_seek_point;
+
+extern void stb_vorbis_set_seek_index(stb_vorbis *f, const stb_vorbis_seek_point *points, int count);
+// give the seek functions a page index, sorted by page_offset (for example
+// built by an earlier scan of the file). seeks then start from the two index
+// entries around the target instead of bisecting the whole file. entries
+// are checked before use, so a stale index only costs speed. the array is
+// not copied; it must stay valid until replaced, or pass NULL to clear it.
+
 extern unsigned int stb_vorbis_stream_length_in_samples(stb_vorbis *f);
 extern float        stb_vorbis_stream_length_in_seconds(stb_vorbis *f);
 // these functions return the total length of the vorbis stream
@@ -448,6 +482,40 @@ enum STBVorbisError
 //      most platforms which requires endianness be defined correctly.
 //#define STB_VORBIS_NO_FAST_SCALED_FLOAT
 
+// STB_VORBIS_NO_SIMD
+//     does not compile the SSE2/AVX2 kernels or the CPUID probe; every
+//     platform then runs the portable scalar code.
+// #define STB_VORBIS_NO_SIMD
+
+// STB_VORBIS_SETUP_CACHE
+//     keep the codebooks, floor/residue/mapping tables and MDCT twiddles
+//     built from each distinct setup header, and share them with later
+//     opens whose setup header (and channel count and block sizes) is
+//     byte-identical, instead of rebuilding them. files encoded with the
+//     same settings have identical setup headers, so every open after
+//     the first skips setup construction. applies to pull-mode opens.
+//     with a user alloc buffer, the tables are still built on the heap
+//     (so they can outlive the decoder) and only per-stream state comes
+//     from the buffer. shared tables are read-only during decode, so
+//     decoders on several threads can use the same entry. free the
+//     cache with stb_vorbis_flush_setup_cache(), once no decoder is open.
+// #define STB_VORBIS_SETUP_CACHE
+
+// STB_VORBIS_LAZY_COMMENTS
+//     don't read the comment header when opening a file: step over it
+//     page by page, seeking past each segment, and parse it the first
+//     time stb_vorbis_get_comment() is called. files with embedded cover
+//     art (METADATA_BLOCK_PICTURE) can carry megabytes of comments.
+//     applies to pull-mode opens; push mode still parses it at open.
+// #define STB_VORBIS_LAZY_COMMENTS
+
+// STB_VORBIS_SETUP_CACHE_SIZE [number]
+//     the most distinct setups the cache holds; once full, opens with a
+//     new setup header build private tables as usual.
+#ifndef STB_VORBIS_SETUP_CACHE_SIZE
+#define STB_VORBIS_SETUP_CACHE_SIZE  16
+#endif
+
 
 // STB_VORBIS_MAX_CHANNELS [number]
 //     globally define this to the maximum number of channels you need.
@@ -629,6 +697,98 @@ enum STBVorbisError
 #error "Value of STB_VORBIS_FAST_HUFFMAN_LENGTH outside of allowed range"
 #endif
 
+// x86 SIMD: the kernels are compiled with per-function target attributes
+// on gcc/clang (MSVC allows any intrinsic regardless of /arch), so the
+// library still runs on CPUs without them; the CPUID probe decides.
+#if !defined(STB_VORBIS_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+   #if (defined(_MSC_VER) && _MSC_VER >= 1700) || defined(__clang__) || \
+       (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+      #define STB_VORBIS_SIMD_X86
+   #endif
+#endif
+
+#ifdef STB_VORBIS_SIMD_X86
+   #include <immintrin.h>
+   #ifdef _MSC_VER
+      #include <intrin.h>
+      #define STBV_TARGET_SSE2
+      #define STBV_TARGET_AVX2
+   #else
+      #include <cpuid.h>
+      #define STBV_TARGET_SSE2  __attribute__((target("sse2")))
+      #define STBV_TARGET_AVX2  __attribute__((target("avx2")))
+   #endif
+
+static void stbv_cpuid(int info[4], int leaf)
+{
+   #ifdef _MSC_VER
+   __cpuidex(info, leaf, 0);
+   #else
+   unsigned int a,b,c,d;
+   __cpuid_count(leaf, 0, a, b, c, d);
+   info[0] = (int) a; info[1] = (int) b; info[2] = (int) c; info[3] = (int) d;
+   #endif
+}
+
+// XCR0: bits 1 and 2 tell us the OS saves the XMM and YMM state
+static unsigned int stbv_xgetbv(void)
+{
+   #ifdef _MSC_VER
+   return (unsigned int) _xgetbv(0);
+   #else
+   unsigned int a,d;
+   __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0" : "=a"(a), "=d"(d) : "c"(0));
+   return a;
+   #endif
+}
+
+static int stbv_detect_simd(void)
+{
+   int info[4], max_leaf, level = STB_VORBIS_SIMD_NONE;
+   stbv_cpuid(info, 0);
+   max_leaf = info[0];
+   if (max_leaf < 1) return level;
+   stbv_cpuid(info, 1);
+   if (info[3] & (1 << 26))
+      level = STB_VORBIS_SIMD_SSE2;
+   // AVX2 needs the AVX bit, OSXSAVE and OS support for YMM state as well
+   if (max_leaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (stbv_xgetbv() & 6) == 6) {
+      stbv_cpuid(info, 7);
+      if (info[1] & (1 << 5))
+         level = STB_VORBIS_SIMD_AVX2;
+   }
+   return level;
+}
+#endif // STB_VORBIS_SIMD_X86
+
+static int stbv_simd_level = -1; // -1 until probed
+static int stbv_simd_max;
+
+static void stbv_simd_init(void)
+{
+   if (stbv_simd_level >= 0) return;
+   #ifdef STB_VORBIS_SIMD_X86
+   stbv_simd_max = stbv_detect_simd();
+   #else
+   stbv_simd_max = STB_VORBIS_SIMD_NONE;
+   #endif
+   stbv_simd_level = stbv_simd_max;
+}
+
+int stb_vorbis_get_simd_level(void)
+{
+   stbv_simd_init();
+   return stbv_simd_level;
+}
+
+int stb_vorbis_set_simd_level(int level)
+{
+   stbv_simd_init();
+   if (level < STB_VORBIS_SIMD_NONE) level = STB_VORBIS_SIMD_NONE;
+   stbv_simd_level = level < stbv_simd_max ? level : stbv_simd_max;
+   return stbv_simd_level;
+}
+
 
 #if 0
 #include <crtdbg.h>
@@ -818,6 +978,28 @@ struct stb_vorbis
    // (but not necessarily the page on which it starts)
    ProbedPage p_first, p_last;
 
+   // optional page index for seeking, owned by the caller
+   const stb_vorbis_seek_point *seek_index;
+   int seek_index_count;
+
+#ifdef STB_VORBIS_SETUP_CACHE
+   // the cache entry whose tables we use (not ours to free), and the setup
+   // packet read during the lookup, kept until a new entry takes it over
+   struct stbv__setup_entry *setup_shared;
+   uint8 *setup_packet;
+   int setup_packet_len;
+   // setup allocations currently bypass the alloc buffer; our own tables
+   // were built that way
+   int setup_on_heap;
+   int tables_on_heap;
+#endif
+
+#ifdef STB_VORBIS_LAZY_COMMENTS
+   // the comment header was skipped at open; where its first page is
+   int comments_pending;
+   unsigned int comment_offset;
+#endif
+
   // memory management
    stb_vorbis_alloc alloc;
    int setup_offset;
@@ -947,11 +1129,17 @@ static void *make_block_array(void *mem, int count, int size)
    return p;
 }
 
+#ifdef STB_VORBIS_SETUP_CACHE
+#define SETUP_IN_BUFFER(f)   ((f)->alloc.alloc_buffer && !(f)->setup_on_heap)
+#else
+#define SETUP_IN_BUFFER(f)   ((f)->alloc.alloc_buffer)
+#endif
+
 static void *setup_malloc(vorb *f, int sz)
 {
    sz = (sz+7) & ~7; // round up to nearest 8 for alignment of future allocs.
    f->setup_memory_required += sz;
-   if (f->alloc.alloc_buffer) {
+   if (SETUP_IN_BUFFER(f)) {
       void *p = (char *) f->alloc.alloc_buffer + f->setup_offset;
       if (f->setup_offset + sz > f->temp_offset) return NULL;
       f->setup_offset += sz;
@@ -962,14 +1150,14 @@ static void *setup_malloc(vorb *f, int sz)
 
 static void setup_free(vorb *f, void *p)
 {
-   if (f->alloc.alloc_buffer) return; // do nothing; setup mem is a stack
+   if (SETUP_IN_BUFFER(f)) return; // do nothing; setup mem is a stack
    free(p);
 }
 
 static void *setup_temp_malloc(vorb *f, int sz)
 {
    sz = (sz+7) & ~7; // round up to nearest 8 for alignment of future allocs.
-   if (f->alloc.alloc_buffer) {
+   if (SETUP_IN_BUFFER(f)) {
       if (f->temp_offset - sz < f->setup_offset) return NULL;
       f->temp_offset -= sz;
       return (char *) f->alloc.alloc_buffer + f->temp_offset;
@@ -979,7 +1167,7 @@ static void *setup_temp_malloc(vorb *f, int sz)
 
 static void setup_temp_free(vorb *f, void *p, int sz)
 {
-   if (f->alloc.alloc_buffer) {
+   if (SETUP_IN_BUFFER(f)) {
       f->temp_offset += (sz+7)&~7;
       return;
    }
@@ -2402,6 +2590,144 @@ void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 #endif
 
 
+#ifdef STB_VORBIS_SIMD_X86
+// SIMD versions of the step-3 butterflies. Each scalar iteration does four
+// butterflies on e[0..-7]; the vector code loads those 8 floats as-is, so
+// lanes come in (k01,k00) pairs and the rotation becomes
+//    out = k * (A0,A0) + swap(k) * (A1,-A1)
+// which is the scalar 'k00*A0 - k01*A1' / 'k01*A0 + k00*A1' term for term.
+// (e0 and e2 are always at least 8 floats apart when the loop body runs.)
+
+STBV_TARGET_SSE2
+static void imdct_step3_inner_r_loop_sse2(int lim, float *e, int d0, int k_off, float *A, int k1)
+{
+   int i;
+   float *e0 = e + d0;
+   float *e2 = e0 + k_off;
+
+   for (i=lim >> 2; i > 0; --i) {
+      __m128 a_hi = _mm_loadu_ps(e0-3), b_hi = _mm_loadu_ps(e2-3);
+      __m128 a_lo = _mm_loadu_ps(e0-7), b_lo = _mm_loadu_ps(e2-7);
+      __m128 k_hi = _mm_sub_ps(a_hi, b_hi);
+      __m128 k_lo = _mm_sub_ps(a_lo, b_lo);
+      __m128 c_hi = _mm_set_ps( A[0     ], A[0     ],  A[k1    ], A[k1    ]);
+      __m128 s_hi = _mm_set_ps(-A[1     ], A[1     ], -A[k1  +1], A[k1  +1]);
+      __m128 c_lo = _mm_set_ps( A[k1*2  ], A[k1*2  ],  A[k1*3  ], A[k1*3  ]);
+      __m128 s_lo = _mm_set_ps(-A[k1*2+1], A[k1*2+1], -A[k1*3+1], A[k1*3+1]);
+      _mm_storeu_ps(e0-3, _mm_add_ps(a_hi, b_hi));
+      _mm_storeu_ps(e0-7, _mm_add_ps(a_lo, b_lo));
+      _mm_storeu_ps(e2-3, _mm_add_ps(_mm_mul_ps(k_hi, c_hi), _mm_mul_ps(_mm_shuffle_ps(k_hi, k_hi, _MM_SHUFFLE(2,3,0,1)), s_hi)));
+      _mm_storeu_ps(e2-7, _mm_add_ps(_mm_mul_ps(k_lo, c_lo), _mm_mul_ps(_mm_shuffle_ps(k_lo, k_lo, _MM_SHUFFLE(2,3,0,1)), s_lo)));
+      e0 -= 8;
+      e2 -= 8;
+      A += k1*4;
+   }
+}
+
+STBV_TARGET_SSE2
+static void imdct_step3_inner_s_loop_sse2(int n, float *e, int i_off, int k_off, float *A, int a_off, int k0)
+{
+   int i;
+   __m128 c_hi = _mm_set_ps( A[0        ], A[0        ],  A[a_off    ], A[a_off    ]);
+   __m128 s_hi = _mm_set_ps(-A[1        ], A[1        ], -A[a_off  +1], A[a_off  +1]);
+   __m128 c_lo = _mm_set_ps( A[a_off*2  ], A[a_off*2  ],  A[a_off*3  ], A[a_off*3  ]);
+   __m128 s_lo = _mm_set_ps(-A[a_off*2+1], A[a_off*2+1], -A[a_off*3+1], A[a_off*3+1]);
+   float *ee0 = e  +i_off;
+   float *ee2 = ee0+k_off;
+
+   for (i=n; i > 0; --i) {
+      __m128 a_hi = _mm_loadu_ps(ee0-3), b_hi = _mm_loadu_ps(ee2-3);
+      __m128 a_lo = _mm_loadu_ps(ee0-7), b_lo = _mm_loadu_ps(ee2-7);
+      __m128 k_hi = _mm_sub_ps(a_hi, b_hi);
+      __m128 k_lo = _mm_sub_ps(a_lo, b_lo);
+      _mm_storeu_ps(ee0-3, _mm_add_ps(a_hi, b_hi));
+      _mm_storeu_ps(ee0-7, _mm_add_ps(a_lo, b_lo));
+      _mm_storeu_ps(ee2-3, _mm_add_ps(_mm_mul_ps(k_hi, c_hi), _mm_mul_ps(_mm_shuffle_ps(k_hi, k_hi, _MM_SHUFFLE(2,3,0,1)), s_hi)));
+      _mm_storeu_ps(ee2-7, _mm_add_ps(_mm_mul_ps(k_lo, c_lo), _mm_mul_ps(_mm_shuffle_ps(k_lo, k_lo, _MM_SHUFFLE(2,3,0,1)), s_lo)));
+      ee0 -= k0;
+      ee2 -= k0;
+   }
+}
+
+STBV_TARGET_AVX2
+static void imdct_step3_inner_r_loop_avx2(int lim, float *e, int d0, int k_off, float *A, int k1)
+{
+   int i;
+   float *e0 = e + d0;
+   float *e2 = e0 + k_off;
+
+   for (i=lim >> 2; i > 0; --i) {
+      __m256 a = _mm256_loadu_ps(e0-7), b = _mm256_loadu_ps(e2-7);
+      __m256 k = _mm256_sub_ps(a, b);
+      __m256 c = _mm256_set_ps( A[0], A[0],  A[k1  ], A[k1  ],  A[k1*2  ], A[k1*2  ],  A[k1*3  ], A[k1*3  ]);
+      __m256 s = _mm256_set_ps(-A[1], A[1], -A[k1+1], A[k1+1], -A[k1*2+1], A[k1*2+1], -A[k1*3+1], A[k1*3+1]);
+      _mm256_storeu_ps(e0-7, _mm256_add_ps(a, b));
+      _mm256_storeu_ps(e2-7, _mm256_add_ps(_mm256_mul_ps(k, c), _mm256_mul_ps(_mm256_permute_ps(k, _MM_SHUFFLE(2,3,0,1)), s)));
+      e0 -= 8;
+      e2 -= 8;
+      A += k1*4;
+   }
+}
+
+STBV_TARGET_AVX2
+static void imdct_step3_inner_s_loop_avx2(int n, float *e, int i_off, int k_off, float *A, int a_off, int k0)
+{
+   int i;
+   __m256 c = _mm256_set_ps( A[0], A[0],  A[a_off  ], A[a_off  ],  A[a_off*2  ], A[a_off*2  ],  A[a_off*3  ], A[a_off*3  ]);
+   __m256 s = _mm256_set_ps(-A[1], A[1], -A[a_off+1], A[a_off+1], -A[a_off*2+1], A[a_off*2+1], -A[a_off*3+1], A[a_off*3+1]);
+   float *ee0 = e  +i_off;
+   float *ee2 = ee0+k_off;
+
+   for (i=n; i > 0; --i) {
+      __m256 a = _mm256_loadu_ps(ee0-7), b = _mm256_loadu_ps(ee2-7);
+      __m256 k = _mm256_sub_ps(a, b);
+      _mm256_storeu_ps(ee0-7, _mm256_add_ps(a, b));
+      _mm256_storeu_ps(ee2-7, _mm256_add_ps(_mm256_mul_ps(k, c), _mm256_mul_ps(_mm256_permute_ps(k, _MM_SHUFFLE(2,3,0,1)), s)));
+      ee0 -= k0;
+      ee2 -= k0;
+   }
+}
+
+// overlap-add of the previous window's right half: out[j] = out[j]*w[j] + prev[j]*w[n-1-j]
+STBV_TARGET_SSE2
+static int window_overlap_add_sse2(float *out, const float *prev, const float *w, int n)
+{
+   int j;
+   for (j=0; j+4 <= n; j += 4) {
+      __m128 wr = _mm_loadu_ps(w + n-4-j);
+      wr = _mm_shuffle_ps(wr, wr, _MM_SHUFFLE(0,1,2,3));
+      _mm_storeu_ps(out+j, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(out+j), _mm_loadu_ps(w+j)),
+                                      _mm_mul_ps(_mm_loadu_ps(prev+j), wr)));
+   }
+   return j;
+}
+
+STBV_TARGET_AVX2
+static int window_overlap_add_avx2(float *out, const float *prev, const float *w, int n)
+{
+   int j;
+   for (j=0; j+8 <= n; j += 8) {
+      __m256 wr = _mm256_loadu_ps(w + n-8-j);
+      wr = _mm256_permute_ps(_mm256_permute2f128_ps(wr, wr, 1), _MM_SHUFFLE(0,1,2,3));
+      _mm256_storeu_ps(out+j, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(out+j), _mm256_loadu_ps(w+j)),
+                                            _mm256_mul_ps(_mm256_loadu_ps(prev+j), wr)));
+   }
+   return j;
+}
+#endif // STB_VORBIS_SIMD_X86
+
+// returns how many leading samples were handled; the caller finishes the tail
+static int window_overlap_add_simd(float *out, const float *prev, const float *w, int n)
+{
+   #ifdef STB_VORBIS_SIMD_X86
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) return window_overlap_add_avx2(out, prev, w, n);
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) return window_overlap_add_sse2(out, prev, w, n);
+   #else
+   STBV_NOTUSED(out); STBV_NOTUSED(prev); STBV_NOTUSED(w); STBV_NOTUSED(n);
+   #endif
+   return 0;
+}
+
 // the following were split out into separate functions while optimizing;
 // they could be pushed back up but eh. __forceinline showed no change;
 // they're probably already being inlined.
@@ -2412,6 +2738,11 @@ static void imdct_step3_iter0_loop(int n, float *e, int i_off, int k_off, float
    int i;
 
    assert((n & 3) == 0);
+   #ifdef STB_VORBIS_SIMD_X86
+   // iteration 0 is the r loop with a twiddle stride of 8
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) { imdct_step3_inner_r_loop_avx2(n, e, i_off, k_off, A, 8); return; }
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) { imdct_step3_inner_r_loop_sse2(n, e, i_off, k_off, A, 8); return; }
+   #endif
    for (i=(n>>2); i > 0; --i) {
       float k00_20, k01_21;
       k00_20  = ee0[ 0] - ee2[ 0];
@@ -2458,6 +2789,11 @@ static void imdct_step3_inner_r_loop(int lim, float *e, int d0, int k_off, float
    float *e0 = e + d0;
    float *e2 = e0 + k_off;
 
+   #ifdef STB_VORBIS_SIMD_X86
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) { imdct_step3_inner_r_loop_avx2(lim, e, d0, k_off, A, k1); return; }
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) { imdct_step3_inner_r_loop_sse2(lim, e, d0, k_off, A, k1); return; }
+   #endif
+
    for (i=lim >> 2; i > 0; --i) {
       k00_20 = e0[-0] - e2[-0];
       k01_21 = e0[-1] - e2[-1];
@@ -2517,6 +2853,11 @@ static void imdct_step3_inner_s_loop(int n, float *e, int i_off, int k_off, floa
    float *ee0 = e  +i_off;
    float *ee2 = ee0+k_off;
 
+   #ifdef STB_VORBIS_SIMD_X86
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) { imdct_step3_inner_s_loop_avx2(n, e, i_off, k_off, A, a_off, k0); return; }
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) { imdct_step3_inner_s_loop_sse2(n, e, i_off, k_off, A, a_off, k0); return; }
+   #endif
+
    for (i=n; i > 0; --i) {
       k00     = ee0[ 0] - ee2[ 0];
       k11     = ee0[-1] - ee2[-1];
@@ -3470,7 +3811,7 @@ static int vorbis_finish_frame(stb_vorbis *f, int len, int left, int right)
       float *w = get_window(f, n);
       if (w == NULL) return 0;
       for (i=0; i < f->channels; ++i) {
-         for (j=0; j < n; ++j)
+         for (j=window_overlap_add_simd(f->channel_buffers[i]+left, f->previous_window[i], w, n); j < n; ++j)
             f->channel_buffers[i][left+j] =
                f->channel_buffers[i][left+j]*w[    j] +
                f->previous_window[i][     j]*w[n-1-j];
@@ -3577,6 +3918,321 @@ static int is_whole_packet_present(stb_vorbis *f)
 }
 #endif // !STB_VORBIS_NO_PUSHDATA_API
 
+// the tables built from the setup header (plus the MDCT setup for the two
+// block sizes). vorbis_deinit frees them unless they belong to the cache.
+static void free_setup_tables(vorb *p)
+{
+   int i,j;
+
+   if (p->residue_config) {
+      for (i=0; i < p->residue_count; ++i) {
+         Residue *r = p->residue_config+i;
+         if (r->classdata) {
+            for (j=0; j < p->codebooks[r->classbook].entries; ++j)
+               setup_free(p, r->classdata[j]);
+            setup_free(p, r->classdata);
+         }
+         setup_free(p, r->residue_books);
+      }
+   }
+
+   if (p->codebooks) {
+      CHECK(p);
+      for (i=0; i < p->codebook_count; ++i) {
+         Codebook *c = p->codebooks + i;
+         setup_free(p, c->codeword_lengths);
+         setup_free(p, c->multiplicands);
+         setup_free(p, c->codewords);
+         setup_free(p, c->sorted_codewords);
+         // c->sorted_values[-1] is the first entry in the array
+         setup_free(p, c->sorted_values ? c->sorted_values-1 : NULL);
+      }
+      setup_free(p, p->codebooks);
+   }
+   setup_free(p, p->floor_config);
+   setup_free(p, p->residue_config);
+   if (p->mapping) {
+      for (i=0; i < p->mapping_count; ++i)
+         setup_free(p, p->mapping[i].chan);
+      setup_free(p, p->mapping);
+   }
+   for (i=0; i < 2; ++i) {
+      setup_free(p, p->A[i]);
+      setup_free(p, p->B[i]);
+      setup_free(p, p->C[i]);
+      setup_free(p, p->window[i]);
+      setup_free(p, p->bit_reverse[i]);
+   }
+}
+
+#ifdef STB_VORBIS_SETUP_CACHE
+
+#ifdef _MSC_VER
+   #include <intrin.h>
+   #define STBV_LOCK(l)     while (_InterlockedExchange(&(l), 1)) {}
+   #define STBV_UNLOCK(l)   _InterlockedExchange(&(l), 0)
+#else
+   #define STBV_LOCK(l)     while (__sync_lock_test_and_set(&(l), 1)) {}
+   #define STBV_UNLOCK(l)   __sync_lock_release(&(l))
+#endif
+
+typedef struct stbv__setup_entry
+{
+   struct stbv__setup_entry *next;
+   int len;
+   uint8 *packet;
+   vorb tables; // channels, block sizes and the setup tables
+} stbv__setup_entry;
+
+// entries are only added (at the head), until stb_vorbis_flush_setup_cache
+static stbv__setup_entry *stbv__setup_cache;
+static volatile long stbv__setup_lock;
+
+static void copy_setup_tables(vorb *dst, const vorb *src)
+{
+   int i;
+   dst->codebook_count = src->codebook_count;
+   dst->codebooks      = src->codebooks;
+   dst->floor_count    = src->floor_count;
+   dst->floor_config   = src->floor_config;
+   dst->residue_count  = src->residue_count;
+   dst->residue_config = src->residue_config;
+   dst->mapping_count  = src->mapping_count;
+   dst->mapping        = src->mapping;
+   dst->mode_count     = src->mode_count;
+   memcpy(dst->floor_types, src->floor_types, sizeof(dst->floor_types));
+   memcpy(dst->residue_types, src->residue_types, sizeof(dst->residue_types));
+   memcpy(dst->mode_config, src->mode_config, sizeof(dst->mode_config));
+   for (i=0; i < 2; ++i) {
+      dst->A[i] = src->A[i];
+      dst->B[i] = src->B[i];
+      dst->C[i] = src->C[i];
+      dst->window[i] = src->window[i];
+      dst->bit_reverse[i] = src->bit_reverse[i];
+   }
+}
+
+static int setup_entry_matches(stbv__setup_entry *e, vorb *f)
+{
+   return e->tables.channels == f->channels
+       && e->tables.blocksize_0 == f->blocksize_0
+       && e->tables.blocksize_1 == f->blocksize_1;
+}
+
+// called at the start of the setup packet. reads the packet and looks it
+// up; on a hit, f uses the cached tables and is left at the end of the
+// packet. on a miss, f is rewound to the start of the packet to build
+// the tables normally (on the heap), and keeps a copy of the packet for
+// setup_cache_insert.
+static int setup_cache_find(vorb *f)
+{
+   stb_vorbis saved;
+   unsigned int loc;
+   stbv__setup_entry *cand[STB_VORBIS_SETUP_CACHE_SIZE], *e;
+   uint8 *packet = NULL;
+   int n = 0, i, len = 0, size = 0, c;
+
+   if (IS_PUSH_MODE(f)) return FALSE;
+
+   // published entries never change, so once the head is read the list
+   // can be walked without the lock
+   STBV_LOCK(stbv__setup_lock);
+   e = stbv__setup_cache;
+   STBV_UNLOCK(stbv__setup_lock);
+   for (; e && n < STB_VORBIS_SETUP_CACHE_SIZE; e = e->next)
+      if (setup_entry_matches(e, f))
+         cand[n++] = e;
+
+   saved = *f;
+   loc = stb_vorbis_get_file_offset(f);
+
+   // compare the packet with the candidates as it is read, so a hit
+   // allocates nothing
+   if (n) {
+      while ((c = get8_packet(f)) != EOP) {
+         for (i=0; i < n; )
+            if (len < cand[i]->len && cand[i]->packet[len] == c) ++i;
+            else cand[i] = cand[--n];
+         if (!n) break;
+         ++len;
+      }
+      for (i=0; i < n; ++i) {
+         if (cand[i]->len == len) {
+            copy_setup_tables(f, &cand[i]->tables);
+            f->setup_shared = cand[i];
+            return TRUE;
+         }
+      }
+      *f = saved;
+      set_file_offset(f, loc);
+      len = 0;
+   }
+
+   while ((c = get8_packet(f)) != EOP) {
+      if (len == size) {
+         uint8 *grown = (uint8 *) realloc(packet, size = size ? size*2 : 4096);
+         if (!grown) { free(packet); packet = NULL; break; }
+         packet = grown;
+      }
+      packet[len++] = (uint8) c;
+   }
+
+   *f = saved;
+   set_file_offset(f, loc);
+   f->setup_packet = packet;
+   f->setup_packet_len = len;
+   f->tables_on_heap = f->setup_on_heap = TRUE;
+   return FALSE;
+}
+
+// called once f has built its own tables after a miss: hand them to a new
+// cache entry, unless the cache is full (or another thread got there first)
+static void setup_cache_insert(vorb *f)
+{
+   stbv__setup_entry *e, *n;
+   int count = 0;
+
+   if (!f->setup_packet) return;
+   e = (stbv__setup_entry *) malloc(sizeof(*e));
+   if (!e) return;
+   memset(e, 0, sizeof(*e));
+   e->len = f->setup_packet_len;
+   e->packet = f->setup_packet;
+   e->tables.channels = f->channels;
+   e->tables.blocksize_0 = f->blocksize_0;
+   e->tables.blocksize_1 = f->blocksize_1;
+   copy_setup_tables(&e->tables, f);
+
+   STBV_LOCK(stbv__setup_lock);
+   for (n = stbv__setup_cache; n; n = n->next, ++count)
+      if (setup_entry_matches(n, f) && n->len == e->len && !memcmp(n->packet, e->packet, e->len))
+         break;
+   if (!n && count < STB_VORBIS_SETUP_CACHE_SIZE) {
+      e->next = stbv__setup_cache;
+      stbv__setup_cache = e;
+      f->setup_shared = e;
+      f->setup_packet = NULL;
+      e = NULL;
+   }
+   STBV_UNLOCK(stbv__setup_lock);
+
+   free(e);
+}
+
+void stb_vorbis_flush_setup_cache(void)
+{
+   stbv__setup_entry *e, *next;
+   STBV_LOCK(stbv__setup_lock);
+   e = stbv__setup_cache;
+   stbv__setup_cache = NULL;
+   STBV_UNLOCK(stbv__setup_lock);
+   for (; e; e = next) {
+      next = e->next;
+      free_setup_tables(&e->tables);
+      free(e->packet);
+      free(e);
+   }
+}
+
+#else // STB_VORBIS_SETUP_CACHE
+
+void stb_vorbis_flush_setup_cache(void)
+{
+}
+
+#endif // STB_VORBIS_SETUP_CACHE
+
+// reads the vendor string and user comments, after the packet type and
+// "vorbis". comment_list_length counts only the comments actually read, so
+// a failure part way leaves nothing for vorbis_deinit to trip over.
+static int parse_comments(vorb *f)
+{
+   int len, n, i, j;
+
+   //file vendor
+   len = get32_packet(f);
+   f->vendor = (char*)setup_malloc(f, sizeof(char) * (len+1));
+   if (f->vendor == NULL)                           return error(f, VORBIS_outofmem);
+   for(i=0; i < len; ++i) {
+      f->vendor[i] = get8_packet(f);
+   }
+   f->vendor[len] = (char)'\0';
+   //user comments
+   n = get32_packet(f);
+   f->comment_list_length = 0;
+   f->comment_list = NULL;
+   if (n > 0)
+   {
+      f->comment_list = (char**) setup_malloc(f, sizeof(char*) * n);
+      if (f->comment_list == NULL)                  return error(f, VORBIS_outofmem);
+   }
+
+   for(i=0; i < n; ++i) {
+      len = get32_packet(f);
+      f->comment_list[i] = (char*)setup_malloc(f, sizeof(char) * (len+1));
+      if (f->comment_list[i] == NULL)               return error(f, VORBIS_outofmem);
+      f->comment_list_length = i+1;
+
+      for(j=0; j < len; ++j) {
+         f->comment_list[i][j] = get8_packet(f);
+      }
+      f->comment_list[i][len] = (char)'\0';
+   }
+
+   // framing_flag
+   if (!(get8_packet(f) & 1))                       return error(f, VORBIS_invalid_setup);
+   return TRUE;
+}
+
+static void free_comments(vorb *f)
+{
+   int i;
+   setup_free(f, f->vendor);
+   for (i=0; i < f->comment_list_length; ++i) {
+      setup_free(f, f->comment_list[i]);
+   }
+   setup_free(f, f->comment_list);
+   f->vendor = NULL;
+   f->comment_list = NULL;
+   f->comment_list_length = 0;
+}
+
+#ifdef STB_VORBIS_LAZY_COMMENTS
+// parses the comment header skipped by start_decoder, then puts the
+// decoder back exactly where it was. on failure the comments stay empty.
+static void load_comments(vorb *f)
+{
+   stb_vorbis saved;
+   unsigned int loc;
+   uint8 header[6];
+   int i, ok;
+
+   if (!f->comments_pending) return;
+   f->comments_pending = FALSE;
+   saved = *f;
+   loc = stb_vorbis_get_file_offset(f);
+
+   ok = set_file_offset(f, f->comment_offset) && start_page(f) && start_packet(f)
+     && next_segment(f) && get8_packet(f) == VORBIS_packet_comment;
+   for (i=0; ok && i < 6; ++i) header[i] = get8_packet(f);
+   ok = ok && vorbis_validate(header) && parse_comments(f);
+   // with an alloc buffer, the comments must not eat the decoder's temp memory
+   if (ok && f->alloc.alloc_buffer && f->setup_offset + (int) f->temp_memory_required > f->temp_offset)
+      ok = FALSE;
+   if (!ok) {
+      free_comments(f);
+      f->setup_offset = saved.setup_offset;
+   }
+
+   set_file_offset(f, loc);
+   saved.vendor = f->vendor;
+   saved.comment_list = f->comment_list;
+   saved.comment_list_length = f->comment_list_length;
+   saved.setup_offset = f->setup_offset;
+   *f = saved;
+}
+#endif
+
 static int start_decoder(vorb *f)
 {
    uint8 header[6], x,y;
@@ -3639,6 +4295,9 @@ static int start_decoder(vorb *f)
    if (!(x & 1))                                    return error(f, VORBIS_invalid_first_page);
 
    // second packet!
+   #ifdef STB_VORBIS_LAZY_COMMENTS
+   f->comment_offset = stb_vorbis_get_file_offset(f);
+   #endif
    if (!start_page(f))                              return FALSE;
 
    if (!start_packet(f))                            return FALSE;
@@ -3648,37 +4307,13 @@ static int start_decoder(vorb *f)
    if (get8_packet(f) != VORBIS_packet_comment)            return error(f, VORBIS_invalid_setup);
    for (i=0; i < 6; ++i) header[i] = get8_packet(f);
    if (!vorbis_validate(header))                    return error(f, VORBIS_invalid_setup);
-   //file vendor
-   len = get32_packet(f);
-   f->vendor = (char*)setup_malloc(f, sizeof(char) * (len+1));
-   if (f->vendor == NULL)                           return error(f, VORBIS_outofmem);
-   for(i=0; i < len; ++i) {
-      f->vendor[i] = get8_packet(f);
-   }
-   f->vendor[len] = (char)'\0';
-   //user comments
-   f->comment_list_length = get32_packet(f);
-   f->comment_list = NULL;
-   if (f->comment_list_length > 0)
-   {
-      f->comment_list = (char**) setup_malloc(f, sizeof(char*) * (f->comment_list_length));
-      if (f->comment_list == NULL)                  return error(f, VORBIS_outofmem);
-   }
 
-   for(i=0; i < f->comment_list_length; ++i) {
-      len = get32_packet(f);
-      f->comment_list[i] = (char*)setup_malloc(f, sizeof(char) * (len+1));
-      if (f->comment_list[i] == NULL)               return error(f, VORBIS_outofmem);
-
-      for(j=0; j < len; ++j) {
-         f->comment_list[i][j] = get8_packet(f);
-      }
-      f->comment_list[i][len] = (char)'\0';
-   }
-
-   // framing_flag
-   x = get8_packet(f);
-   if (!(x & 1))                                    return error(f, VORBIS_invalid_setup);
+   #ifdef STB_VORBIS_LAZY_COMMENTS
+   if (!IS_PUSH_MODE(f))
+      f->comments_pending = TRUE; // skip the rest; see load_comments
+   else
+   #endif
+   if (!parse_comments(f))                          return FALSE;
 
 
    skip(f, f->bytes_in_seg);
@@ -3705,6 +4340,16 @@ static int start_decoder(vorb *f)
    #endif
 
    crc32_init(); // always init it, to avoid multithread race conditions
+   stbv_simd_init(); // same here
+
+   #ifdef STB_VORBIS_SETUP_CACHE
+   if (setup_cache_find(f)) {
+      for (i=0; i < f->floor_count; ++i)
+         if (f->floor_config[i].floor1.values > longest_floorlist)
+            longest_floorlist = f->floor_config[i].floor1.values;
+      goto setup_built;
+   }
+   #endif
 
    if (get8_packet(f) != VORBIS_packet_setup)       return error(f, VORBIS_invalid_setup);
    for (i=0; i < 6; ++i) header[i] = get8_packet(f);
@@ -4124,6 +4769,10 @@ static int start_decoder(vorb *f)
       if (m->mapping >= f->mapping_count)     return error(f, VORBIS_invalid_setup);
    }
 
+#ifdef STB_VORBIS_SETUP_CACHE
+  setup_built:
+   f->setup_on_heap = FALSE;
+#endif
    flush_packet(f);
 
    f->previous_length = 0;
@@ -4140,8 +4789,20 @@ static int start_decoder(vorb *f)
       #endif
    }
 
-   if (!init_blocksize(f, 0, f->blocksize_0)) return FALSE;
-   if (!init_blocksize(f, 1, f->blocksize_1)) return FALSE;
+   #ifdef STB_VORBIS_SETUP_CACHE
+   if (!f->setup_shared)
+   #endif
+   {
+      #ifdef STB_VORBIS_SETUP_CACHE
+      f->setup_on_heap = f->tables_on_heap;
+      #endif
+      if (!init_blocksize(f, 0, f->blocksize_0)) return FALSE;
+      if (!init_blocksize(f, 1, f->blocksize_1)) return FALSE;
+      #ifdef STB_VORBIS_SETUP_CACHE
+      f->setup_on_heap = FALSE;
+      setup_cache_insert(f);
+      #endif
+   }
    f->blocksize[0] = f->blocksize_0;
    f->blocksize[1] = f->blocksize_1;
 
@@ -4207,46 +4868,22 @@ static int start_decoder(vorb *f)
 
 static void vorbis_deinit(stb_vorbis *p)
 {
-   int i,j;
-
-   setup_free(p, p->vendor);
-   for (i=0; i < p->comment_list_length; ++i) {
-      setup_free(p, p->comment_list[i]);
-   }
-   setup_free(p, p->comment_list);
+   int i;
 
-   if (p->residue_config) {
-      for (i=0; i < p->residue_count; ++i) {
-         Residue *r = p->residue_config+i;
-         if (r->classdata) {
-            for (j=0; j < p->codebooks[r->classbook].entries; ++j)
-               setup_free(p, r->classdata[j]);
-            setup_free(p, r->classdata);
-         }
-         setup_free(p, r->residue_books);
-      }
-   }
+   #ifdef STB_VORBIS_SETUP_CACHE
+   p->setup_on_heap = FALSE; // still set if the setup failed part way
+   #endif
+   free_comments(p);
 
-   if (p->codebooks) {
-      CHECK(p);
-      for (i=0; i < p->codebook_count; ++i) {
-         Codebook *c = p->codebooks + i;
-         setup_free(p, c->codeword_lengths);
-         setup_free(p, c->multiplicands);
-         setup_free(p, c->codewords);
-         setup_free(p, c->sorted_codewords);
-         // c->sorted_values[-1] is the first entry in the array
-         setup_free(p, c->sorted_values ? c->sorted_values-1 : NULL);
-      }
-      setup_free(p, p->codebooks);
-   }
-   setup_free(p, p->floor_config);
-   setup_free(p, p->residue_config);
-   if (p->mapping) {
-      for (i=0; i < p->mapping_count; ++i)
-         setup_free(p, p->mapping[i].chan);
-      setup_free(p, p->mapping);
-   }
+   #ifdef STB_VORBIS_SETUP_CACHE
+   free(p->setup_packet);
+   p->setup_on_heap = p->tables_on_heap;
+   if (!p->setup_shared)
+   #endif
+   free_setup_tables(p);
+   #ifdef STB_VORBIS_SETUP_CACHE
+   p->setup_on_heap = FALSE;
+   #endif
    CHECK(p);
    for (i=0; i < p->channels && i < STB_VORBIS_MAX_CHANNELS; ++i) {
       setup_free(p, p->channel_buffers[i]);
@@ -4256,13 +4893,6 @@ static void vorbis_deinit(stb_vorbis *p)
       #endif
       setup_free(p, p->finalY[i]);
    }
-   for (i=0; i < 2; ++i) {
-      setup_free(p, p->A[i]);
-      setup_free(p, p->B[i]);
-      setup_free(p, p->C[i]);
-      setup_free(p, p->window[i]);
-      setup_free(p, p->bit_reverse[i]);
-   }
    #ifndef STB_VORBIS_NO_STDIO
    if (p->close_on_free) fclose(p->f);
    #endif
@@ -4317,6 +4947,9 @@ stb_vorbis_info stb_vorbis_get_info(stb_vorbis *f)
 stb_vorbis_comment stb_vorbis_get_comment(stb_vorbis *f)
 {
    stb_vorbis_comment d;
+   #ifdef STB_VORBIS_LAZY_COMMENTS
+   load_comments(f);
+   #endif
    d.vendor = f->vendor;
    d.comment_list_length = f->comment_list_length;
    d.comment_list = f->comment_list;
@@ -4739,6 +5372,38 @@ static int seek_to_sample_coarse(stb_vorbis *f, uint32 sample_number)
       return 0;
    }
 
+   // with a page index, bound the search by the entries either side of the
+   // target; each is verified by reading its page header, and only taken
+   // if it keeps left.page_end <= right.page_start
+   if (f->seek_index_count > 0) {
+      int lo = 0, hi = f->seek_index_count;
+      while (lo < hi) {
+         int m = (lo + hi) >> 1;
+         if (f->seek_index[m].last_sample <= last_sample_limit)
+            lo = m + 1;
+         else
+            hi = m;
+      }
+      if (lo > 0 && f->seek_index[lo-1].page_offset > left.page_start
+                 && f->seek_index[lo-1].page_offset < right.page_start) {
+         set_file_offset(f, f->seek_index[lo-1].page_offset);
+         if (get_seek_page_info(f, &mid) && mid.last_decoded_sample != ~0U
+                                         && mid.last_decoded_sample <= last_sample_limit
+                                         && mid.page_end <= right.page_start)
+            left = mid;
+      }
+      if (lo < f->seek_index_count && f->seek_index[lo].page_offset > left.page_start
+                                   && f->seek_index[lo].page_offset < right.page_start) {
+         set_file_offset(f, f->seek_index[lo].page_offset);
+         if (get_seek_page_info(f, &mid) && mid.last_decoded_sample != ~0U
+                                         && mid.last_decoded_sample > last_sample_limit
+                                         && mid.page_start >= left.page_end)
+            right = mid;
+      }
+      // the interpolation probes don't help within an index span
+      probe = 2;
+   }
+
    while (left.page_end != right.page_start) {
       assert(left.page_end < right.page_start);
       // search range in bytes
@@ -4943,6 +5608,12 @@ int stb_vorbis_seek_start(stb_vorbis *f)
    return vorbis_pump_first_frame(f);
 }
 
+void stb_vorbis_set_seek_index(stb_vorbis *f, const stb_vorbis_seek_point *points, int count)
+{
+   f->seek_index = points;
+   f->seek_index_count = points ? count : 0;
+}
+
 unsigned int stb_vorbis_stream_length_in_samples(stb_vorbis *f)
 {
    unsigned int restore_offset, previous_safe;
@@ -5162,11 +5833,96 @@ static int8 channel_position[7][6] =
    #define FASTDEF(x)
 #endif
 
+#ifdef STB_VORBIS_SIMD_X86
+// 4/8 floats -> int32 with exactly the rounding of FAST_SCALED_FLOAT_TO_INT(,,15);
+// packs_epi32 then saturates the same way the scalar clamp does
+#ifndef STB_VORBIS_NO_FAST_SCALED_FLOAT
+   #define STBV_SSE2_F2I(x)  _mm_sub_epi32(_mm_castps_si128(_mm_add_ps((x), _mm_set1_ps(MAGIC(15)))), _mm_set1_epi32(ADDEND(15)))
+   #define STBV_AVX2_F2I(x)  _mm256_sub_epi32(_mm256_castps_si256(_mm256_add_ps((x), _mm256_set1_ps(MAGIC(15)))), _mm256_set1_epi32(ADDEND(15)))
+#else
+   #define STBV_SSE2_F2I(x)  _mm_cvttps_epi32(_mm_mul_ps((x), _mm_set1_ps(32768.0f)))
+   #define STBV_AVX2_F2I(x)  _mm256_cvttps_epi32(_mm256_mul_ps((x), _mm256_set1_ps(32768.0f)))
+#endif
+
+STBV_TARGET_SSE2
+static int copy_samples_sse2(short *dest, const float *src, int len)
+{
+   int i;
+   for (i=0; i+8 <= len; i += 8) {
+      __m128i a = STBV_SSE2_F2I(_mm_loadu_ps(src+i));
+      __m128i b = STBV_SSE2_F2I(_mm_loadu_ps(src+i+4));
+      _mm_storeu_si128((__m128i *) (dest+i), _mm_packs_epi32(a, b));
+   }
+   return i;
+}
+
+STBV_TARGET_AVX2
+static int copy_samples_avx2(short *dest, const float *src, int len)
+{
+   int i;
+   for (i=0; i+16 <= len; i += 16) {
+      __m256i a = STBV_AVX2_F2I(_mm256_loadu_ps(src+i));
+      __m256i b = STBV_AVX2_F2I(_mm256_loadu_ps(src+i+8));
+      // packs works per 128-bit lane: a0-3 b0-3 a4-7 b4-7
+      _mm256_storeu_si256((__m256i *) (dest+i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3,1,2,0)));
+   }
+   return i;
+}
+
+STBV_TARGET_SSE2
+static int interleave_stereo_sse2(short *dest, const float *left, const float *right, int len)
+{
+   int i;
+   for (i=0; i+4 <= len; i += 4) {
+      __m128i l = STBV_SSE2_F2I(_mm_loadu_ps(left+i));
+      __m128i r = STBV_SSE2_F2I(_mm_loadu_ps(right+i));
+      _mm_storeu_si128((__m128i *) (dest+i*2), _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+   }
+   return i;
+}
+
+STBV_TARGET_AVX2
+static int interleave_stereo_avx2(short *dest, const float *left, const float *right, int len)
+{
+   int i;
+   for (i=0; i+8 <= len; i += 8) {
+      __m256i l = STBV_AVX2_F2I(_mm256_loadu_ps(left+i));
+      __m256i r = STBV_AVX2_F2I(_mm256_loadu_ps(right+i));
+      // per-lane unpack + per-lane pack lands back in sample order
+      _mm256_storeu_si256((__m256i *) (dest+i*2), _mm256_packs_epi32(_mm256_unpacklo_epi32(l, r), _mm256_unpackhi_epi32(l, r)));
+   }
+   return i;
+}
+#endif // STB_VORBIS_SIMD_X86
+
+// these return how many leading samples were converted; callers finish the tail
+static int copy_samples_simd(short *dest, const float *src, int len)
+{
+   #ifdef STB_VORBIS_SIMD_X86
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) return copy_samples_avx2(dest, src, len);
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) return copy_samples_sse2(dest, src, len);
+   #else
+   STBV_NOTUSED(dest); STBV_NOTUSED(src); STBV_NOTUSED(len);
+   #endif
+   return 0;
+}
+
+static int interleave_stereo_simd(short *dest, const float *left, const float *right, int len)
+{
+   #ifdef STB_VORBIS_SIMD_X86
+   if (stbv_simd_level >= STB_VORBIS_SIMD_AVX2) return interleave_stereo_avx2(dest, left, right, len);
+   if (stbv_simd_level >= STB_VORBIS_SIMD_SSE2) return interleave_stereo_sse2(dest, left, right, len);
+   #else
+   STBV_NOTUSED(dest); STBV_NOTUSED(left); STBV_NOTUSED(right); STBV_NOTUSED(len);
+   #endif
+   return 0;
+}
+
 static void copy_samples(short *dest, float *src, int len)
 {
    int i;
    check_endianness();
-   for (i=0; i < len; ++i) {
+   for (i=copy_samples_simd(dest, src, len); i < len; ++i) {
       FASTDEF(temp);
       int v = FAST_SCALED_FLOAT_TO_INT(temp, src[i],15);
       if ((unsigned int) (v + 32768) > 65535)
@@ -5277,8 +6033,12 @@ static void convert_channels_short_interleaved(int buf_c, short *buffer, int dat
          compute_stereo_samples(buffer, data_c, data, d_offset, len);
    } else {
       int limit = buf_c < data_c ? buf_c : data_c;
-      int j;
-      for (j=0; j < len; ++j) {
+      int j = 0;
+      if (buf_c == 2 && limit == 2) {
+         j = interleave_stereo_simd(buffer, data[0]+d_offset, data[1]+d_offset, len);
+         buffer += j*2;
+      }
+      for (   ; j < len; ++j) {
          for (i=0; i < limit; ++i) {
             FASTDEF(temp);
             float f = data[i][d_offset+j];
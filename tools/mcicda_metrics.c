@@ -0,0 +1,87 @@
+/*
+ * mcicda_metrics - print the live metrics page published by mcicda.dll.
+ *
+ * Usage: mcicda_metrics [path]
+ *
+ * The default path is C:\mcicda_metrics.bin. From the Linux/macOS host,
+ * point it at the file inside the Wine prefix instead, e.g.
+ *   mcicda_metrics ~/.wine/drive_c/mcicda_metrics.bin
+ *
+ * Builds with any C compiler: cc -I.. -o mcicda_metrics mcicda_metrics.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define sleep_ms(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#define sleep_ms(ms) usleep((ms) * 1000)
+#endif
+
+#include "mcicda_metrics.h"
+
+static const char* g_commandNames[MCICDA_CMD_COUNT] = {
+    "open", "close", "play", "stop", "pause", "resume", "seek", "status", "set", "info", "other"
+};
+
+static const char* g_modeNames[] = { "stopped", "playing", "paused" };
+
+static int ReadMetrics(const char* path, McicdaMetrics* m)
+{
+    FILE* f = fopen(path, "rb");
+    size_t got;
+
+    if (!f) return 0;
+    got = fread(m, 1, sizeof(*m), f);
+    fclose(f);
+    return got == sizeof(*m) && m->magic == MCICDA_METRICS_MAGIC &&
+           m->version == MCICDA_METRICS_VERSION && m->size == sizeof(*m);
+}
+
+static void PrintMetrics(const McicdaMetrics* m)
+{
+    unsigned int lookups = m->cacheHits + m->cacheMisses;
+    int i;
+
+    printf("track %02u %-7s  pos %6.1f s  queued %4u ms (depth %u)  decoded %6.1f s at %u.%02ux\n",
+           m->currentTrack, m->playing < 3 ? g_modeNames[m->playing] : "?",
+           m->positionMs / 1000.0, m->queuedMs, m->queueDepth,
+           m->decodedMs / 1000.0, m->decodeSpeedX100 / 100, m->decodeSpeedX100 % 100);
+    printf("underruns %u  late refills %u  cache %u/%u hits (%u%%)  resident %.1f MB\n",
+           m->underruns, m->lateRefills, m->cacheHits, lookups,
+           lookups ? m->cacheHits * 100 / lookups : 0, m->bytesResident / (1024.0 * 1024.0));
+
+    printf("latency (us)  ");
+    for (i = 0; i < MCICDA_CMD_COUNT; i++) {
+        const McicdaCommandLatency* c = &m->commands[i];
+        if (c->count)
+            printf(" %s %u/%u/%u", g_commandNames[i], c->lastUs, c->totalUs / c->count, c->maxUs);
+    }
+    printf("   (last/avg/max)\n\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : MCICDA_METRICS_FILE;
+    McicdaMetrics m;
+    unsigned int lastUpdates = 0;
+    int waiting = 0;
+
+    for (;;) {
+        if (!ReadMetrics(path, &m)) {
+            if (!waiting)
+                fprintf(stderr, "Waiting for %s (set Metrics=1 in mcicda.ini)...\n", path);
+            waiting = 1;
+        } else if (m.updates != lastUpdates) {
+            lastUpdates = m.updates;
+            waiting = 0;
+            PrintMetrics(&m);
+        }
+        sleep_ms(500);
+    }
+    return 0;
+}